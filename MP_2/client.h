@@ -97,6 +97,7 @@ void IClient::displayTitle() const
     std::cout << " UNFOLLOW <username>\n";
     std::cout << " LIST\n";
     std::cout << " TIMELINE\n";
+    std::cout << " HISTORY\n";
     std::cout << "=====================================\n";
 }
 
@@ -118,7 +119,7 @@ std::string IClient::getCommand() const
 			input = cmd + " " + argument;
 		} else {
 			toUpperCase(input);
-			if (input != "LIST" && input != "TIMELINE") {
+			if (input != "LIST" && input != "TIMELINE" && input != "HISTORY") {
 				std::cout << "Invalid Command\n";
 				continue;
 			}
@@ -0,0 +1,80 @@
+#include <iostream>
+#include <memory>
+#include <string>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "storage.h"
+
+// Copy a data folder from one storage backend to the other
+//
+//   ./storage_convert -f json -t binary [-d folder]
+int main(int argc, char** argv) {
+
+  std::string from = "json";
+  std::string to = "binary";
+  std::string folder = ".";
+  int opt = 0;
+  while ((opt = getopt(argc, argv, "f:t:d:")) != -1){
+    switch(opt) {
+      case 'f':
+          from = optarg;
+          break;
+      case 't':
+          to = optarg;
+          break;
+      case 'd':
+          folder = optarg;
+          break;
+      default:
+	         std::cerr << "Invalid Command Line Argument\n";
+    }
+  }
+
+  std::unique_ptr<Storage> src(MakeStorage(from, folder, "data.json", "data.json"));
+  std::unique_ptr<Storage> dst(MakeStorage(to, folder, "data.json", "data.json"));
+  if (!src || !dst || from == to) {
+    std::cerr << "Usage: storage_convert -f json|binary -t binary|json [-d folder]\n";
+    return -1;
+  }
+  if (!src->Exists()) {
+    std::cerr << "No " << from << " data in " << folder << "\n";
+    return -1;
+  }
+  if (dst->Exists()) {
+    std::cerr << folder << " already has " << to << " data - remove it first\n";
+    return -1;
+  }
+  if (!src->Init() || !dst->Init()) {
+    return -1;
+  }
+
+  int users = 0;
+  int follows = 0;
+  int posts = 0;
+
+  src->LoadGraph(
+    [&](const std::string& username) {
+      dst->CreateUser(username);
+      users++;
+    },
+    [&](const std::string& username, const std::string& following, int64_t timestamp) {
+      dst->Follow(username, following, timestamp);
+      follows++;
+    });
+
+  bool ok = true;
+  src->ScanPosts([&](const StoredPost& post) {
+    ok = dst->AppendPost(post);
+    posts += ok;
+    return ok;
+  });
+  if (!ok) {
+    std::cerr << "Could not write post " << posts + 1 << "\n";
+    return -1;
+  }
+
+  std::cout << "Converted " << users << " users, " << follows << " follows, "
+            << posts << " posts from " << from << " to " << to << "\n";
+  return 0;
+}
@@ -0,0 +1,124 @@
+#include <chrono>
+#include <ctime>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "sns.pb.h"
+#include "timeline_batch.h"
+
+using csce438::Message;
+using csce438::MessageBatch;
+
+// Every gRPC message on the wire has a 5 byte prefix (flag + length)
+const size_t grpc_frame_overhead = 5;
+
+struct Result
+{
+    size_t bytes = 0;
+    size_t writes = 0;
+    double seconds = 0;
+};
+
+// Timeline - one Message per post, one write per Message
+Result PerMessage(const std::vector<Message>& posts)
+{
+    Result r;
+    std::string wire;
+    auto start = std::chrono::steady_clock::now();
+    for (const Message& m : posts) {
+        Message send;
+        send.set_username(m.username());
+        send.set_msg(m.msg());
+        google::protobuf::Timestamp* timestamp = new google::protobuf::Timestamp();
+        timestamp->set_seconds(m.timestamp().seconds());
+        timestamp->set_nanos(m.timestamp().nanos());
+        send.set_allocated_timestamp(timestamp);
+
+        send.SerializeToString(&wire);
+        r.bytes += wire.size() + grpc_frame_overhead;
+        r.writes++;
+    }
+    r.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return r;
+}
+
+// TimelineBatch - up to batch_size posts coalesced into one MessageBatch
+Result Batched(const std::vector<Message>& posts, int batch_size)
+{
+    Result r;
+    std::string wire;
+    BatchEncoder encoder;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < posts.size(); i += batch_size) {
+        MessageBatch batch;
+        for (size_t j = i; j < posts.size() && j < i + batch_size; j++) {
+            encoder.Add(posts[j], &batch);
+        }
+
+        batch.SerializeToString(&wire);
+        r.bytes += wire.size() + grpc_frame_overhead;
+        r.writes++;
+    }
+    r.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return r;
+}
+
+void Print(const std::string& name, const Result& r, size_t posts)
+{
+    std::cout << name
+              << "  writes " << r.writes
+              << "  bytes " << r.bytes
+              << "  bytes/post " << (double)r.bytes / posts
+              << "  ns/post " << r.seconds * 1e9 / posts << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    int num_posts = 100000;
+    int num_authors = 50;
+    int batch_size = 16;
+    int msg_len = 64;
+
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "n:a:b:l:")) != -1){
+        switch(opt) {
+            case 'n':
+                num_posts = atoi(optarg);break;
+            case 'a':
+                num_authors = atoi(optarg);break;
+            case 'b':
+                batch_size = atoi(optarg);break;
+            case 'l':
+                msg_len = atoi(optarg);break;
+            default:
+                std::cerr << "Invalid Command Line Argument\n";
+        }
+    }
+    if (num_posts <= 0 || num_authors <= 0 || batch_size <= 0 || msg_len < 0) {
+        std::cerr << "Arguments must be positive\n";
+        return -1;
+    }
+
+    // Posts a few hundred ms apart from a fixed set of authors
+    std::vector<Message> posts;
+    int64_t nanos = (int64_t)time(NULL) * 1000000000LL;
+    srand(438);
+    for (int i = 0; i < num_posts; i++) {
+        Message m;
+        m.set_username("user" + std::to_string(rand() % num_authors));
+        m.set_msg(std::string(msg_len, 'a' + (i % 26)));
+        nanos += (rand() % 500) * 1000000LL;
+        NanosToTimestamp(nanos, m.mutable_timestamp());
+        posts.push_back(m);
+    }
+
+    std::cout << num_posts << " posts, " << num_authors << " authors, "
+              << msg_len << " byte messages, batch size " << batch_size << std::endl;
+    Print("Timeline     ", PerMessage(posts), posts.size());
+    Print("TimelineBatch", Batched(posts, batch_size), posts.size());
+
+    return 0;
+}
@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <future>
 #include <iostream>
 #include <string>
 #include <unistd.h>
@@ -7,19 +9,58 @@
 #include "client.h"
 
 #include "sns.grpc.pb.h"
+#include "timeline_batch.h"
+#include "timeline_cache.h"
 
 using google::protobuf::Timestamp;
 using grpc::ClientContext;
 using grpc::ClientReaderWriter;
 using grpc::Status;
 using csce438::Message;
+using csce438::MessageBatch;
+using csce438::PageCursor;
 using csce438::Request;
 using csce438::Reply;
 using csce438::SNSService;
+using csce438::TimelinePage;
+using csce438::TimelinePageRequest;
 
 std::string hostname = "localhost";
 std::string username = "default";
 std::string port = "3010";
+bool batched = false;
+
+// Posts per HISTORY page
+const int history_page_size = 20;
+
+// Users per LIST page
+const int list_page_size = 1000;
+
+// Posts seen in timeline mode, kept between runs
+std::string CachePath() {
+    return "timeline-" + username + ".cache";
+}
+
+// Show the newest cached posts in the order the INIT history would come in,
+// and ask the server in init for only the ones missing
+void ResumeFromCache(TimelineCache& cache, bool newest_first, Message* init) {
+    const std::vector<Message>& cached = cache.Load();
+    size_t shown = std::min(cached.size(), (size_t)history_page_size);
+    for (size_t i = 0; i < shown; i++) {
+        const Message& msg = newest_first ? cached[cached.size() - 1 - i] : cached[cached.size() - shown + i];
+        time_t time = msg.timestamp().seconds();
+        displayPostMessage(msg.username(), msg.msg(), time);
+    }
+    if (!cache.Resume(init->mutable_resume())) {
+        // Nothing cached - ask for the full history
+        init->clear_resume();
+    }
+}
+
+struct PageResult {
+    Status status;
+    TimelinePage page;
+};
 
 class Client : public IClient
 {
@@ -34,6 +75,11 @@ class Client : public IClient
         virtual IReply processCommand(std::string& input);
         virtual void processTimeline();
     private:
+        void processTimelineBatch();
+        IReply List();
+        IReply History();
+        std::future<PageResult> FetchPage(const PageCursor* cursor);
+
         std::string hostname;
         std::string username;
         std::string port;
@@ -41,6 +87,14 @@ class Client : public IClient
         // You can have an instance of the client stub
         // as a member variable.
         std::unique_ptr<SNSService::Stub> stub_;
+
+        // Next HISTORY page, requested while the current one is shown
+        std::future<PageResult> next_page_;
+
+        // Last complete LIST, and its version to send with the next one
+        std::vector<std::string> known_users_;
+        std::vector<std::string> known_following_;
+        std::string known_version_;
 };
 
 // Signal the server that the client has SIGINTed
@@ -64,7 +118,7 @@ void sig_handler(int sig) {
 int main(int argc, char** argv) {
  
     int opt = 0;
-    while ((opt = getopt(argc, argv, "h:u:p:")) != -1){
+    while ((opt = getopt(argc, argv, "h:u:p:b")) != -1){
         switch(opt) {
             case 'h':
                 hostname = optarg;break;
@@ -72,6 +126,8 @@ int main(int argc, char** argv) {
                 username = optarg;break;
             case 'p':
                 port = optarg;break;
+            case 'b':
+                batched = true;break;
             default:
                 std::cerr << "Invalid Command Line Argument\n";
         }
@@ -248,25 +304,14 @@ IReply Client::processCommand(std::string& input) {
         request.set_username(username);
         
         if (input.compare("LIST") == 0) {
-            Status status = stub_->List(&ctx, request, &reply);
-            ireply.grpc_status = status;
-
-            // Add users to ireply
-            for (std::string uname : reply.all_users()) {
-                ireply.all_users.push_back(uname);
-            }
-            
-            // Add following to ireply
-            for (std::string uname : reply.following_users()) {
-                ireply.following_users.push_back(uname);
-            }
-
-            ireply.comm_status = SUCCESS;
-
+            ireply = List();
         }
         else if (input.compare("TIMELINE") == 0) {
             ireply.comm_status = SUCCESS;
         }
+        else if (input.compare("HISTORY") == 0) {
+            ireply = History();
+        }
     }
 
     return ireply;
@@ -290,20 +335,32 @@ void Client::processTimeline() {
     // CTRL-C (SIGINT)
 	// ------------------------------------------------------------
 
+    if (batched) {
+        processTimelineBatch();
+        return;
+    }
+
     ClientContext ctx;
     std::shared_ptr<ClientReaderWriter<Message, Message>> stream(stub_->Timeline(&ctx));
+    TimelineCache cache(CachePath());
 
     Message message;
 
-    // Send message signalling initial setup
+    // Send message signalling initial setup - only posts missing from the
+    // cache are sent back
     message.set_username(username);
     message.set_msg("INIT");
+    ResumeFromCache(cache, true, &message);
     stream->Write(message);
 
     // Read
     std::thread reader ([&] {
         Message msg;
         while (stream->Read(&msg)) {
+            // Already shown if it is cached
+            if (!cache.Add(msg)) {
+                continue;
+            }
             Timestamp timestamp = msg.timestamp();
             time_t time = timestamp.seconds();
             displayPostMessage(msg.username(), msg.msg(), time);
@@ -321,12 +378,161 @@ void Client::processTimeline() {
         Message msg;
         msg.set_username(username);
         msg.set_msg(post);
-        Timestamp* timestamp = new Timestamp();
-        timestamp->set_seconds(time(NULL));
-        timestamp->set_nanos(0);
-        msg.set_allocated_timestamp(timestamp);
+        msg.mutable_timestamp()->set_seconds(time(NULL));
+
+        // Send to server - cached once the server sends it back numbered
+        stream->Write(msg);
+    }
+    stream->WritesDone();
+
+}
+
+// Timeline mode over TimelineBatch (-b) - each frame may hold several posts
+// Reads every page of the user directory. The listing is cached, so after
+// the first LIST the server only sends users added since, or "not modified".
+IReply Client::List() {
+    IReply ireply;
+    std::vector<std::string> users = known_users_;
+    Reply reply;
+    std::string cursor;
+
+    do {
+        Request request;
+        request.set_username(username);
+        request.set_page_size(list_page_size);
+        request.set_cursor(cursor);
+        request.set_known_version(known_version_);
+
+        ClientContext ctx;
+        reply.Clear();
+        Status status = stub_->List(&ctx, request, &reply);
+        ireply.grpc_status = status;
+        if (!status.ok()) {
+            // The server restarted while we were paging - start over next time
+            known_version_.clear();
+            known_users_.clear();
+            ireply.comm_status = FAILURE_UNKNOWN;
+            return ireply;
+        }
+        if (reply.not_modified()) {
+            break;
+        }
+        if (cursor.empty() && !reply.delta()) {
+            users.clear();
+        }
+        for (const std::string& uname : reply.all_users()) {
+            users.push_back(uname);
+        }
+        cursor = reply.next_cursor();
+    } while (!cursor.empty());
+
+    if (!reply.not_modified()) {
+        known_users_ = users;
+        known_following_.assign(reply.following_users().begin(), reply.following_users().end());
+        known_version_ = reply.directory_version();
+    }
+
+    ireply.comm_status = SUCCESS;
+    ireply.all_users = known_users_;
+    ireply.following_users = known_following_;
+    return ireply;
+}
+
+// Each HISTORY shows the next older page of the timeline, starting over from
+// the newest once the oldest page has been shown
+IReply Client::History() {
+    if (!next_page_.valid()) {
+        next_page_ = FetchPage(nullptr);
+    }
+    PageResult result = next_page_.get();
+
+    IReply ireply;
+    ireply.grpc_status = result.status;
+    if (!result.status.ok()) {
+        ireply.comm_status = FAILURE_UNKNOWN;
+        return ireply;
+    }
+
+    // Get the page after this one while this one is printed
+    if (result.page.has_next_cursor()) {
+        next_page_ = FetchPage(&result.page.next_cursor());
+    }
+
+    for (const Message& msg : result.page.posts()) {
+        time_t time = msg.timestamp().seconds();
+        displayPostMessage(msg.username(), msg.msg(), time);
+    }
+    if (!result.page.has_next_cursor()) {
+        std::cout << "-- No older posts --" << std::endl;
+    }
+    ireply.comm_status = SUCCESS;
+    return ireply;
+}
+
+// Request a page in the background - the newest if cursor is null
+std::future<PageResult> Client::FetchPage(const PageCursor* cursor) {
+    TimelinePageRequest request;
+    request.set_username(username);
+    request.set_limit(history_page_size);
+    if (cursor != nullptr) {
+        *request.mutable_cursor() = *cursor;
+    }
+
+    SNSService::Stub* stub = stub_.get();
+    return std::async(std::launch::async, [stub, request]() {
+        ClientContext ctx;
+        PageResult result;
+        result.status = stub->GetTimelinePage(&ctx, request, &result.page);
+        return result;
+    });
+}
+
+void Client::processTimelineBatch() {
+    ClientContext ctx;
+    std::shared_ptr<ClientReaderWriter<Message, MessageBatch>> stream(stub_->TimelineBatch(&ctx));
+    TimelineCache cache(CachePath());
+
+    Message message;
+
+    // Send message signalling initial setup - only posts missing from the
+    // cache are sent back
+    message.set_username(username);
+    message.set_msg("INIT");
+    ResumeFromCache(cache, false, &message);
+    stream->Write(message);
+
+    // Read
+    std::thread reader ([&] {
+        BatchDecoder decoder;
+        MessageBatch batch;
+        std::vector<Message> posts;
+        while (stream->Read(&batch)) {
+            posts.clear();
+            decoder.Decode(batch, &posts);
+            for (Message& msg : posts) {
+                if (!cache.Add(msg)) {
+                    continue;
+                }
+                time_t time = msg.timestamp().seconds();
+                displayPostMessage(msg.username(), msg.msg(), time);
+            }
+        }
+    });
+    reader.detach();
+
+    std::string post;
+    while(true) {
+
+        // Get stdin
+        post = getPostMessage();
+
+        // Create message
+        Message msg;
+        msg.set_username(username);
+        msg.set_msg(post);
+        msg.mutable_timestamp()->set_seconds(time(NULL));
 
-        // Send to server
+        // Send to server - cached once the server sends it back numbered
         stream->Write(msg);
     }
     stream->WritesDone();
@@ -1,20 +1,37 @@
 #include <ctime>
 
+#include <google/protobuf/arena.h>
 #include <google/protobuf/timestamp.pb.h>
 #include <google/protobuf/duration.pb.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <limits>
 #include <memory>
+#include <mutex>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <stdlib.h>
 #include <unistd.h>
 #include <google/protobuf/util/time_util.h>
 #include <grpc++/grpc++.h>
-#include "json.hpp"
 
 #include "sns.grpc.pb.h"
-
+#include "admission.h"
+#include "storage.h"
+#include "timeline_batch.h"
+#include "timeline_cache.h"
+#include "user_table.h"
+
+using google::protobuf::Arena;
+using google::protobuf::ArenaOptions;
 using google::protobuf::Timestamp;
 using google::protobuf::Duration;
 using grpc::Server;
@@ -25,10 +42,44 @@ using grpc::ServerReaderWriter;
 using grpc::ServerWriter;
 using grpc::Status;
 using csce438::Message;
+using csce438::MessageBatch;
+using csce438::PageCursor;
 using csce438::Request;
 using csce438::Reply;
 using csce438::SNSService;
-using json = nlohmann::ordered_json;
+using csce438::TimelinePage;
+using csce438::TimelinePageRequest;
+
+// Fan-out policy - posts from authors with at least this many followers are
+// not pushed to every follower. They go into the author's outbox once and each
+// follower's stream pulls them from there.
+int fanout_threshold = 1000;
+
+// Posts kept in each outbox
+const size_t outbox_limit = 100;
+
+// How often a timeline stream pulls from the outboxes it follows
+const int pull_interval_ms = 200;
+
+// Posts sent on INIT, and the default and largest GetTimelinePage sizes
+const size_t history_size = 20;
+
+// Stack block the INIT history frame is built in - fits history_size
+// posts of a few hundred bytes before the arena goes to the heap
+const size_t history_arena_block = 16 * 1024;
+const size_t max_page_size = 100;
+
+// Most posts a resumed INIT sends - a client away for longer gets the
+// newest ones and pages back for the rest
+const size_t resume_limit = 1000;
+
+// Default and largest List page sizes
+const size_t list_page_size = 1000;
+const size_t max_list_page_size = 10000;
+
+// Changes every time the server starts, so List tokens from an earlier run
+// (when user_db may have been loaded in another order) are not trusted
+std::string list_epoch;
 
 // Stores all data regarding users
 struct User {
@@ -36,11 +87,76 @@ struct User {
   std::string username;
   std::vector<User*> followers;
   std::vector<User*> following;
+  std::atomic<uint64_t> following_version{0};  // bumped whenever following changes
+  std::unordered_map<std::string, int64_t> follow_time;  // when each following started
+
+  // The user's newest Timeline stream, which followers' posts are pushed
+  // to. A new stream replaces it, and a handler only clears it if it is
+  // still its own. Held for every write to the user's streams, as a stream
+  // takes one write at a time.
+  std::mutex stream_mutex;
   ServerReaderWriter<Message, Message>* stream = 0;
+
+  // TimelineBatch - posts wait here until the stream's writer picks them
+  // up. Only the newest TimelineBatch stream has a writer taking them. A
+  // handler, or its writer once a write fails, only clears batch_stream if
+  // it is still its own.
+  ServerReaderWriter<MessageBatch, Message>* batch_stream = 0;
+  std::mutex pending_mutex;
+  std::condition_variable pending_cv;
+  MessageList pending;
+
+  // Pull fan-out - recent posts while over fanout_threshold. The outbox is
+  // a ring of up to outbox_limit posts, post n is at outbox[n % outbox_limit]
+  std::mutex outbox_mutex;
+  std::vector<Message> outbox;
+  std::atomic<uint64_t> outbox_end{0};  // sequence number after the newest outbox post
+
+  // Admission control
+  TokenBucket post_bucket;
+  TokenBucket call_bucket;
+
+  // Held while a post is numbered and stored, so the author's sequence
+  // numbers reach storage in order. Loaded from storage on the first post.
+  std::mutex post_mutex;
+  bool sequence_loaded = false;
+  uint64_t last_sequence = 0;
 };
 
-// Local database of all clients
-std::vector<User*> user_db;
+// Local database of all clients. Appended to under user_index_mutex and
+// read without it - user_table.h never moves an entry once added.
+AppendTable<User*> user_db;
+
+// username -> index in user_db
+std::unordered_map<std::string, int> user_index;
+std::mutex user_index_mutex;
+
+// Persistent users, follows and posts (-s json|binary)
+std::unique_ptr<Storage> storage;
+
+// Group commit (-d) - posts are acknowledged only once fdatasynced. A batch
+// is synced after commit_latency_us or once it has commit_batch posts (-b).
+int commit_latency_us = -1;
+int commit_batch = 64;
+
+// How often the group commit counters are printed
+const int commit_stats_interval = 60;
+
+// Admission control - per-user and global token buckets for posts (-r/-R)
+// and for Follow, UnFollow, List and GetTimelinePage calls (-q/-Q), in
+// requests per second, 0 for no limit
+double user_post_rate = 0;
+double global_post_rate = 0;
+double user_call_rate = 0;
+double global_call_rate = 0;
+Admission post_admission;
+Admission call_admission;
+
+// Buckets hold this many seconds of tokens, so short bursts get through
+const double burst_seconds = 2;
+
+// How often the rejection counters are printed
+const int admission_stats_interval = 60;
 
 int find_following(User* user, std::string following_username) {
   for (int i = 0; i < user->following.size(); i++) {
@@ -52,184 +168,377 @@ int find_following(User* user, std::string following_username) {
 }
 
 int find_user(std::string username) {
-  for (int i = 0; i < user_db.size(); i++) {
-    User* u = user_db[i];
-    if (u->username == username) {
-      return i;
-    }
-  }
-  return -1;
+  std::lock_guard<std::mutex> lock(user_index_mutex);
+  auto it = user_index.find(username);
+  return it == user_index.end() ? -1 : it->second;
 }
 
-void UpdateJSON(json j) {
-  std::ofstream ofs("data.json");
-  ofs << std::setw(4) << j << std::endl;
-  ofs.close();
+// Add a new user to user_db and the index
+User* AddUser(const std::string& username) {
+  User* user = new User;
+  user->username = username;
+  std::lock_guard<std::mutex> lock(user_index_mutex);
+  user_index[username] = user_db.size();
+  user_db.push_back(user);
+  return user;
 }
 
-// Load inital data - assumes empty local db
-void LoadInitialData() {
-  std::ifstream file("data.json");
-  json j; 
-  
-  if (file.is_open()) {
+// Run body(worker, workers) once on each of workers threads
+void RunWorkers(const std::function<void(size_t worker, size_t workers)>& body) {
+  size_t workers = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<std::thread> threads;
+  for (size_t w = 1; w < workers; w++) {
+    threads.emplace_back(body, w, workers);
+  }
+  body(0, workers);
+  for (std::thread& t : threads) {
+    t.join();
+  }
+}
 
-    // Check if file is empty
-    if (file.peek() == std::ifstream::traits_type::eof()) {
-      file.close();
+// Load inital data - assumes empty local db. Storage streams out the users
+// and edges, the directory is built and indexed once, and then the edges are
+// resolved and linked in parallel - each worker owns the users whose index
+// is its worker number mod workers, so no two workers touch the same User.
+void LoadInitialData() {
+  auto start = std::chrono::steady_clock::now();
+  if (!storage->Init()) {
+    std::cerr << "Could not open storage\n";
+    exit(1);
+  }
 
-      // Update data.json with an empty array
-      j = json::object();
-      j["users"] = json::object();
-      j["posts"] = json::array();
-      UpdateJSON(j);
+  struct Edge {
+    std::string username;
+    std::string following;
+    int64_t timestamp;
+  };
+  std::vector<std::string> names;
+  std::vector<Edge> edges;
+  storage->LoadGraph(
+    [&names](const std::string& uname) {
+      names.push_back(uname);
+    },
+    [&edges](const std::string& uname, const std::string& follow_username, int64_t timestamp) {
+      edges.push_back({uname, follow_username, timestamp});
+    });
+  auto parsed = std::chrono::steady_clock::now();
+
+  // Directory - allocate in parallel, then index in load order
+  std::vector<User*> created(names.size());
+  RunWorkers([&](size_t w, size_t workers) {
+    for (size_t i = names.size() * w / workers; i < names.size() * (w + 1) / workers; i++) {
+      created[i] = new User;
+      created[i]->username = names[i];
+    }
+  });
+  user_index.reserve(names.size());
+  for (User* user : created) {
+    if (!user_index.emplace(user->username, user_db.size()).second) {
+      delete user;  // listed twice
+      continue;
+    }
+    user_db.push_back(user);
+  }
 
-      return;
+  // Resolve edges - the index is read-only until the misses are added
+  std::vector<std::pair<int, int>> resolved(edges.size());
+  RunWorkers([&](size_t w, size_t workers) {
+    for (size_t i = edges.size() * w / workers; i < edges.size() * (w + 1) / workers; i++) {
+      auto from = user_index.find(edges[i].username);
+      auto to = user_index.find(edges[i].following);
+      resolved[i].first = from == user_index.end() ? -1 : from->second;
+      resolved[i].second = to == user_index.end() ? -1 : to->second;
+    }
+  });
+
+  // Add users only named by an edge
+  auto find_or_add = [](const std::string& uname) {
+    int index = find_user(uname);
+    if (index < 0) {
+      AddUser(uname);
+      index = user_db.size() - 1;
+    }
+    return index;
+  };
+  for (size_t i = 0; i < edges.size(); i++) {
+    if (resolved[i].first < 0) {
+      resolved[i].first = find_or_add(edges[i].username);
+    }
+    if (resolved[i].second < 0) {
+      resolved[i].second = find_or_add(edges[i].following);
     }
+  }
 
-    // Parse json
-    j = json::parse(file);
-    file.close();
-    
-    for (auto user_data : j["users"]) {
-      // Find user in local db
-      User* user;
-      std::string uname = user_data["username"];
-      int user_index = find_user(uname);
-
-      // Create the user if not found
-      if (user_index == -1) {
-        user = new User;
-        user->username = uname;
+  // Link - storage gives every current edge once, so no duplicate checks
+  RunWorkers([&](size_t w, size_t workers) {
+    for (size_t i = 0; i < edges.size(); i++) {
+      User* user = user_db[resolved[i].first];
+      User* user_to_follow = user_db[resolved[i].second];
+      if ((size_t)resolved[i].first % workers == w) {
+        user->following.push_back(user_to_follow);
+        user->following_version++;
+        user->follow_time[user_to_follow->username] = edges[i].timestamp;
       }
-      // Grab the user in the local database
-      else {
-        user = user_db[user_index];
+      if ((size_t)resolved[i].second % workers == w) {
+        user_to_follow->followers.push_back(user);
       }
+    }
+  });
+  auto linked = std::chrono::steady_clock::now();
+
+  auto ms = [](std::chrono::steady_clock::duration d) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(d).count();
+  };
+  std::cout << "Loaded " << user_db.size() << " users and " << edges.size() << " follows in "
+            << ms(linked - start) << "ms (read " << ms(parsed - start) << "ms, build "
+            << ms(linked - parsed) << "ms)" << std::endl;
+}
 
-      // Load followings / followers
-      for (auto following_data : user_data["following"]) {
-        std::string follow_username = following_data["username"];
-        std::cout << uname << " -> " << follow_username << "... ";
-        bool exit = false;
-
-        // Find user_to_follow in local db
-        User* user_to_follow;
-        int following_index = find_user(follow_username);
-
-        // Create the user if not found
-        if (following_index == -1) {
-          user_to_follow = new User;
-          user_to_follow->username = follow_username;
-          user_db.push_back(user_to_follow);
-        }
+// Stamp a post by user with the time and the user's next sequence number,
+// and store it. False if the post could not be stored - its sequence number
+// is then given to the next post. With group commit (-d) this returns once
+// the post is on disk.
+bool StorePost(User* user, Message* message) {
+  std::lock_guard<std::mutex> lock(user->post_mutex);
+  if (!user->sequence_loaded) {
+    user->last_sequence = storage->LastSequence(user->username);
+    user->sequence_loaded = true;
+  }
 
-        // Grab the user in the local database
-        else {
-          user_to_follow = user_db[following_index];
-        }
+  int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+  NanosToTimestamp(now, message->mutable_timestamp());
+  message->set_sequence(user->last_sequence + 1);
+
+  StoredPost post;
+  post.username = message->username();
+  post.msg = message->msg();
+  post.timestamp = message->timestamp().seconds();
+  post.nanos = message->timestamp().nanos();
+  post.sequence = message->sequence();
+  if (!storage->AppendPost(post)) {
+    return false;
+  }
+  user->last_sequence++;
+  return true;
+}
 
-        // Check if already following
-        for (User* u : user->following) {
-          if (u->username == user_to_follow->username) {
-            std::cout << "already following\n";
-            exit = true;
-            break;
-          }
-        }
+// RESOURCE_EXHAUSTED with a retry hint - in the message, and in
+// milliseconds in the retry-after-ms trailer
+Status RateLimited(ServerContext* context, int64_t retry_ns) {
+  std::string retry_ms = std::to_string((retry_ns + 999999) / 1000000);
+  context->AddTrailingMetadata("retry-after-ms", retry_ms);
+  return Status(grpc::StatusCode::RESOURCE_EXHAUSTED, "Rate limited - retry in " + retry_ms + "ms");
+}
 
-        if (exit) {
-          continue;
-        }
+// Call bucket of a user, null if there is no such user
+TokenBucket* CallBucket(int user_index) {
+  return user_index < 0 ? 0 : &user_db[user_index]->call_bucket;
+}
 
-        std::cout << "added\n";
-        user->following.push_back(user_to_follow);
-        user_to_follow->followers.push_back(user);
-      }
-      
-      // Add user to db
-      if (user_index == -1) {
-        user_db.push_back(user);
-      }
-    }
+// Queue a post for a TimelineBatch follower
+void QueueBatchPost(User* user, const Message& message) {
+  std::lock_guard<std::mutex> lock(user->pending_mutex);
+  if (user->batch_stream == 0) {
+    return;
   }
+  user->pending.Add(message);
+  // A replaced stream's writer may still be waiting too
+  user->pending_cv.notify_all();
+}
+
+bool IsPullAuthor(User* user) {
+  return (int)user->followers.size() >= fanout_threshold;
+}
 
-  // Create data.json if it doesn't exist
+// Store a post once for all followers to pull
+void AppendOutbox(User* user, const Message& message) {
+  std::lock_guard<std::mutex> lock(user->outbox_mutex);
+  if (user->outbox.size() < outbox_limit) {
+    user->outbox.push_back(message);
+  }
   else {
-    j = json::object();
-    j["users"] = json::object();
-    j["posts"] = json::array();
-    UpdateJSON(j);
+    CopyPost(message, &user->outbox[user->outbox_end % outbox_limit]);
   }
+  user->outbox_end++;
 }
 
-// Add a new user to data.json
-void CreateUserJSON(std::string username) {
-  // std::cout << "adding " << username << " to storage\n";
-  
-  // Load data.json
-  std::ifstream file("data.json");
-  json j = json::parse(file);
-  file.close();
-
-  // Create user object
-  json user_data;
-  user_data["username"] = username;
-  user_data["following"] = json::object();
-  j["users"][username] = user_data;
-
-  UpdateJSON(j);
+// Deliver a new post - push to followers' streams, or leave it in the
+// outbox if the author has too many followers
+void FanOut(User* user, const Message& message) {
+  if (IsPullAuthor(user)) {
+    AppendOutbox(user, message);
+    return;
+  }
+
+  for (User* u : user->followers) {
+    {
+      std::lock_guard<std::mutex> lock(u->stream_mutex);
+      if (u->stream != 0) {
+        u->stream->Write(message);
+        continue;
+      }
+    }
+    QueueBatchPost(u, message);
+  }
 }
 
-void FollowUserJSON(std::string username, std::string username_to_follow) {
-  // std::cout << username << " -> " << username_to_follow << " to storage\n";
-  
-  // Load data.json
-  std::ifstream file("data.json");
-  json j = json::parse(file);
-  file.close();
-  
-  Timestamp* timestamp = new Timestamp();
-  timestamp->set_seconds(time(NULL));
-  timestamp->set_nanos(0);
+// Outbox position a stream has read up to, per followed author
+typedef std::unordered_map<User*, uint64_t> OutboxCursors;
 
-  json follow_data;
-  follow_data["username"] = username_to_follow;
-  follow_data["timestamp"] = timestamp->seconds();
+// Start pulling from now - older posts are covered by the INIT history
+void StartCursors(User* user, OutboxCursors& cursors) {
+  for (User* u : user->following) {
+    cursors[u] = u->outbox_end;
+  }
+}
 
-  // Update json
-  j["users"][username]["following"][username_to_follow] = follow_data; 
-  
-  UpdateJSON(j);
+// Pull outbox posts newer than the cursors and merge them into posts by time.
+// Cost is bounded by followed authors * outbox_limit.
+void PullPosts(User* user, OutboxCursors& cursors, MessageList* posts) {
+  size_t pushed = posts->size();
+
+  for (User* u : user->following) {
+    auto it = cursors.find(u);
+
+    // Newly followed - only see posts from now on
+    if (it == cursors.end()) {
+      cursors[u] = u->outbox_end;
+      continue;
+    }
+    if (it->second == u->outbox_end) {
+      continue;
+    }
+
+    std::lock_guard<std::mutex> lock(u->outbox_mutex);
+    uint64_t first = u->outbox_end - u->outbox.size();
+    for (uint64_t i = std::max(it->second, first); i < u->outbox_end; i++) {
+      posts->Add(u->outbox[i % outbox_limit]);
+    }
+    it->second = u->outbox_end;
+  }
+
+  if (posts->size() > pushed) {
+    std::stable_sort(posts->begin(), posts->end(), [](const Message& a, const Message& b) {
+      return a.timestamp().seconds() < b.timestamp().seconds() ||
+             (a.timestamp().seconds() == b.timestamp().seconds() && a.timestamp().nanos() < b.timestamp().nanos());
+    });
+  }
+}
+
+// Authors whose posts are on a user's timeline - own posts from the start,
+// followed users' from when they were followed
+AuthorSince TimelineAuthors(User* user) {
+  AuthorSince authors(user->follow_time.begin(), user->follow_time.end());
+  authors[user->username] = std::numeric_limits<int64_t>::min();
+  return authors;
 }
 
-void UnfollowUserJSON(std::string username, std::string username_to_unfollow) {
-  // Load data.json
-  std::ifstream file("data.json");
-  json j = json::parse(file);
-  file.close();
+// Fill message in place, reusing whatever it already holds
+void ToMessage(const StoredPost& post, Message* message) {
+  message->set_username(post.username);
+  message->set_msg(post.msg);
+  message->mutable_timestamp()->set_seconds(post.timestamp);
+  message->mutable_timestamp()->set_nanos(post.nanos);
+  message->set_sequence(post.sequence);
+}
+
+// The INIT history - the most recent posts the user can see, newest first.
+// With a resume vector only the posts the client is missing are returned:
+// for an author it has posts from, the user included, the ones after the
+// newest of those, and for anyone else the ones since its oldest cached post.
+std::vector<StoredPost> RecentPosts(User* user, const Message& init) {
+  AuthorSince authors = TimelineAuthors(user);
+  if (!init.has_resume()) {
+    return storage->RecentPosts(authors, history_size);
+  }
 
-  j["users"][username]["following"].erase(username_to_unfollow);
+  // Start each author at the second of the post the client has - an
+  // author's sequence numbers only go up with time - or at since
+  const csce438::ResumeVector& resume = init.resume();
+  std::unordered_map<std::string, uint64_t> after;
+  for (auto& a : authors) {
+    a.second = std::max(a.second, resume.since());
+  }
+  for (const csce438::ResumePoint& point : resume.authors()) {
+    auto it = authors.find(point.author());
+    if (it != authors.end()) {
+      it->second = std::max(it->second, point.timestamp());
+      after[point.author()] = point.sequence();
+    }
+  }
+
+  // That also finds the posts from that second the client has. Drop them,
+  // and ask for as many more until resume_limit are left or there are none.
+  std::vector<StoredPost> posts;
+  size_t limit = resume_limit;
+  while (true) {
+    std::vector<StoredPost> found = storage->RecentPosts(authors, limit);
+    posts.clear();
+    for (StoredPost& post : found) {
+      auto it = after.find(post.username);
+      if (it == after.end() || post.sequence > it->second) {
+        posts.push_back(std::move(post));
+      }
+    }
+    if (posts.size() >= resume_limit || found.size() < limit) {
+      break;
+    }
+    limit += found.size() - posts.size();
+  }
+  if (posts.size() > resume_limit) {
+    posts.resize(resume_limit);
+  }
+  return posts;
+}
 
-  UpdateJSON(j);
+// List tokens - a directory version is "<epoch>.<users>.<following_version>"
+// and a list cursor is "<epoch>.<index>". user_db only grows, so within one
+// epoch (one run of the server) the users after an index are exactly the
+// ones added since, and a version tells both how much of user_db the client
+// has and whether its following list is current.
+std::string ListCursor(size_t index) {
+  return list_epoch + "." + std::to_string(index);
 }
 
-void TimelineJSON(Message message, Timestamp* timestamp) {
-  // std::cout << "writing post to storage\n";
-  std::string username = message.username();
+std::string DirectoryVersion(size_t users, uint64_t following_version) {
+  return ListCursor(users) + "." + std::to_string(following_version);
+}
 
-  // Load data.json
-  std::ifstream file("data.json");
-  json j = json::parse(file);
-  file.close();
+// Split a token into numbers after checking its epoch - false if it is
+// malformed or from another epoch
+bool ParseListToken(const std::string& token, std::vector<uint64_t>* numbers) {
+  if (token.compare(0, list_epoch.size() + 1, list_epoch + ".") != 0) {
+    return false;
+  }
+  std::stringstream ss(token.substr(list_epoch.size() + 1));
+  std::string part;
+  while (std::getline(ss, part, '.')) {
+    if (part.empty() || part.find_first_not_of("0123456789") != std::string::npos) {
+      return false;
+    }
+    numbers->push_back(std::stoull(part));
+  }
+  return true;
+}
 
-  json post = json::object();
-  post["message"] = message.msg();
-  post["username"] = message.username();
-  post["timestamp"] = timestamp->seconds();
-  j["posts"].push_back(post);
+bool ParseListCursor(const std::string& cursor, size_t* index) {
+  std::vector<uint64_t> numbers;
+  if (!ParseListToken(cursor, &numbers) || numbers.size() != 1 || numbers[0] > user_db.size()) {
+    return false;
+  }
+  *index = numbers[0];
+  return true;
+}
 
-  UpdateJSON(j);
+bool ParseDirectoryVersion(const std::string& version, size_t* users, uint64_t* following_version) {
+  std::vector<uint64_t> numbers;
+  if (!ParseListToken(version, &numbers) || numbers.size() != 2) {
+    return false;
+  }
+  *users = numbers[0];
+  *following_version = numbers[1];
+  return true;
 }
 
 class SNSServiceImpl final : public SNSService::Service {
@@ -242,14 +551,53 @@ class SNSServiceImpl final : public SNSService::Service {
     // ------------------------------------------------------------
 
     int user_index = find_user(request->username());
+    if (user_index < 0) {
+      return Status(grpc::StatusCode::NOT_FOUND, "Unknown user");
+    }
     User* user = user_db[user_index];
 
-    // Add all users
-    for (User* u : user_db) {
-      reply->add_all_users(u->username);
+    int64_t retry_ns;
+    if (!call_admission.Admit(&user->call_bucket, &retry_ns)) {
+      return RateLimited(context, retry_ns);
     }
 
-    // Add self to follows
+    size_t users = user_db.size();
+    uint64_t following_version = user->following_version;
+    reply->set_directory_version(DirectoryVersion(users, following_version));
+
+    // What the client already has, if it listed during this epoch
+    size_t known_users = 0;
+    uint64_t known_following = 0;
+    bool known = ParseDirectoryVersion(request->known_version(), &known_users, &known_following) &&
+                 known_users <= users;
+    if (known && request->cursor().empty() && known_users == users && known_following == following_version) {
+      reply->set_not_modified(true);
+      return Status::OK;
+    }
+    reply->set_delta(known);
+
+    size_t start = known ? known_users : 0;
+    if (!request->cursor().empty() && !ParseListCursor(request->cursor(), &start)) {
+      return Status(grpc::StatusCode::ABORTED, "List cursor is from before a restart");
+    }
+
+    size_t page_size = request->page_size();
+    if (page_size == 0) {
+      page_size = list_page_size;
+    }
+    page_size = std::min(page_size, max_list_page_size);
+
+    // Add a page of users
+    size_t end = std::min(users, start + page_size);
+    for (size_t i = start; i < end; i++) {
+      reply->add_all_users(user_db[i]->username);
+    }
+    if (end < users) {
+      reply->set_next_cursor(ListCursor(end));
+      return Status::OK;
+    }
+
+    // Last page - add self to follows
     reply->add_following_users(request->username());
 
     // Add follows
@@ -278,6 +626,12 @@ class SNSServiceImpl final : public SNSService::Service {
     int user_index = find_user(uname);
     int follow_index = find_user(username_to_follow);
 
+    int64_t retry_ns;
+    if (!call_admission.Admit(CallBucket(user_index), &retry_ns)) {
+      std::cout << "Follow failed - rate limited\n";
+      return RateLimited(context, retry_ns);
+    }
+
     // Prevent self follow
     if (uname.compare(username_to_follow) == 0) {
       std::cout << "Follow failed - self follow\n";
@@ -304,13 +658,16 @@ class SNSServiceImpl final : public SNSService::Service {
         }
       }
 
+      int64_t timestamp = time(NULL);
       user->following.push_back(user_to_follow);
+      user->following_version++;
+      user->follow_time[user_to_follow->username] = timestamp;
       user_to_follow->followers.push_back(user);
 
       std::cout << "Follow successful\n";
       reply->set_msg("Follow successful");
 
-      FollowUserJSON(user->username, user_to_follow->username);
+      storage->Follow(user->username, user_to_follow->username, timestamp);
     }
 
     return Status::OK; 
@@ -329,6 +686,12 @@ class SNSServiceImpl final : public SNSService::Service {
     int user_index = find_user(uname);
     int unfollow_index = find_user(username_to_unfollow);
 
+    int64_t retry_ns;
+    if (!call_admission.Admit(CallBucket(user_index), &retry_ns)) {
+      std::cout << "Unfollow failed - rate limited\n";
+      return RateLimited(context, retry_ns);
+    }
+
     // Prevent self unfollow
     if (uname.compare(username_to_unfollow) == 0) {
       std::cout << "Unfollow failed - self unfollow\n";
@@ -351,6 +714,7 @@ class SNSServiceImpl final : public SNSService::Service {
       for (int i = 0; i < following_list->size(); i++) {
         if (following_list->at(i)->username == username_to_unfollow) {
           following_list->erase(following_list->begin() + i);
+          user_db[user_index]->following_version++;
           unfollowing = true;
           break;
         }
@@ -370,7 +734,8 @@ class SNSServiceImpl final : public SNSService::Service {
         std::cout << "Unfollow successful\n";
         reply->set_msg("Unfollow successful");
 
-        UnfollowUserJSON(uname, username_to_unfollow);
+        user_db[user_index]->follow_time.erase(username_to_unfollow);
+        storage->Unfollow(uname, username_to_unfollow);
       }
       else {
         std::cout << "Unfollow failed - not following\n";
@@ -404,13 +769,11 @@ class SNSServiceImpl final : public SNSService::Service {
 
     // No user with the username found -- add them into the database and let them login
     if (user_index == -1) {
-      user = new User;
-      user->username = uname;
+      user = AddUser(uname);
       user->connected = true;
-      user_db.push_back(user);
 
       std::cout << "Login successful\n";
-      CreateUserJSON(uname);
+      storage->CreateUser(uname);
 
       reply->set_msg("Login successful");
     }
@@ -441,10 +804,18 @@ class SNSServiceImpl final : public SNSService::Service {
     Message message_send;
     std::string uname;
     int user_index = -1;
+    User* user = 0;
     bool init = true;
+    std::atomic<bool> done(false);
+    std::thread puller;
+    Status status = Status::OK;
+    int64_t retry_ns;
 
     while (stream->Read(&message_recv)) {
-      User* user;
+      // A post over the rate is dropped and counted, and the stream stays open
+      if (!init && !post_admission.Admit(user ? &user->post_bucket : 0, &retry_ns)) {
+        continue;
+      }
 
       // Check if inital setup
       if (message_recv.msg() == "INIT" && init) {
@@ -453,90 +824,279 @@ class SNSServiceImpl final : public SNSService::Service {
         uname = message_recv.username();
         std::cout << uname << "\n";
         user_index = find_user(uname);
+        if (user_index < 0) {
+          status = Status(grpc::StatusCode::NOT_FOUND, "Unknown user");
+          break;
+        }
         user = user_db[user_index];
 
-        if (user->stream == 0) {
-          user->stream = stream;
+        // Retrieve following messages - up to 20. The history goes out
+        // before followers' posts can be pushed to this stream.
+        std::lock_guard<std::mutex> lock(user->stream_mutex);
+        for (const StoredPost& post : RecentPosts(user, message_recv)) {
+          ToMessage(post, &message_send);
+          stream->Write(message_send);
         }
 
-        // Retrieve following messages - up to 20
-        int count = 0;
+        // Pull posts from high-follower authors this user follows
+        puller = std::thread([user, stream, &done] {
+          OutboxCursors cursors;
+          StartCursors(user, cursors);
+          MessageList pulled;
+          while (!done) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(pull_interval_ms));
+            pulled.Clear();
+            PullPosts(user, cursors, &pulled);
+            // Followers' pushes write to this stream too
+            std::lock_guard<std::mutex> lock(user->stream_mutex);
+            for (Message& m : pulled) {
+              stream->Write(m);
+            }
+          }
+        });
+        user->stream = stream;
+      }
 
-        // Load json
-        std::ifstream file("data.json");
-        json j = json::parse(file);
-        file.close();
+      // Send post to followers - a post before INIT has no author to number it by
+      else if (user != 0) {
+        // Create message - message_send keeps its buffers from the last post.
+        // StorePost stamps it.
+        message_send.set_username(uname);
+        message_send.set_msg(message_recv.msg());
 
-        // Get the recent 20 messages
-        
-        json posts = j["posts"];
-        for (auto it = posts.rbegin(); it != posts.rend(); it++) {
-          if (count >= 20) {
-            break;
-          }
+        // Store the post before anyone sees it
+        if (!StorePost(user, &message_send)) {
+          std::cerr << "Could not store post from " << uname << std::endl;
+          status = Status(grpc::StatusCode::INTERNAL, "Post could not be stored");
+          break;
+        }
 
-          std::string message_username = (*it)["username"];
-          if (uname != message_username) {
-            // Check if username is followed
-            if (find_following(user, message_username) < 0) {
-              continue;
+        // send post to followers
+        FanOut(user, message_send);
+      }
+    }
+
+    // Nothing is pushed to this stream once the handler returns
+    if (user != 0) {
+      std::lock_guard<std::mutex> lock(user->stream_mutex);
+      if (user->stream == stream) {
+        user->stream = 0;
+      }
+    }
+
+    // Stop the puller
+    done = true;
+    if (puller.joinable()) {
+      puller.join();
+    }
+
+    return status;
+  }
+
+  Status TimelineBatch(ServerContext* context, ServerReaderWriter<MessageBatch, Message>* stream) override {
+    // ------------------------------------------------------------
+    // Same as Timeline, but posts for this user are queued and a
+    // writer thread sends everything pending as one MessageBatch
+    // ------------------------------------------------------------
+    std::cout << "TimelineBatch activated - ";
+    Message message_recv;
+    Message message_send;
+    User* user = 0;
+    BatchEncoder encoder;
+    std::thread writer;
+    Status status = Status::OK;
+    int64_t retry_ns;
+
+    while (stream->Read(&message_recv)) {
+      // A post over the rate is dropped and counted, and the stream stays open
+      if (user != 0 && !post_admission.Admit(&user->post_bucket, &retry_ns)) {
+        continue;
+      }
+
+      // Check if inital setup
+      if (message_recv.msg() == "INIT" && user == 0) {
+        std::cout << message_recv.username() << "\n";
+        int user_index = find_user(message_recv.username());
+        if (user_index < 0) {
+          status = Status(grpc::StatusCode::NOT_FOUND, "Unknown user");
+          break;
+        }
+        user = user_db[user_index];
+
+        // Take the pending posts over from an older stream, whose writer
+        // then stops, before the history is read - a post stored meanwhile
+        // is in one or the other, and the writer drops what the history
+        // already had. Posts the old writer had not drained yet are kept.
+        {
+          std::lock_guard<std::mutex> lock(user->pending_mutex);
+          user->batch_stream = stream;
+        }
+        user->pending_cv.notify_all();
+        OutboxCursors cursors;
+        StartCursors(user, cursors);
+
+        // History goes out as a single frame, oldest first. The frame is
+        // built on an arena that starts in a stack block, so its posts are
+        // not allocated one by one - only long message text still goes to
+        // the heap.
+        char block[history_arena_block];
+        ArenaOptions options;
+        options.initial_block = block;
+        options.initial_block_size = sizeof(block);
+        Arena arena(options);
+        MessageBatch* history = Arena::CreateMessage<MessageBatch>(&arena);
+        std::vector<StoredPost> recent = RecentPosts(user, message_recv);
+        // Newest sequence the history has from each author
+        std::unordered_map<std::string, uint64_t> sent;
+        for (auto it = recent.rbegin(); it != recent.rend(); it++) {
+          encoder.Add(it->username, it->msg, it->timestamp * 1000000000LL + it->nanos, it->sequence, history);
+          uint64_t& newest = sent[it->username];
+          newest = std::max(newest, it->sequence);
+        }
+        if (history->posts_size() > 0) {
+          stream->Write(*history);
+        }
+
+        // Drain everything that piled up while the last write was in flight,
+        // plus anything new in the outboxes this user pulls from
+        writer = std::thread([user, stream, &encoder, cursors, sent]() mutable {
+          MessageList drained;
+          MessageBatch batch;
+          while (true) {
+            {
+              std::unique_lock<std::mutex> lock(user->pending_mutex);
+              user->pending_cv.wait_for(lock, std::chrono::milliseconds(pull_interval_ms),
+                                        [user, stream] { return user->batch_stream != stream || !user->pending.empty(); });
+              if (user->batch_stream != stream) {
+                break;
+              }
+              drained.Swap(&user->pending);
             }
 
-            // Check if message is after follow age
-            int64_t follow_age = j["users"][uname]["following"][message_username]["timestamp"];
-            int64_t message_seconds = (*it)["timestamp"];
+            PullPosts(user, cursors, &drained);
+            if (drained.empty()) {
+              continue;
+            }
 
-            if (follow_age > message_seconds) {
+            // drained and batch are reused, so the steady state allocates nothing
+            batch.Clear();
+            for (const Message& m : drained) {
+              auto it = sent.find(m.username());
+              if (it == sent.end() || m.sequence() > it->second) {
+                encoder.Add(m, &batch);
+              }
+            }
+            drained.Clear();
+            if (batch.posts_size() == 0) {
               continue;
             }
+
+            // A broken stream takes no more - let the posts stop piling up
+            // for it
+            if (!stream->Write(batch)) {
+              std::lock_guard<std::mutex> lock(user->pending_mutex);
+              if (user->batch_stream == stream) {
+                user->batch_stream = 0;
+                user->pending.Clear();
+              }
+              break;
+            }
           }
+        });
+      }
 
+      // Send post to followers
+      else if (user != 0) {
+        // Create message - message_send keeps its buffers from the last post.
+        // StorePost stamps it.
+        message_send.set_username(user->username);
+        message_send.set_msg(message_recv.msg());
+
+        // Store the post before anyone sees it
+        if (!StorePost(user, &message_send)) {
+          std::cerr << "Could not store post from " << user->username << std::endl;
+          status = Status(grpc::StatusCode::INTERNAL, "Post could not be stored");
+          break;
+        }
 
-          // Create message
-          message_send.set_username((*it)["username"]);
-          message_send.set_msg((*it)["message"]);
-          Timestamp* timestamp = new Timestamp();
-          timestamp->set_seconds((*it)["timestamp"]);
-          timestamp->set_nanos(0);
-          message_send.set_allocated_timestamp(timestamp);
+        FanOut(user, message_send);
+      }
+    }
 
-          // Send to client
-          stream->Write(message_send);
-          count++;
+    // Stop the writer
+    if (user != 0) {
+      {
+        std::lock_guard<std::mutex> lock(user->pending_mutex);
+        if (user->batch_stream == stream) {
+          user->batch_stream = 0;
+          user->pending.Clear();
         }
-        
       }
+      user->pending_cv.notify_all();
+      writer.join();
+    }
 
-      // Send post to followers
-      else {
-        std::string str = message_recv.msg();
+    return status;
+  }
 
-        // Create message
-        message_send.set_username(uname);
-        message_send.set_msg(str);
-        Timestamp* timestamp = new Timestamp();
-        timestamp->set_seconds(time(NULL));
-        timestamp->set_nanos(0);
-        message_send.set_allocated_timestamp(timestamp);
+  Status GetTimelinePage(ServerContext* context, const TimelinePageRequest* request, TimelinePage* page) override {
+    int user_index = find_user(request->username());
+    if (user_index < 0) {
+      return Status(grpc::StatusCode::NOT_FOUND, "Unknown user");
+    }
 
-        // send post to followers
-        for (User* u : user->followers) {
-          if (u->stream != 0) {
-            u->stream->Write(message_send);
-          }
-        }
+    int64_t retry_ns;
+    if (!call_admission.Admit(CallBucket(user_index), &retry_ns)) {
+      return RateLimited(context, retry_ns);
+    }
 
-        // Update JSON
-        TimelineJSON(message_send, timestamp);
-      }
+    size_t limit = request->limit();
+    if (limit == 0) {
+      limit = history_size;
+    }
+    limit = std::min(limit, max_page_size);
+
+    PostCursor before;
+    if (request->has_cursor()) {
+      before.segment = request->cursor().segment();
+      before.timestamp = request->cursor().timestamp();
+      before.offset = request->cursor().offset();
     }
 
+    PostCursor next;
+    std::vector<StoredPost> posts = storage->PostsBefore(TimelineAuthors(user_db[user_index]), before, limit, &next);
+    for (const StoredPost& post : posts) {
+      ToMessage(post, page->add_posts());
+    }
+
+    // A short page is the last one
+    if (posts.size() == limit) {
+      PageCursor* cursor = page->mutable_next_cursor();
+      cursor->set_segment(next.segment);
+      cursor->set_timestamp(next.timestamp);
+      cursor->set_offset(next.offset);
+    }
     return Status::OK;
   }
 
 };
 
 
+void CommitStatsThread() {
+  while (true) {
+    std::this_thread::sleep_for(std::chrono::seconds(commit_stats_interval));
+    std::cout << "Group commit: " << storage->CommitStats() << std::endl;
+  }
+}
+
+void AdmissionStatsThread() {
+  while (true) {
+    std::this_thread::sleep_for(std::chrono::seconds(admission_stats_interval));
+    std::cout << "Admission: posts " << post_admission.ToString()
+              << ", calls " << call_admission.ToString() << std::endl;
+  }
+}
+
 void RunServer(std::string port_no) {
   // ------------------------------------------------------------
   // In this function, you are to write code 
@@ -546,14 +1106,33 @@ void RunServer(std::string port_no) {
   std::string server_addr = "localhost:" + port_no;
   SNSServiceImpl service;
 
+  // load inital data into local user_db before taking requests
+  LoadInitialData();
+
+  post_admission.Configure(user_post_rate, global_post_rate, burst_seconds);
+  call_admission.Configure(user_call_rate, global_call_rate, burst_seconds);
+  if (post_admission.enabled() || call_admission.enabled()) {
+    std::cout << "Admission control on: posts/s " << user_post_rate << " per user, "
+              << global_post_rate << " total; calls/s " << user_call_rate << " per user, "
+              << global_call_rate << " total (0 = no limit)\n";
+    std::thread(AdmissionStatsThread).detach();
+  }
+
   ServerBuilder builder;
   builder.AddListeningPort(server_addr, grpc::InsecureServerCredentials());
   builder.RegisterService(&service);
   std::unique_ptr<Server> server(builder.BuildAndStart());
   std::cout << "Server listening on " << server_addr + "\n";
 
-  // load inital data into local user_db
-  LoadInitialData();
+  if (commit_latency_us >= 0) {
+    if (commit_batch <= 0 || !storage->EnableGroupCommit(commit_batch, commit_latency_us)) {
+      std::cerr << "Group commit (-d) needs binary storage and a positive batch size (-b)\n";
+      exit(1);
+    }
+    std::cout << "Group commit on: " << commit_batch << " posts or "
+              << commit_latency_us << "us per batch\n";
+    std::thread(CommitStatsThread).detach();
+  }
 
   server->Wait();
 
@@ -562,16 +1141,49 @@ void RunServer(std::string port_no) {
 int main(int argc, char** argv) {
   
   std::string port = "3010";
+  std::string storage_kind = "binary";
+  list_epoch = std::to_string(time(NULL)) + "-" + std::to_string(getpid());
   int opt = 0;
-  while ((opt = getopt(argc, argv, "p:")) != -1){
+  while ((opt = getopt(argc, argv, "p:f:s:d:b:r:R:q:Q:")) != -1){
     switch(opt) {
       case 'p':
           port = optarg;
           break;
+      case 'f':
+          fanout_threshold = atoi(optarg);
+          break;
+      case 's':
+          storage_kind = optarg;
+          break;
+      case 'd':
+          commit_latency_us = atoi(optarg);
+          break;
+      case 'b':
+          commit_batch = atoi(optarg);
+          break;
+      case 'r':
+          user_post_rate = atof(optarg);
+          break;
+      case 'R':
+          global_post_rate = atof(optarg);
+          break;
+      case 'q':
+          user_call_rate = atof(optarg);
+          break;
+      case 'Q':
+          global_call_rate = atof(optarg);
+          break;
       default:
 	         std::cerr << "Invalid Command Line Argument\n";
     }
   }
+
+  // json keeps everything in data.json, binary uses segment files
+  storage.reset(MakeStorage(storage_kind, ".", "data.json", "data.json"));
+  if (!storage) {
+    std::cerr << "Unknown storage type " << storage_kind << " (-s json|binary)\n";
+    return -1;
+  }
   RunServer(port);
   return 0;
 }
@@ -0,0 +1,266 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <deque>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "sns.pb.h"
+#include "timeline_batch.h"
+
+using csce438::Message;
+using csce438::MessageBatch;
+
+// Heap allocations per delivered post on the server's Timeline paths.
+// Each path is a copy of what server.cc does with a post, with the stream
+// write replaced by serializing into a string. Every path first runs over
+// all posts once to warm up, then the same posts are counted again.
+//
+//   ./alloc_bench -n 100000 -a 50 -b 16 -l 64
+
+std::atomic<size_t> allocations(0);
+
+void* operator new(size_t size)
+{
+    allocations++;
+    void* p = malloc(size);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+// Posts kept in each outbox, as in server.cc
+const size_t outbox_limit = 100;
+
+// Timeline - a fresh Timestamp for every post, then one write per follower
+struct PushBefore
+{
+    Message send;
+    std::string wire;
+
+    void Deliver(const Message& recv, int batch_size)
+    {
+        std::string str = recv.msg();
+        send.set_username(recv.username());
+        send.set_msg(str);
+        google::protobuf::Timestamp* timestamp = new google::protobuf::Timestamp();
+        timestamp->set_seconds(recv.timestamp().seconds());
+        timestamp->set_nanos(0);
+        send.set_allocated_timestamp(timestamp);
+        send.SerializeToString(&wire);
+    }
+};
+
+struct Push
+{
+    Message send;
+    std::string wire;
+
+    void Deliver(const Message& recv, int batch_size)
+    {
+        send.set_username(recv.username());
+        send.set_msg(recv.msg());
+        send.mutable_timestamp()->set_seconds(recv.timestamp().seconds());
+        send.mutable_timestamp()->set_nanos(recv.timestamp().nanos());
+        send.set_sequence(recv.sequence());
+        send.SerializeToString(&wire);
+    }
+};
+
+// TimelineBatch - queue for the writer, which drains batch_size posts per frame
+struct QueuedBefore
+{
+    std::vector<Message> pending;
+    std::vector<Message> drained;
+    BatchEncoder encoder;
+    std::string wire;
+
+    void Deliver(const Message& recv, int batch_size)
+    {
+        pending.push_back(recv);
+        if ((int)pending.size() < batch_size) {
+            return;
+        }
+        drained.swap(pending);
+        MessageBatch batch;
+        for (const Message& m : drained) {
+            encoder.Add(m, &batch);
+        }
+        drained.clear();
+        batch.SerializeToString(&wire);
+    }
+};
+
+struct Queued
+{
+    MessageList pending;
+    MessageList drained;
+    MessageBatch batch;
+    BatchEncoder encoder;
+    std::string wire;
+
+    void Deliver(const Message& recv, int batch_size)
+    {
+        pending.Add(recv);
+        if ((int)pending.size() < batch_size) {
+            return;
+        }
+        drained.Swap(&pending);
+        batch.Clear();
+        for (const Message& m : drained) {
+            encoder.Add(m, &batch);
+        }
+        drained.Clear();
+        batch.SerializeToString(&wire);
+    }
+};
+
+// Pull fan-out - into the outbox, pulled every batch_size posts
+struct OutboxBefore
+{
+    std::deque<Message> outbox;
+    uint64_t outbox_end = 0;
+    uint64_t cursor = 0;
+    std::vector<Message> pulled;
+    std::string wire;
+
+    void Deliver(const Message& recv, int batch_size)
+    {
+        outbox.push_back(recv);
+        if (outbox.size() > outbox_limit) {
+            outbox.pop_front();
+        }
+        outbox_end++;
+        if (outbox_end - cursor < (uint64_t)batch_size) {
+            return;
+        }
+
+        pulled.clear();
+        uint64_t first = outbox_end - outbox.size();
+        for (uint64_t i = std::max(cursor, first); i < outbox_end; i++) {
+            pulled.push_back(outbox[i - first]);
+        }
+        cursor = outbox_end;
+        for (const Message& m : pulled) {
+            m.SerializeToString(&wire);
+        }
+    }
+};
+
+struct Outbox
+{
+    std::vector<Message> outbox;
+    uint64_t outbox_end = 0;
+    uint64_t cursor = 0;
+    MessageList pulled;
+    std::string wire;
+
+    void Deliver(const Message& recv, int batch_size)
+    {
+        if (outbox.size() < outbox_limit) {
+            outbox.push_back(recv);
+        }
+        else {
+            CopyPost(recv, &outbox[outbox_end % outbox_limit]);
+        }
+        outbox_end++;
+        if (outbox_end - cursor < (uint64_t)batch_size) {
+            return;
+        }
+
+        pulled.Clear();
+        uint64_t first = outbox_end - outbox.size();
+        for (uint64_t i = std::max(cursor, first); i < outbox_end; i++) {
+            pulled.Add(outbox[i % outbox_limit]);
+        }
+        cursor = outbox_end;
+        for (const Message& m : pulled) {
+            m.SerializeToString(&wire);
+        }
+    }
+};
+
+template <typename Path>
+void Run(const std::string& name, const std::vector<Message>& posts, int batch_size)
+{
+    Path path;
+    for (const Message& m : posts) {
+        path.Deliver(m, batch_size);
+    }
+
+    size_t before = allocations;
+    auto start = std::chrono::steady_clock::now();
+    for (const Message& m : posts) {
+        path.Deliver(m, batch_size);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    size_t counted = allocations - before;
+
+    std::cout << name
+              << "  allocations " << counted
+              << "  allocations/post " << (double)counted / posts.size()
+              << "  ns/post " << seconds * 1e9 / posts.size() << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    int num_posts = 100000;
+    int num_authors = 50;
+    int batch_size = 16;
+    int msg_len = 64;
+
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "n:a:b:l:")) != -1){
+        switch(opt) {
+            case 'n':
+                num_posts = atoi(optarg);break;
+            case 'a':
+                num_authors = atoi(optarg);break;
+            case 'b':
+                batch_size = atoi(optarg);break;
+            case 'l':
+                msg_len = atoi(optarg);break;
+            default:
+                std::cerr << "Invalid Command Line Argument\n";
+        }
+    }
+    if (num_posts <= 0 || num_authors <= 0 || batch_size <= 0 || msg_len < 0) {
+        std::cerr << "Arguments must be positive\n";
+        return -1;
+    }
+
+    // Posts a few hundred ms apart from a fixed set of authors
+    std::vector<Message> posts;
+    int64_t nanos = (int64_t)time(NULL) * 1000000000LL;
+    srand(438);
+    for (int i = 0; i < num_posts; i++) {
+        Message m;
+        m.set_username("user" + std::to_string(rand() % num_authors));
+        m.set_msg(std::string(msg_len, 'a' + (i % 26)));
+        nanos += (rand() % 500) * 1000000LL;
+        NanosToTimestamp(nanos, m.mutable_timestamp());
+        posts.push_back(m);
+    }
+
+    std::cout << num_posts << " posts, " << num_authors << " authors, "
+              << msg_len << " byte messages, batch size " << batch_size << std::endl;
+    Run<PushBefore>("Timeline (fresh Timestamp)     ", posts, batch_size);
+    Run<Push>("Timeline                       ", posts, batch_size);
+    Run<QueuedBefore>("TimelineBatch (fresh messages) ", posts, batch_size);
+    Run<Queued>("TimelineBatch                  ", posts, batch_size);
+    Run<OutboxBefore>("Outbox (deque)                 ", posts, batch_size);
+    Run<Outbox>("Outbox                         ", posts, batch_size);
+
+    return 0;
+}
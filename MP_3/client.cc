@@ -1,5 +1,12 @@
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <random>
 #include <thread>
 #include <vector>
 #include <string>
@@ -12,6 +19,9 @@
 #include "client.h"
 #include "sns.grpc.pb.h"
 #include "coordinator.grpc.pb.h"
+#include "routing_cache.h"
+#include "timeline_batch.h"
+#include "timeline_cache.h"
 using grpc::Channel;
 using grpc::ClientContext;
 using grpc::ClientReader;
@@ -19,30 +29,249 @@ using grpc::ClientReaderWriter;
 using grpc::ClientWriter;
 using grpc::Status;
 using csce438::Message;
+using csce438::MessageBatch;
+using csce438::PageCursor;
 using csce438::ListReply;
+using csce438::ListRequest;
 using csce438::Request;
 using csce438::Reply;
 using csce438::SNSService;
+using csce438::TimelinePage;
+using csce438::TimelinePageRequest;
 using snsCoordinator::SNSCoordinator;
 using snsCoordinator::User;
 using snsCoordinator::Server;
 
-// Login info for the master server
-// TODO - fix for slave switch
-std::string login_info;
+// Channel to the user's master, set again whenever the client rehomes. The
+// SIGINT handler logs out over it.
+std::shared_ptr<Channel> login_channel;
 std::string username = "-1";
 
+// Use TimelineBatch instead of Timeline (-b)
+bool batched = false;
+
+// Send LIST and HISTORY to the server the coordinator picks for reads -
+// the slave while it is caught up (-r)
+bool read_from_slave = false;
+
+// Posts per HISTORY page
+const int history_page_size = 20;
+
+// Users per LIST page
+const int list_page_size = 1000;
+
+// Servers come from the coordinator's routing table, which the client keeps
+// a copy of (routing_cache.h) - it waits up to topology_wait_ms for the
+// first one, and only asks the coordinator directly without it.
+const int topology_wait_ms = 1000;
+
+// A server refuses a user that has moved to another cluster, and one that
+// is down or fenced off refuses everyone. The client logs in wherever the
+// user is now (see Client::Rehome) and tries again, up to max_rehomes times
+// in a row.
+const int max_rehomes = 5;
+
+// Channels to the user's master and its cluster's slave are opened as soon
+// as the routing table names them, so a failover does not wait for a
+// connection. Keepalive pings every keepalive_ms, answered within
+// keepalive_timeout_ms, find a dead server even while no call is made, and
+// fail the calls on its channel instead of leaving them hanging.
+const int keepalive_ms = 1000;
+const int keepalive_timeout_ms = 1000;
+
+// Rehoming logs in on the master in the newest routing table and on the
+// cluster's slave at once - the slave may have been promoted before the
+// table says so. Rounds start reconnect_base_ms apart, doubling up to
+// reconnect_max_ms, with jitter so the clients of a failed master do not all
+// arrive together. A newer table starts the next round at once. After
+// reconnect_timeout_ms without a server taking the user, the client gives up.
+const int reconnect_base_ms = 25;
+const int reconnect_max_ms = 250;
+const int reconnect_timeout_ms = 10000;
+
+struct PageResult {
+    Status status;
+    TimelinePage page;
+};
+
+struct LoginResult {
+    Status status;
+    Reply reply;
+};
+
+// Channel to address, connecting now rather than on the first call
+std::shared_ptr<Channel> WarmChannel(const std::string& address) {
+    grpc::ChannelArguments args;
+    args.SetInt(GRPC_ARG_KEEPALIVE_TIME_MS, keepalive_ms);
+    args.SetInt(GRPC_ARG_KEEPALIVE_TIMEOUT_MS, keepalive_timeout_ms);
+    args.SetInt(GRPC_ARG_KEEPALIVE_PERMIT_WITHOUT_CALLS, 1);
+    args.SetInt(GRPC_ARG_HTTP2_MAX_PINGS_WITHOUT_DATA, 0);
+    // A promoted or restarted server is picked up quickly
+    args.SetInt(GRPC_ARG_INITIAL_RECONNECT_BACKOFF_MS, reconnect_base_ms * 4);
+    args.SetInt(GRPC_ARG_MAX_RECONNECT_BACKOFF_MS, keepalive_ms);
+    std::shared_ptr<Channel> channel = grpc::CreateCustomChannel(address, grpc::InsecureChannelCredentials(), args);
+    channel->GetState(true);
+    return channel;
+}
+
+// Log the user in on the server behind channel, giving up after
+// keepalive_timeout_ms. Servers that are not their cluster's master refuse.
+LoginResult TryLogin(std::shared_ptr<Channel> channel, const std::string& user) {
+    ClientContext context;
+    context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(keepalive_timeout_ms));
+    Request request;
+    request.set_username(user);
+    LoginResult result;
+    result.status = SNSService::NewStub(channel)->Login(&context, request, &result.reply);
+    return result;
+}
+
 Message MakeMessage(const std::string& username, const std::string& msg) {
     Message m;
     m.set_username(username);
     m.set_msg(msg);
-    google::protobuf::Timestamp* timestamp = new google::protobuf::Timestamp();
-    timestamp->set_seconds(time(NULL));
-    timestamp->set_nanos(0);
-    m.set_allocated_timestamp(timestamp);
+    m.mutable_timestamp()->set_seconds(time(NULL));
     return m;
 }
 
+// Posts seen in timeline mode, kept between runs
+std::string CachePath() {
+    return "timeline-" + username + ".cache";
+}
+
+// Show the newest cached posts in the order the INIT history would come in,
+// and ask the server in init for only the ones missing
+void ResumeFromCache(TimelineCache& cache, bool newest_first, Message* init) {
+    const std::vector<Message>& cached = cache.Load();
+    size_t shown = std::min(cached.size(), (size_t)history_page_size);
+    for (size_t i = 0; i < shown; i++) {
+        const Message& m = newest_first ? cached[cached.size() - 1 - i] : cached[cached.size() - shown + i];
+        std::time_t time = m.timestamp().seconds();
+        displayPostMessage(m.username(), m.msg(), time);
+    }
+    if (!cache.Resume(init->mutable_resume())) {
+        //Nothing cached - ask for the full history
+        init->clear_resume();
+    }
+}
+
+// Value of a numeric trailer, false if the server did not send it
+bool TrailerValue(const ClientContext& context, const std::string& key, uint64_t* value) {
+    const auto& trailers = context.GetServerTrailingMetadata();
+    auto it = trailers.find(key);
+    if (it == trailers.end()) {
+        return false;
+    }
+    *value = std::stoull(std::string(it->second.data(), it->second.size()));
+    return true;
+}
+
+// Timeline stream to whichever master has the user. When the user moves,
+// the old master ends the stream with the number of the stream's posts it
+// stored or dropped for going over the rate. The stream is then opened on
+// the new master, asking only for the posts missing from the cache, and the
+// rest of the posts are sent again.
+// A master that fails is left the same way, once keepalive notices - then
+// only the posts that could not be written are known not to be stored. If
+// only the connection failed, the stream is reopened on the same master,
+// and the new stream takes the pushed posts over from the broken one.
+template <class Frame>
+class TimelineStream {
+    public:
+        typedef ClientReaderWriter<Message, Frame> Stream;
+        typedef std::function<std::unique_ptr<Stream>(ClientContext*)> Opener;
+
+        // rehome finds the user's master, false if there is none
+        TimelineStream(Opener open, std::function<bool()> rehome, TimelineCache& cache)
+            : open_(open), rehome_(rehome), cache_(cache) {}
+
+        void Start(const Message& init) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            Open(init);
+        }
+
+        void Post(const Message& m) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            Write(m);
+        }
+
+        // Next frame, following the user to its new master. False once the
+        // stream has ended for good. Only the reader thread replaces the
+        // stream, so it reads without the lock.
+        bool Read(Frame* frame) {
+            for (int rehomes = 0; ; rehomes++) {
+                if (stream_->Read(frame)) {
+                    return true;
+                }
+
+                std::lock_guard<std::mutex> lock(mutex_);
+                Status status = stream_->Finish();
+                if (status.error_code() != grpc::StatusCode::UNAVAILABLE || rehomes >= max_rehomes) {
+                    log(INFO, "Timeline ended - " + status.error_message());
+                    return false;
+                }
+                std::vector<Message> unstored;
+                uint64_t stored;
+                if (TrailerValue(*context_, "stored-posts", &stored)) {
+                    unstored.assign(written_.begin() + std::min((size_t)stored, written_.size()), written_.end());
+                } else {
+                    unstored = unsent_;
+                    if (written_.size() > unsent_.size()) {
+                        log(INFO, std::to_string(written_.size() - unsent_.size()) +
+                            " posts went to the lost server and are stored only if it replicated them");
+                    }
+                }
+                log(INFO, "Timeline moving - " + status.error_message() + ", " +
+                    std::to_string(unstored.size()) + " posts to resend");
+                if (!rehome_()) {
+                    log(INFO, "Timeline ended - no server took the user");
+                    return false;
+                }
+
+                // Only what the cache does not have yet comes back
+                Message init = MakeMessage(username_, "INIT");
+                if (!cache_.Resume(init.mutable_resume())) {
+                    init.clear_resume();
+                }
+                Open(init);
+                for (const Message& m : unstored) {
+                    Write(m);
+                }
+            }
+        }
+
+    private:
+        void Open(const Message& init) {
+            username_ = init.username();
+            stream_.reset();
+            context_.reset(new ClientContext);
+            stream_ = open_(context_.get());
+            written_.clear();
+            unsent_.clear();
+            stream_->Write(init);
+        }
+
+        void Write(const Message& m) {
+            written_.push_back(m);
+            if (!stream_->Write(m)) {
+                unsent_.push_back(m);
+            }
+        }
+
+        Opener open_;
+        std::function<bool()> rehome_;
+        TimelineCache& cache_;
+        std::string username_;
+
+        std::mutex mutex_;
+        std::unique_ptr<ClientContext> context_;
+        std::unique_ptr<Stream> stream_;
+        // Posts written to this stream, in order, and those of them the
+        // stream would not take
+        std::vector<Message> written_;
+        std::vector<Message> unsent_;
+};
+
 // Signal the server that the client has SIGINTed - connected = false
 void sig_handler(int sig) {
     ClientContext ctx;
@@ -52,8 +281,10 @@ void sig_handler(int sig) {
     request.set_username(username);
     request.add_arguments("SIGINT");
 
-    std::unique_ptr<SNSService::Stub> stub = std::unique_ptr<SNSService::Stub>(SNSService::NewStub(grpc::CreateChannel(login_info, grpc::InsecureChannelCredentials())));
-    Status status = stub->Login(&ctx, request, &reply);
+    std::shared_ptr<Channel> channel = std::atomic_load(&login_channel);
+    if (channel) {
+        Status status = SNSService::NewStub(channel)->Login(&ctx, request, &reply);
+    }
     std::cout << "\n";
 
     exit(0);
@@ -81,12 +312,48 @@ class Client : public IClient
         // as a member variable.
         std::unique_ptr<SNSService::Stub> stub_;
         std::unique_ptr<SNSCoordinator::Stub> coord_stub_;
+        std::unique_ptr<RoutingCache> routes_;
+        // Version of the routing table the stubs were made from
+        uint64_t routes_version_ = 0;
+
+        // Open channels to the user's master and slave, by address
+        std::mutex channels_mutex_;
+        std::map<std::string, std::shared_ptr<Channel>> channels_;
+
+        // With -r, the slave reads go to. Null if they go to the master.
+        std::unique_ptr<SNSService::Stub> read_stub_;
+        // Newest session token from a write, sent with reads so the slave
+        // only answers once it has what this client wrote
+        std::string session_token_;
+
+        // Next HISTORY page, requested while the current one is shown, and
+        // the server paging through - cursors only work where they were made
+        std::future<PageResult> next_page_;
+        SNSService::Stub* page_stub_ = nullptr;
+
+        // Last complete LIST, and its version to send with the next one
+        std::vector<std::string> known_users_;
+        std::vector<std::string> known_followers_;
+        std::string known_version_;
 
         IReply Login();
         IReply List();
+        IReply ListFrom(SNSService::Stub* stub);
         IReply Follow(const std::string& username2);
         // IReply UnFollow(const std::string& username2);
+        IReply History();
+        std::future<PageResult> FetchPage(SNSService::Stub* stub, const PageCursor* cursor);
+        bool AskMaster(RoutingCache::Route* master);
+        std::shared_ptr<Channel> ChannelTo(const std::string& address);
+        void WarmUp(const RoutingCache::Table& table);
+        void UseMaster(const RoutingCache::Route& master);
+        void ConnectReads();
+        SNSService::Stub* ReadStub();
+        void KeepToken(const std::string& token);
+        bool Rehome();
+        IReply Retry(const std::function<IReply()>& command);
         void Timeline(const std::string& username);
+        void TimelineBatch(const std::string& username);
 
 
 };
@@ -103,10 +370,42 @@ int Client::connectTo()
     // Please refer to gRpc tutorial how to create a stub.
 	// ------------------------------------------------------------
 
-    // Contact C for server IP and Port
-    std::string coord_info = hostname + ":" + port;
-    coord_stub_ = std::unique_ptr<SNSCoordinator::Stub>(SNSCoordinator::NewStub(grpc::CreateChannel(coord_info, grpc::InsecureChannelCredentials())));
+    // Contact C for the routing table, kept current from then on
+    if (!coord_stub_) {
+        std::string coord_info = hostname + ":" + port;
+        coord_stub_ = std::unique_ptr<SNSCoordinator::Stub>(SNSCoordinator::NewStub(grpc::CreateChannel(coord_info, grpc::InsecureChannelCredentials())));
+        routes_.reset(new RoutingCache(coord_stub_.get()));
+        routes_->Start([this](const RoutingCache::Table& table) { WarmUp(table); });
+        routes_->WaitNewer(0, topology_wait_ms);
+    }
 
+    std::shared_ptr<const RoutingCache::Table> table = routes_->Current();
+    routes_version_ = table->version();
+    RoutingCache::Route master;
+    if (!table->Master(std::stoi(username), &master) && !AskMaster(&master)) {
+        return -1;
+    }
+
+    // Connect to the user's master server
+    displayReConnectionMessage(master.ip, master.port);
+    UseMaster(master);
+
+    IReply ire = Login();
+    if (!ire.grpc_status.ok()) {
+        return -1;
+    }
+    if (ire.comm_status != SUCCESS) {
+        return -1;
+    }
+    if (read_from_slave) {
+        ConnectReads();
+    }
+    return 1;
+}
+
+// Ask the coordinator for the user's master, for when there is no routing
+// table yet
+bool Client::AskMaster(RoutingCache::Route* master) {
     glog(INFO, "Fetching Server");
     ClientContext ctx;
     Server server;
@@ -117,22 +416,165 @@ int Client::connectTo()
 
     if (!status.ok()) {
         log(INFO, "GetServer failed")
-        return -1;
+        return false;
     }
+    master->ip = server.server_ip();
+    master->port = server.port_num();
+    return true;
+}
 
-    // Connect to returned master server
-    displayReConnectionMessage(server.server_ip(), server.port_num());
-    login_info = server.server_ip() + ":" + server.port_num();
-    stub_ = std::unique_ptr<SNSService::Stub>(SNSService::NewStub(grpc::CreateChannel(login_info, grpc::InsecureChannelCredentials())));
+// The open channel to address, or a new one
+std::shared_ptr<Channel> Client::ChannelTo(const std::string& address) {
+    std::lock_guard<std::mutex> lock(channels_mutex_);
+    std::shared_ptr<Channel>& channel = channels_[address];
+    if (!channel) {
+        channel = WarmChannel(address);
+    }
+    return channel;
+}
 
-    IReply ire = Login();
-    if (!ire.grpc_status.ok()) {
-        return -1;
+// Open channels to the servers table has for the user, and close the rest.
+// Called on the routing cache's thread with every new table.
+void Client::WarmUp(const RoutingCache::Table& table) {
+    int cluster = table.Cluster(std::stoi(username));
+    std::map<std::string, std::shared_ptr<Channel>> warm;
+    std::lock_guard<std::mutex> lock(channels_mutex_);
+    for (snsCoordinator::ServerType type : {snsCoordinator::MASTER, snsCoordinator::SLAVE}) {
+        RoutingCache::Route route;
+        if (table.Find(cluster, type, &route)) {
+            auto it = channels_.find(route.Address());
+            warm[route.Address()] = it != channels_.end() ? it->second : WarmChannel(route.Address());
+        }
     }
-    if (ire.comm_status != SUCCESS) {
-        return -1;
+    // Stubs still using a closed channel keep it alive
+    channels_.swap(warm);
+}
+
+void Client::UseMaster(const RoutingCache::Route& master) {
+    std::shared_ptr<Channel> channel = ChannelTo(master.Address());
+    stub_ = SNSService::NewStub(channel);
+    std::atomic_store(&login_channel, channel);
+}
+
+// Find where reads should go in the routing table, or ask the coordinator
+// if there is none yet
+void Client::ConnectReads() {
+    std::shared_ptr<const RoutingCache::Table> table = routes_->Current();
+    RoutingCache::Route route;
+    bool slave = false;
+    if (table->version() > 0) {
+        table->ReadServer(std::stoi(username), &route, &slave);
+    } else {
+        ClientContext ctx;
+        Server server;
+        User user;
+        user.set_user_id(std::stoi(username));
+        Status status = coord_stub_->GetReadServer(&ctx, user, &server);
+        slave = status.ok() && server.server_type() == snsCoordinator::SLAVE;
+        route.ip = server.server_ip();
+        route.port = server.port_num();
     }
-    return 1;
+    if (!slave) {
+        log(INFO, "Reads go to the master");
+        return;
+    }
+    std::string read_info = route.Address();
+    log(INFO, "Reads go to the slave at " + read_info);
+    read_stub_ = SNSService::NewStub(ChannelTo(read_info));
+}
+
+SNSService::Stub* Client::ReadStub() {
+    return read_stub_ ? read_stub_.get() : stub_.get();
+}
+
+// This client's writes are made one at a time, so the last token is the newest
+void Client::KeepToken(const std::string& token) {
+    if (!token.empty()) {
+        session_token_ = token;
+    }
+}
+
+// The user has moved, or its master is gone. Log in on its master in the
+// newest routing table and on the cluster's slave at once, in rounds until
+// one takes the user - see reconnect_base_ms. False if none did in time.
+bool Client::Rehome() {
+    // A HISTORY page being read from the old servers finishes first
+    if (next_page_.valid()) {
+        next_page_.wait();
+    }
+    next_page_ = std::future<PageResult>();
+    page_stub_ = nullptr;
+    read_stub_.reset();
+
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point start = Clock::now();
+    Clock::time_point deadline = start + std::chrono::milliseconds(reconnect_timeout_ms);
+    std::mt19937 random(std::random_device{}());
+    std::uniform_real_distribution<double> jitter(0.5, 1.0);
+    int delay_ms = reconnect_base_ms;
+    int user_id = std::stoi(username);
+    while (true) {
+        std::shared_ptr<const RoutingCache::Table> table = routes_->Current();
+        routes_version_ = table->version();
+        int cluster = table->Cluster(user_id);
+        // The master first - it wins if both take the user
+        std::vector<RoutingCache::Route> candidates;
+        RoutingCache::Route route;
+        if (table->Find(cluster, snsCoordinator::MASTER, &route) || (table->version() == 0 && AskMaster(&route))) {
+            candidates.push_back(route);
+        }
+        if (table->Find(cluster, snsCoordinator::SLAVE, &route)) {
+            candidates.push_back(route);
+        }
+
+        std::vector<std::future<LoginResult>> attempts;
+        for (const RoutingCache::Route& candidate : candidates) {
+            attempts.push_back(std::async(std::launch::async, TryLogin, ChannelTo(candidate.Address()), username));
+        }
+        int chosen = -1;
+        Status refused(grpc::StatusCode::UNAVAILABLE, "No server for the user's cluster");
+        for (size_t i = 0; i < attempts.size(); i++) {
+            LoginResult result = attempts[i].get();
+            if (chosen < 0 && result.status.ok()) {
+                chosen = i;
+                KeepToken(result.reply.session_token());
+            } else if (!result.status.ok()) {
+                refused = result.status;
+            }
+        }
+        if (chosen >= 0) {
+            displayReConnectionMessage(candidates[chosen].ip, candidates[chosen].port);
+            UseMaster(candidates[chosen]);
+            log(INFO, "Logged in at " + candidates[chosen].Address() + " after " +
+                std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start).count()) + "ms");
+            if (read_from_slave) {
+                ConnectReads();
+            }
+            return true;
+        }
+
+        Clock::time_point now = Clock::now();
+        if (now >= deadline) {
+            log(INFO, "No server took the user - " + refused.error_message());
+            return false;
+        }
+        int64_t left_ms = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count();
+        routes_->WaitNewer(routes_version_, (int)(std::min((int64_t)delay_ms, left_ms) * jitter(random)));
+        delay_ms = std::min(delay_ms * 2, reconnect_max_ms);
+    }
+}
+
+// Run a command, and again wherever the user is now if it was refused
+IReply Client::Retry(const std::function<IReply()>& command) {
+    IReply ire = command();
+    for (int i = 0; i < max_rehomes && ire.grpc_status.error_code() == grpc::StatusCode::UNAVAILABLE; i++) {
+        log(INFO, "Command refused - " + ire.grpc_status.error_message());
+        if (!Rehome()) {
+            break;
+        }
+        ire = command();
+    }
+    return ire;
 }
 
 IReply Client::processCommand(std::string& input)
@@ -199,7 +641,7 @@ IReply Client::processCommand(std::string& input)
         std::string argument = input.substr(index+1, (input.length()-index));
 
         if (cmd == "FOLLOW") {
-            return Follow(argument);
+            return Retry([&]() { return Follow(argument); });
         } 
         // else if(cmd == "UNFOLLOW") {
         //     return UnFollow(argument);
@@ -207,12 +649,15 @@ IReply Client::processCommand(std::string& input)
     } 
     else {
         if (input == "LIST") {
-            return List();
+            return Retry([&]() { return List(); });
         } 
         else if (input == "TIMELINE") {
             ire.comm_status = SUCCESS;
             return ire;
         }
+        else if (input == "HISTORY") {
+            return Retry([&]() { return History(); });
+        }
     }
 
     ire.comm_status = FAILURE_INVALID;
@@ -221,7 +666,12 @@ IReply Client::processCommand(std::string& input)
 
 void Client::processTimeline()
 {
-    Timeline(username);
+    if (batched) {
+        TimelineBatch(username);
+    }
+    else {
+        Timeline(username);
+    }
 	// ------------------------------------------------------------
     // In this function, you are supposed to get into timeline mode.
     // You may need to call a service method to communicate with
@@ -240,33 +690,67 @@ void Client::processTimeline()
 	// ------------------------------------------------------------
 }
 
+// Reads every page of the user directory. The listing is cached, so after
+// the first LIST the server only sends users added since, or "not modified".
+// A slave that is behind says so, and the master is asked instead.
 IReply Client::List() {
-    //Data being sent to the server
-    Request request;
-    request.set_username(username);
-
-    //Container for the data from the server
-    ListReply list_reply;
-
-    //Context for the client
-    ClientContext context;
+    IReply ire = ListFrom(ReadStub());
+    if (read_stub_ && ire.grpc_status.error_code() == grpc::StatusCode::UNAVAILABLE) {
+        log(INFO, "Slave cannot serve LIST - " + ire.grpc_status.error_message());
+        ire = ListFrom(stub_.get());
+    }
+    return ire;
+}
 
-    Status status = stub_->List(&context, request, &list_reply);
+IReply Client::ListFrom(SNSService::Stub* stub) {
     IReply ire;
-    ire.grpc_status = status;
-    //Loop through list_reply.all_users and list_reply.following_users
-    //Print out the name of each room
-    if(status.ok()){
-        ire.comm_status = SUCCESS;
-        std::string all_users;
-        std::string following_users;
-        for(std::string s : list_reply.all_users()){
-            ire.all_users.push_back(s);
+    std::vector<std::string> users = known_users_;
+    ListReply list_reply;
+    std::string cursor;
+
+    do {
+        //Data being sent to the server
+        ListRequest request;
+        request.set_username(username);
+        request.set_page_size(list_page_size);
+        request.set_cursor(cursor);
+        request.set_known_version(known_version_);
+        request.set_session_token(session_token_);
+
+        //Context for the client
+        ClientContext context;
+        list_reply.Clear();
+
+        Status status = stub->List(&context, request, &list_reply);
+        ire.grpc_status = status;
+        if (!status.ok()) {
+            // The server restarted while we were paging - start over next time
+            known_version_.clear();
+            known_users_.clear();
+            ire.comm_status = FAILURE_UNKNOWN;
+            return ire;
+        }
+        if (list_reply.not_modified()) {
+            break;
+        }
+        if (cursor.empty() && !list_reply.delta()) {
+            users.clear();
         }
-        for(std::string s : list_reply.followers()){
-            ire.followers.push_back(s);
+        for (const std::string& s : list_reply.all_users()) {
+            users.push_back(s);
         }
+        cursor = list_reply.next_cursor();
+    } while (!cursor.empty());
+
+    if (!list_reply.not_modified()) {
+        known_users_ = users;
+        known_followers_.assign(list_reply.followers().begin(), list_reply.followers().end());
+        known_version_ = list_reply.directory_version();
     }
+
+    ire.comm_status = SUCCESS;
+    ire.all_users = known_users_;
+    ire.followers = known_followers_;
     return ire;
 }
         
@@ -280,6 +764,7 @@ IReply Client::Follow(const std::string& username2) {
 
     Status status = stub_->Follow(&context, request, &reply);
     IReply ire; ire.grpc_status = status;
+    KeepToken(reply.session_token());
 
     if (reply.msg() == "Follow Failed - Invalid Username") {
         ire.comm_status = FAILURE_INVALID_USERNAME;
@@ -296,6 +781,62 @@ IReply Client::Follow(const std::string& username2) {
     return ire;
 }
 
+// Each HISTORY shows the next older page of the timeline, starting over from
+// the newest once the oldest page has been shown
+IReply Client::History() {
+    if (!next_page_.valid()) {
+        page_stub_ = ReadStub();
+        next_page_ = FetchPage(page_stub_, nullptr);
+    }
+    PageResult result = next_page_.get();
+    if (page_stub_ != stub_.get() && result.status.error_code() == grpc::StatusCode::UNAVAILABLE) {
+        // The slave's cursors mean nothing to the master, so start over
+        log(INFO, "Slave cannot serve HISTORY - " + result.status.error_message());
+        page_stub_ = stub_.get();
+        result = FetchPage(page_stub_, nullptr).get();
+    }
+
+    IReply ire;
+    ire.grpc_status = result.status;
+    if (!result.status.ok()) {
+        ire.comm_status = FAILURE_UNKNOWN;
+        return ire;
+    }
+
+    // Get the page after this one while this one is printed
+    if (result.page.has_next_cursor()) {
+        next_page_ = FetchPage(page_stub_, &result.page.next_cursor());
+    }
+
+    for (const Message& m : result.page.posts()) {
+        std::time_t time = m.timestamp().seconds();
+        displayPostMessage(m.username(), m.msg(), time);
+    }
+    if (!result.page.has_next_cursor()) {
+        std::cout << "-- No older posts --" << std::endl;
+    }
+    ire.comm_status = SUCCESS;
+    return ire;
+}
+
+// Request a page from stub in the background - the newest if cursor is null
+std::future<PageResult> Client::FetchPage(SNSService::Stub* stub, const PageCursor* cursor) {
+    TimelinePageRequest request;
+    request.set_username(username);
+    request.set_limit(history_page_size);
+    request.set_session_token(session_token_);
+    if (cursor != nullptr) {
+        *request.mutable_cursor() = *cursor;
+    }
+
+    return std::async(std::launch::async, [stub, request]() {
+        ClientContext context;
+        PageResult result;
+        result.status = stub->GetTimelinePage(&context, request, &result.page);
+        return result;
+    });
+}
+
 IReply Client::Login() {
     Request request;
     request.set_username(username);
@@ -306,6 +847,7 @@ IReply Client::Login() {
 
     IReply ire;
     ire.grpc_status = status;
+    KeepToken(reply.session_token());
     if (reply.msg() == "You have already logged in!") {
         ire.comm_status = FAILURE_ALREADY_EXISTS;
     } else {
@@ -315,26 +857,34 @@ IReply Client::Login() {
 }
 
 void Client::Timeline(const std::string& username) {
-    ClientContext context;
+    TimelineCache cache(CachePath());
+    //Only posts missing from the cache are sent back
+    Message init = MakeMessage(username, "INIT");
+    ResumeFromCache(cache, true, &init);
 
-    std::shared_ptr<ClientReaderWriter<Message, Message>> stream(stub_->Timeline(&context));
+    TimelineStream<Message> stream([this](ClientContext* context) { return stub_->Timeline(context); },
+                                   [this]() { return Rehome(); }, cache);
+    stream.Start(init);
 
     //Thread used to read chat messages and send them to the server
-    std::thread writer([username, stream]() {
-        std::string input = "INIT";
-        Message m = MakeMessage(username, input);
-        stream->Write(m);
+    std::thread writer([username, &stream]() {
+        std::string input;
+        Message m;
         while (1) {
             input = getPostMessage();
             m = MakeMessage(username, input);
-            stream->Write(m);
+            //Cached once the server sends it back numbered
+            stream.Post(m);
         }
-        stream->WritesDone();
     });
 
-    std::thread reader([username, stream]() {
+    std::thread reader([&stream, &cache]() {
         Message m;
-        while(stream->Read(&m)){
+        while(stream.Read(&m)){
+            //Already shown if it is cached
+            if (!cache.Add(m)) {
+                continue;
+            }
             google::protobuf::Timestamp temptime = m.timestamp();
             std::time_t time = temptime.seconds();
             displayPostMessage(m.username(), m.msg(), time);
@@ -346,13 +896,58 @@ void Client::Timeline(const std::string& username) {
     reader.join();
 }
 
+void Client::TimelineBatch(const std::string& username) {
+    TimelineCache cache(CachePath());
+    //Only posts missing from the cache are sent back
+    Message init = MakeMessage(username, "INIT");
+    ResumeFromCache(cache, false, &init);
+
+    TimelineStream<MessageBatch> stream([this](ClientContext* context) { return stub_->TimelineBatch(context); },
+                                        [this]() { return Rehome(); }, cache);
+    stream.Start(init);
+
+    //Thread used to read chat messages and send them to the server
+    std::thread writer([username, &stream]() {
+        std::string input;
+        Message m;
+        while (1) {
+            input = getPostMessage();
+            m = MakeMessage(username, input);
+            //Cached once the server sends it back numbered
+            stream.Post(m);
+        }
+    });
+
+    //Each frame may carry several posts
+    std::thread reader([&stream, &cache]() {
+        BatchDecoder decoder;
+        MessageBatch batch;
+        std::vector<Message> posts;
+        while(stream.Read(&batch)){
+            posts.clear();
+            decoder.Decode(batch, &posts);
+            for (Message& m : posts) {
+                if (!cache.Add(m)) {
+                    continue;
+                }
+                std::time_t time = m.timestamp().seconds();
+                displayPostMessage(m.username(), m.msg(), time);
+            }
+        }
+    });
+
+    //Wait for the threads to finish
+    writer.join();
+    reader.join();
+}
+
 int main(int argc, char** argv) {
 
     std::string hostname = "0.0.0.0";
     std::string port = "8000";
     
     int opt = 0;
-    while ((opt = getopt(argc, argv, "c:p:i:")) != -1){
+    while ((opt = getopt(argc, argv, "c:p:i:br")) != -1){
         switch(opt) {
             case 'c':
                 hostname = optarg;break;
@@ -360,6 +955,10 @@ int main(int argc, char** argv) {
                 port = optarg;break;
             case 'i':
                 username = optarg;break;
+            case 'b':
+                batched = true;break;
+            case 'r':
+                read_from_slave = true;break;
             default:
                 std::cerr << "Invalid Command Line Argument\n";
         }
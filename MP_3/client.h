@@ -98,6 +98,7 @@ void IClient::displayTitle() const
     // std::cout << " UNFOLLOW <username>\n";
     std::cout << " LIST\n";
     std::cout << " TIMELINE\n";
+    std::cout << " HISTORY\n";
     std::cout << "=====================================\n";
 }
 
@@ -119,7 +120,7 @@ std::string IClient::getCommand() const
 			input = cmd + " " + argument;
 		} else {
 			toUpperCase(input);
-			if (input != "LIST" && input != "TIMELINE") {
+			if (input != "LIST" && input != "TIMELINE" && input != "HISTORY") {
 				std::cout << "Invalid Command\n";
 				continue;
 			}
@@ -3,6 +3,12 @@
 #include <google/protobuf/timestamp.pb.h>
 #include <google/protobuf/duration.pb.h>
 
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
 #include <vector>
 #include <fstream>
 #include <iostream>
@@ -17,10 +23,14 @@
 
 #include "sns.grpc.pb.h"
 #include "coordinator.grpc.pb.h"
+#include "hash_ring.h"
+#include "server_registry.h"
+#include "timer_wheel.h"
 
 using google::protobuf::Timestamp;
 using google::protobuf::Duration;
 // using grpc::Server;
+using grpc::ClientContext;
 using grpc::ServerBuilder;
 using grpc::ServerContext;
 using grpc::ServerReader;
@@ -38,64 +48,259 @@ using snsCoordinator::MASTER;
 using snsCoordinator::SLAVE;
 using snsCoordinator::SYNC;
 using snsCoordinator::Server;
+using snsCoordinator::Placement;
+using snsCoordinator::ClusterPlacement;
+using snsCoordinator::Migration;
+using snsCoordinator::MigrationResult;
+using snsCoordinator::Topology;
+using snsCoordinator::TopologyRequest;
+using csce438::SNSService;
+using csce438::ExportRequest;
+using csce438::ReplicationBatch;
+using csce438::ReplicationEntry;
+using csce438::UserMove;
+using csce438::Reply;
 using google::protobuf::util::TimeUtil;
 
 
-struct server_t {
-    int server_id;
-    std::string ip;
-    std::string port;
-    ServerType type;
-    Timestamp timestamp;
-    bool active = true;
+// Masters, slaves and followsyncs by cluster
+ServerRegistry registry;
+
+// A master or slave is dropped once the phi-accrual detector over its
+// heartbeats passes phi_threshold (-P), or after max_silence_ms (-x) without
+// one, and a dead master's slave takes over if it is ready. -s is the least
+// standard deviation the detector assumes and -a a pause it always allows,
+// both in ms. Each server's next check is kept on a wheel that turns every
+// expiry_tick_ms. A server whose heartbeat stream ends is dropped at once.
+double phi_threshold = 8;
+int max_silence_ms = 10000;
+double phi_min_std_ms = 200;
+double phi_pause_ms = 0;
+const int expiry_tick_ms = 50;
+const size_t expiry_slots = 256;
+TimerWheel expiry_wheel(expiry_slots, expiry_tick_ms);
+
+// Heartbeat streams by server, so a slave can be told of its promotion at
+// once. The handler and the expiry thread both write to a stream.
+struct BeatStream {
+    std::mutex mutex;
+    ServerReaderWriter<Heartbeat, Heartbeat>* stream;
 };
+std::mutex beat_streams_mutex;
+std::map<ServerRegistry::Key, std::shared_ptr<BeatStream>> beat_streams;
+
+// Users are placed on the clusters whose masters have registered
+std::mutex ring_mutex;
+HashRing ring;
+int ring_changes = 0;
+double ring_last_moved = 0;
+std::map<int, uint64_t> ring_lookups;
+
+// Users MigrateUser moved off the cluster the ring gives them, and the
+// users being moved now
+std::map<int, int> user_overrides;
+std::set<int> migrating;
+
+// A migration copies in rounds, each of what changed during the last, until
+// one copies at most this many posts or there have been max rounds. The
+// user's writes are then refused for one last round and the cutover.
+const uint64_t migration_cutover_posts = 100;
+const int max_migration_rounds = 10;
+
+// Routing table version, bumped by every change a WatchTopology stream
+// passes on: servers joining, leaving or being promoted, slaves becoming
+// ready or falling behind, and users being moved. Streams that have seen
+// no change write nothing.
+std::mutex topology_mutex;
+std::condition_variable topology_cv;
+uint64_t topology_version = 1;
+// How often an idle WatchTopology stream checks it is still wanted
+const int topology_poll_ms = 1000;
+
+void TopologyChanged() {
+    {
+        std::lock_guard<std::mutex> lock(topology_mutex);
+        topology_version++;
+    }
+    topology_cv.notify_all();
+}
 
-// Store Master servers
-std::vector<server_t> master_table;
+// The routing table as of version
+void BuildTopology(uint64_t version, Topology* topology) {
+    topology->set_version(version);
+    for (const auto& route : *registry.Snapshot()) {
+        const server_t& s = route.second;
+        snsCoordinator::Route* r = topology->add_routes();
+        r->set_cluster(s.server_id);
+        r->set_server_type(s.type);
+        r->set_server_ip(s.ip);
+        r->set_port_num(s.port);
+        r->set_ready(s.ready);
+        r->set_epoch(registry.Epoch(s.server_id));
+    }
+    std::lock_guard<std::mutex> lock(ring_mutex);
+    for (int cluster : ring.clusters()) {
+        topology->add_ring_clusters(cluster);
+    }
+    for (const auto& moved : user_overrides) {
+        topology->add_moved_users(moved.first);
+        topology->add_moved_to(moved.second);
+    }
+}
 
-// Store Slave servers
-std::vector<server_t> slave_table;
+// Add a cluster to the ring and log how many users it took
+void AddCluster(int cluster) {
+    std::lock_guard<std::mutex> lock(ring_mutex);
+    if (ring.Contains(cluster)) {
+        return;
+    }
+    HashRing before = ring;
+    ring.Add(cluster);
+    ring_changes++;
+    ring_last_moved = HashRing::Moved(before, ring);
+    log(INFO, "Cluster " + std::to_string(cluster) + " joined the ring - " +
+        std::to_string(ring.clusters().size()) + " clusters, " +
+        std::to_string((int)(ring_last_moved * 100)) + "% of users moved");
+}
 
-// Store FollowSyncs
-std::vector<server_t> sync_table;
+// Take a cluster that has lost both its master and its slave off the ring,
+// so its users are placed on the others until it comes back
+void RemoveCluster(int cluster) {
+    std::lock_guard<std::mutex> lock(ring_mutex);
+    if (!ring.Contains(cluster)) {
+        return;
+    }
+    HashRing before = ring;
+    ring.Remove(cluster);
+    ring_changes++;
+    ring_last_moved = HashRing::Moved(before, ring);
+    log(WARNING, "Cluster " + std::to_string(cluster) + " left the ring - " +
+        std::to_string(ring.clusters().size()) + " clusters, " +
+        std::to_string((int)(ring_last_moved * 100)) + "% of users moved");
+}
 
-int find_server(int id, ServerType type) {
-    int index = 0;
-    switch(type) {
-        case MASTER:
-            for(server_t s : master_table) {
-                if(s.server_id == id) {
-                    return index;
-                }
-                index++;
-            }
-            break;
+// Cluster a user belongs to without counting it, -1 if none has registered.
+// Needs ring_mutex.
+int FindCluster(int user_id) {
+    auto it = user_overrides.find(user_id);
+    return it == user_overrides.end() ? ring.LookupUser(user_id) : it->second;
+}
 
-        case SLAVE:
-            for(server_t s : slave_table) {
-                if(s.server_id == id) {
-                    return index;
-                }
-                index++;
-            }
-            break;
+// Cluster a user belongs to, -1 if none has registered
+int PlaceUser(int user_id) {
+    std::lock_guard<std::mutex> lock(ring_mutex);
+    int cluster = FindCluster(user_id);
+    if (cluster >= 0) {
+        ring_lookups[cluster]++;
+    }
+    return cluster;
+}
 
-        case SYNC:
-            for(server_t s : sync_table) {
-                if(s.server_id == id) {
-                    return index;
-                }
-                index++;
+int64_t SteadyNanos() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+std::string ServerName(const server_t& s) {
+    std::string type = s.type == MASTER ? "Master" : s.type == SLAVE ? "Slave" : "Followsync";
+    return type + " of cluster " + std::to_string(s.server_id) + " at port " + s.port;
+}
+
+uint64_t TimerKey(const ServerRegistry::Key& key) {
+    return ((uint64_t)(uint32_t)key.first << 2) | key.second;
+}
+
+ServerRegistry::Key FromTimerKey(uint64_t timer) {
+    return ServerRegistry::Key((int)(uint32_t)(timer >> 2), (ServerType)(timer & 3));
+}
+
+// False if the server has no heartbeat stream open
+bool SendBeat(const ServerRegistry::Key& key, const Heartbeat& beat) {
+    std::shared_ptr<BeatStream> beats;
+    {
+        std::lock_guard<std::mutex> lock(beat_streams_mutex);
+        auto it = beat_streams.find(key);
+        if (it == beat_streams.end()) {
+            return false;
+        }
+        beats = it->second;
+    }
+    std::lock_guard<std::mutex> lock(beats->mutex);
+    return beats->stream != nullptr && beats->stream->Write(beat);
+}
+
+// "<n>ms without a heartbeat (phi <n>, mean gap <n>ms)"
+std::string Silence(const ServerRegistry::Expired& expired, int64_t now) {
+    return std::to_string((now - expired.server.last_beat_ns) / 1000000) + "ms without a heartbeat (phi " +
+        std::to_string(expired.phi) + ", mean gap " + std::to_string((int64_t)expired.mean_ms) + "ms)";
+}
+
+// Drop the server at key if it is suspected, or at once if closed is the
+// last heartbeat of its ended stream, and promote its slave if it was a master
+void ExpireServer(const ServerRegistry::Key& key, const Heartbeat* closed) {
+    int64_t now = SteadyNanos();
+    ServerRegistry::Expired expired = registry.Expire(key, now, closed);
+    switch (expired.expiry) {
+        case ServerRegistry::NOT_DUE:
+            // Checked a little early - the wheel rounds to its ticks
+            if (expired.check_ms > 0) {
+                expiry_wheel.Schedule(TimerKey(key), expired.check_ms);
             }
-            break;
+            return;
+        case ServerRegistry::REMOVED: {
+            server_t other;
+            if (!registry.Find(key.first, MASTER, &other) && !registry.Find(key.first, SLAVE, &other)) {
+                RemoveCluster(key.first);
+            }
+            TopologyChanged();
+            log(WARNING, ServerName(expired.server) + " is gone after " + Silence(expired, now) +
+                " - removed" + (key.second == MASTER ? ", and the cluster has no ready slave" : ""));
+            return;
+        }
+        case ServerRegistry::PROMOTED: {
+            const server_t& promoted = expired.promoted;
+            TopologyChanged();
+            expiry_wheel.Schedule(TimerKey(key), expired.check_ms);
+            Heartbeat promote;
+            promote.set_server_id(key.first);
+            promote.set_server_type(MASTER);
+            promote.set_epoch(registry.Epoch(key.first));
+            bool told = SendBeat(ServerRegistry::Key(key.first, SLAVE), promote);
+            log(WARNING, ServerName(expired.server) + " is gone after " + Silence(expired, now) +
+                " - promoted its slave at port " + promoted.port + " in epoch " +
+                std::to_string(promote.epoch()) + (told ? ", told it in " + std::to_string((SteadyNanos() - now) / 1000) + "us"
+                                                        : ", it hears with its next heartbeat"));
+            return;
+        }
     }
-    return -1;
 }
 
+void expiry_thread() {
+    std::vector<uint64_t> expired;
+    auto next = std::chrono::steady_clock::now();
+    while (true) {
+        next += std::chrono::milliseconds(expiry_wheel.tick_ms());
+        std::this_thread::sleep_until(next);
+        expired.clear();
+        expiry_wheel.Advance(&expired);
+        for (uint64_t timer : expired) {
+            ExpireServer(FromTimerKey(timer), nullptr);
+        }
+    }
+}
+
+Status Migrate(int user_id, int from, int to, MigrationResult* result);
+
 class SNSCoordinatorImpl final : public SNSCoordinator::Service {
     
     Status HandleHeartBeats(ServerContext* context, ServerReaderWriter<Heartbeat, Heartbeat>* stream) override {
         Heartbeat beat;
+        std::shared_ptr<BeatStream> beats = std::make_shared<BeatStream>();
+        beats->stream = stream;
+        bool registered = false;
+        ServerRegistry::Key key;
+        // The beat that last registered the stream - says which server it is
+        Heartbeat owner;
         while (stream->Read(&beat)) {
             switch(beat.server_type()) {
                 case MASTER:
@@ -109,50 +314,79 @@ class SNSCoordinatorImpl final : public SNSCoordinator::Service {
                     break;
             }
             // a) if first heartbeat, add to master / slave server db 
-            // create a timer for 20 seconds tied to the server
-            // reset it if another heartbeat is received
-            // if the 20 second timer pops, assume dead and either mark it as dead or remove from db. return State:Bad or something
-
-            int index = find_server(beat.server_id(), beat.server_type());
-            if (index < 0) {
-                log(INFO, "Adding new server to table");
-                server_t s;
-                s.server_id = beat.server_id();
-                s.ip = beat.server_ip();
-                s.port = beat.server_port();
-                s.type = beat.server_type();
-                s.timestamp = beat.timestamp();
-
-                // Add server into the table
-                switch(beat.server_type()) {
-                    case MASTER:
-                        master_table.push_back(s);
-                        // log(INFO, "Connected masters: " + std::to_string(master_table.size()));
-                        break;
-                    case SLAVE:
-                        slave_table.push_back(s);
-                        // log(INFO, "Connected slaves: " + std::to_string(slave_table.size()));
-                        break;
-                    case SYNC:
-                        sync_table.push_back(s);
-                        log(INFO, "Connected syncs: " + std::to_string(sync_table.size()));
-                        break;
-                }
+            // b) push the server's expiry timer back - see expiry_thread
+            ServerRegistry::Verdict verdict = registry.Update(beat, SteadyNanos());
+            switch (verdict.change) {
+                case ServerRegistry::ADDED:
+                    log(INFO, "Adding new server to table");
+                    switch(beat.server_type()) {
+                        case MASTER:
+                            AddCluster(beat.server_id());
+                            break;
+                        case SYNC:
+                            log(INFO, "Connected syncs: " + std::to_string(registry.Count(SYNC)));
+                            break;
+                        default:
+                            break;
+                    }
+                    TopologyChanged();
+                    break;
+                case ServerRegistry::READY_CHANGED:
+                    TopologyChanged();
+                    log(INFO, "Slave " + std::to_string(beat.server_id()) +
+                        (beat.ready() ? " is ready" : " is catching up"));
+                    break;
+                case ServerRegistry::PROMOTION_DONE:
+                    log(INFO, "Cluster " + std::to_string(beat.server_id()) + " failed over - its new master took over " +
+                        std::to_string(verdict.failover_ns / 1000000) + "ms after the old one's last heartbeat");
+                    break;
+                case ServerRegistry::WRONG_ROLE:
+                    log(WARNING, (beat.server_type() == MASTER
+                        ? "Replaced master of cluster " + std::to_string(beat.server_id()) + " at port " + beat.server_port() + " is back - fencing it off"
+                        : "Promoted slave of cluster " + std::to_string(beat.server_id()) + " has not heard - telling it again"));
+                    break;
+                case ServerRegistry::UNCHANGED:
+                    break;
             }
-            else {
-                // Update timestamp of existing server to new timestamp
-                int index = find_server(beat.server_id(), beat.server_type());
-                switch(beat.server_type()) {
-                    case MASTER:
-                        master_table.at(index).timestamp = beat.timestamp();
-                        break;
-                    case SLAVE:
-                        slave_table.at(index).timestamp = beat.timestamp();
-                        break;
+
+            if (verdict.counted && beat.server_type() != SYNC) {
+                const ServerRegistry::Key& beat_key = verdict.key;
+                if (!registered || beat_key != key) {
+                    owner = beat;
+                    std::lock_guard<std::mutex> lock(beat_streams_mutex);
+                    if (registered && beat_streams[key] == beats) {
+                        beat_streams.erase(key);
+                    }
+                    beat_streams[beat_key] = beats;
+                    key = beat_key;
+                    registered = true;
                 }
+                expiry_wheel.Schedule(TimerKey(key), verdict.check_ms);
+            }
+            if (verdict.answer) {
+                std::lock_guard<std::mutex> lock(beats->mutex);
+                stream->Write(verdict.reply);
             }
         }
 
+        {
+            std::lock_guard<std::mutex> lock(beats->mutex);
+            beats->stream = nullptr;
+        }
+        // A server that goes away closes its stream - no need to wait for
+        // its timer
+        bool current = false;
+        if (registered) {
+            std::lock_guard<std::mutex> lock(beat_streams_mutex);
+            auto it = beat_streams.find(key);
+            current = it != beat_streams.end() && it->second == beats;
+            if (current) {
+                beat_streams.erase(it);
+            }
+        }
+        if (current) {
+            ExpireServer(key, &owner);
+        }
         return Status::OK;
     }
 
@@ -161,10 +395,13 @@ class SNSCoordinatorImpl final : public SNSCoordinator::Service {
 
         // Loop through all requested users
         for (int i = 0; i < users->users_size(); i++) {
-            int id = ((users->users(i) - 1) % 3) + 1;
-            int index = find_server(id, SYNC);
-            server_t s = sync_table.at(index);
-            log(INFO, "Followsync for user " + std::to_string(users->users(i)) + "at " + std::to_string(index));
+            int id = PlaceUser(users->users(i));
+            server_t s;
+            if (!registry.Find(id, SYNC, &s)) {
+                log(INFO, "No followsync for user " + std::to_string(users->users(i)));
+                continue;
+            }
+            log(INFO, "Followsync for user " + std::to_string(users->users(i)) + " at " + std::to_string(id));
 
             syncs->add_users(users->users(i));
             syncs->add_follow_syncs(s.server_id);
@@ -177,36 +414,236 @@ class SNSCoordinatorImpl final : public SNSCoordinator::Service {
 
     Status GetServer(ServerContext* context, const User* user, Server* server) {
 
-        int id = ((user->user_id() - 1) % 3) + 1;
+        int id = PlaceUser(user->user_id());
         log(INFO, "Fetching server... id " + std::to_string(id));
-        // TODO - Risky access
-        int index = find_server(id, MASTER);
-        server_t s = master_table.at(index);
+        server_t s;
+        if (!registry.Find(id, MASTER, &s)) {
+            return Status(grpc::StatusCode::UNAVAILABLE, id < 0 ? "No cluster has registered" : "The user's cluster has no master");
+        }
 
         server->set_server_ip(s.ip);   
         server->set_port_num(s.port);
-        server->set_server_id(id + 1);
+        server->set_server_id(id);
         server->set_server_type(s.type);   
 
         return Status::OK;
     }
 
+    Status GetReadServer(ServerContext* context, const User* user, Server* server) {
+        int id = PlaceUser(user->user_id());
+        server_t s;
+        // Only a slave that has caught up with its master
+        if (!registry.Find(id, SLAVE, &s) || !s.ready) {
+            return GetServer(context, user, server);
+        }
+        log(INFO, "Fetching read server... id " + std::to_string(id));
+
+        server->set_server_ip(s.ip);
+        server->set_port_num(s.port);
+        server->set_server_id(id);
+        server->set_server_type(s.type);
+
+        return Status::OK;
+    }
+
+    Status GetPlacement(ServerContext* context, const Users* users, Placement* placement) override {
+        std::lock_guard<std::mutex> lock(ring_mutex);
+        std::map<int, double> shares = ring.Shares();
+        for (const auto& share : shares) {
+            ClusterPlacement* c = placement->add_clusters();
+            c->set_cluster(share.first);
+            c->set_share(share.second);
+            c->set_lookups(ring_lookups[share.first]);
+        }
+        for (int user_id : users->users()) {
+            placement->add_users(user_id);
+            placement->add_user_clusters(FindCluster(user_id));
+        }
+        placement->set_ring_changes(ring_changes);
+        placement->set_last_moved(ring_last_moved);
+        placement->set_migrated(user_overrides.size());
+        return Status::OK;
+    }
+
+    Status MigrateUser(ServerContext* context, const Migration* request, MigrationResult* result) override {
+        int user_id = request->user_id();
+        int to = request->to_cluster();
+        int from;
+        {
+            std::lock_guard<std::mutex> lock(ring_mutex);
+            from = FindCluster(user_id);
+            if (!migrating.insert(user_id).second) {
+                return Status(grpc::StatusCode::ABORTED, "User is already being moved");
+            }
+        }
+        Status status = Migrate(user_id, from, to, result);
+        std::lock_guard<std::mutex> lock(ring_mutex);
+        migrating.erase(user_id);
+        return status;
+    }
+
     Status GetSlave(ServerContext*, const ClusterID* cid, Server* server) {
         log(INFO, "Fetching server... id " + std::to_string(cid->cluster()));
-        int index = find_server(cid->cluster(), SLAVE);
-        server_t s = slave_table.at(index);
+        server_t s;
+        if (!registry.Find(cid->cluster(), SLAVE, &s)) {
+            return Status(grpc::StatusCode::UNAVAILABLE, "No slave has registered");
+        }
 
         server->set_server_ip(s.ip);   
         server->set_port_num(s.port);
-        server->set_server_id(index + 1);
+        server->set_server_id(s.server_id);
         server->set_server_type(s.type);   
 
         return Status::OK;
     }
 
+    Status WatchTopology(ServerContext* context, const TopologyRequest* request, ServerWriter<Topology>* writer) override {
+        uint64_t sent = request->known_version();
+        while (!context->IsCancelled()) {
+            uint64_t version;
+            {
+                std::unique_lock<std::mutex> lock(topology_mutex);
+                if (!topology_cv.wait_for(lock, std::chrono::milliseconds(topology_poll_ms),
+                                          [sent] { return topology_version != sent; })) {
+                    continue;
+                }
+                version = topology_version;
+            }
+            // Changes made while this is built bump the version again, so
+            // the next table carries them
+            Topology topology;
+            BuildTopology(version, &topology);
+            if (!writer->Write(topology)) {
+                break;
+            }
+            sent = version;
+        }
+        return Status::OK;
+    }
 
 };
 
+std::unique_ptr<SNSService::Stub> MasterStub(int cluster) {
+    server_t s;
+    if (!registry.Find(cluster, MASTER, &s)) {
+        return nullptr;
+    }
+    return SNSService::NewStub(grpc::CreateChannel(s.ip + ":" + s.port, grpc::InsecureChannelCredentials()));
+}
+
+// Copy what changed for username since after from one master to the other,
+// and move after on. *posts is set to how many posts were copied.
+Status CopyUser(SNSService::Stub* from, SNSService::Stub* to, const std::string& username,
+                std::map<std::string, csce438::ResumePoint>& after, uint64_t* posts, MigrationResult* result) {
+    ExportRequest request;
+    request.set_username(username);
+    for (const auto& point : after) {
+        *request.add_after() = point.second;
+    }
+
+    ClientContext export_context;
+    std::unique_ptr<grpc::ClientReader<ReplicationBatch>> reader(from->ExportUser(&export_context, request));
+    ClientContext import_context;
+    Reply reply;
+    std::unique_ptr<grpc::ClientWriter<ReplicationBatch>> writer(to->ImportUser(&import_context, &reply));
+
+    *posts = 0;
+    ReplicationBatch batch;
+    while (reader->Read(&batch)) {
+        for (const ReplicationEntry& entry : batch.entries()) {
+            if (entry.op() != ReplicationEntry::POST) {
+                continue;
+            }
+            (*posts)++;
+            csce438::ResumePoint& point = after[entry.username()];
+            if (entry.post().sequence() >= point.sequence()) {
+                point.set_author(entry.username());
+                point.set_sequence(entry.post().sequence());
+                point.set_timestamp(entry.post().timestamp().seconds());
+            }
+        }
+        result->set_entries(result->entries() + batch.entries_size());
+        result->set_bytes(result->bytes() + batch.ByteSizeLong());
+        if (!writer->Write(batch)) {
+            break;
+        }
+    }
+    Status exported = reader->Finish();
+    writer->WritesDone();
+    Status imported = writer->Finish();
+    return exported.ok() ? imported : exported;
+}
+
+Status SetMoved(SNSService::Stub* stub, const std::string& username, bool moved) {
+    ClientContext context;
+    UserMove move;
+    move.set_username(username);
+    move.set_moved(moved);
+    Reply reply;
+    return stub->SetUserMoved(&context, move, &reply);
+}
+
+// Copy the user to the new master while it keeps using the old one, then
+// have the old one refuse it, copy the rest and send it to the new one
+Status Migrate(int user_id, int from, int to, MigrationResult* result) {
+    std::unique_ptr<SNSService::Stub> from_stub = MasterStub(from);
+    std::unique_ptr<SNSService::Stub> to_stub = MasterStub(to);
+    if (!from_stub || !to_stub) {
+        return Status(grpc::StatusCode::FAILED_PRECONDITION, "No master for one of the clusters");
+    }
+    result->set_from_cluster(from);
+    if (from == to) {
+        return Status::OK;
+    }
+    std::string username = std::to_string(user_id);
+    log(INFO, "Moving user " + username + " from cluster " + std::to_string(from) + " to " + std::to_string(to));
+
+    typedef std::chrono::steady_clock Clock;
+    auto start = Clock::now();
+    std::map<std::string, csce438::ResumePoint> after;
+    uint64_t posts = 0;
+    do {
+        Status status = CopyUser(from_stub.get(), to_stub.get(), username, after, &posts, result);
+        if (!status.ok()) {
+            return status;
+        }
+        result->set_rounds(result->rounds() + 1);
+    } while (posts > migration_cutover_posts && (int)result->rounds() < max_migration_rounds);
+
+    // Cutover - no writes from here until the routing points at the new master
+    auto cutover = Clock::now();
+    Status status = SetMoved(from_stub.get(), username, true);
+    if (status.ok()) {
+        status = CopyUser(from_stub.get(), to_stub.get(), username, after, &posts, result);
+    }
+    if (status.ok()) {
+        // In case it lived there before
+        status = SetMoved(to_stub.get(), username, false);
+    }
+    if (!status.ok()) {
+        SetMoved(from_stub.get(), username, false);
+        log(ERROR, "Moving user " + username + " failed: " + status.error_message());
+        return status;
+    }
+    {
+        std::lock_guard<std::mutex> lock(ring_mutex);
+        if (ring.LookupUser(user_id) == to) {
+            user_overrides.erase(user_id);
+        } else {
+            user_overrides[user_id] = to;
+        }
+    }
+    TopologyChanged();
+    auto done = Clock::now();
+
+    result->set_copy_us(std::chrono::duration_cast<std::chrono::microseconds>(cutover - start).count());
+    result->set_pause_us(std::chrono::duration_cast<std::chrono::microseconds>(done - cutover).count());
+    log(INFO, "Moved user " + username + " in " + std::to_string(result->rounds()) + " rounds, " +
+        std::to_string(result->entries()) + " entries (" + std::to_string(result->bytes()) + " bytes) in " +
+        std::to_string(result->copy_us() / 1000) + "ms, writes paused " + std::to_string(result->pause_us()) + "us");
+    return Status::OK;
+}
+
 void RunCoordinator(std::string port_no) {
     std::string server_address = "0.0.0.0:" + port_no;
     SNSCoordinatorImpl service;
@@ -215,6 +652,7 @@ void RunCoordinator(std::string port_no) {
     builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
     builder.RegisterService(&service);
     std::unique_ptr<grpc::Server> server(builder.BuildAndStart());
+    std::thread(expiry_thread).detach();
     std::cout << "Coordinator listening on " << server_address << std::endl;
     log(INFO, "Coordinator listening on "+server_address);
 
@@ -225,15 +663,29 @@ int main(int argc, char** argv) {
     std::string port = "8000";
 
     int opt = 0;
-    while ((opt = getopt(argc, argv, "p:")) != -1){
+    while ((opt = getopt(argc, argv, "p:x:P:s:a:")) != -1){
         switch(opt) {
             case 'p':
             port = optarg;break;
+            case 'x':
+            max_silence_ms = std::stoi(optarg);break;
+            case 'P':
+            phi_threshold = std::stod(optarg);break;
+            case 's':
+            phi_min_std_ms = std::stod(optarg);break;
+            case 'a':
+            phi_pause_ms = std::stod(optarg);break;
             default:
             std::cerr << "Invalid Command Line Argument\n";
         }
     }
 
+    if (phi_threshold < 1 || max_silence_ms <= 0 || phi_min_std_ms <= 0 || phi_pause_ms < 0) {
+        std::cerr << "Failure detection needs -P of at least 1, positive -x and -s, and -a of at least 0\n";
+        return -1;
+    }
+    registry.Configure(phi_threshold, max_silence_ms, phi_min_std_ms, phi_pause_ms);
+
     std::string log_file_name = std::string("coordinator-") + port;
 
     // log to the terminal
@@ -0,0 +1,134 @@
+#ifndef FILE_WATCH_H
+#define FILE_WATCH_H
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+
+/*
+ * Wakes a thread when a file changes.
+ *
+ * Watches the file's folder with inotify rather than the file itself, so a
+ * file that is replaced instead of rewritten in place is still seen. Events
+ * that arrive together are reported as one change. Without inotify, Wait
+ * sleeps out its timeout and compares the file's mtime and size, like the
+ * poll it replaces.
+ */
+
+class FileWatch
+{
+    public:
+        explicit FileWatch(const std::string &path)
+            : path_(path)
+        {
+            size_t slash = path.rfind('/');
+            std::string folder = slash == std::string::npos ? "." : path.substr(0, slash);
+            name_ = slash == std::string::npos ? path : path.substr(slash + 1);
+
+            fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if (fd_ >= 0 &&
+                inotify_add_watch(fd_, folder.c_str(), IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0)
+            {
+                close(fd_);
+                fd_ = -1;
+            }
+            if (fd_ < 0)
+            {
+                Stat(&mtime_, &size_);
+            }
+        }
+
+        ~FileWatch()
+        {
+            if (fd_ >= 0)
+            {
+                close(fd_);
+            }
+        }
+
+        FileWatch(const FileWatch &) = delete;
+        FileWatch &operator=(const FileWatch &) = delete;
+
+        // False if changes are only found by polling
+        bool watching() const
+        {
+            return fd_ >= 0;
+        }
+
+        // Wait up to timeout_ms for the file to change. True if it did.
+        bool Wait(int timeout_ms)
+        {
+            if (fd_ < 0)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(timeout_ms));
+                time_t mtime;
+                off_t size;
+                Stat(&mtime, &size);
+                bool changed = mtime != mtime_ || size != size_;
+                mtime_ = mtime;
+                size_ = size;
+                return changed;
+            }
+
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+            while (true)
+            {
+                int left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    deadline - std::chrono::steady_clock::now()).count();
+                struct pollfd pfd = {fd_, POLLIN, 0};
+                if (left <= 0 || poll(&pfd, 1, left) <= 0)
+                {
+                    return false;
+                }
+                if (Drain())
+                {
+                    return true;
+                }
+            }
+        }
+
+    private:
+        // Zeroes if the file is missing
+        void Stat(time_t *mtime, off_t *size) const
+        {
+            struct stat st;
+            bool ok = stat(path_.c_str(), &st) == 0;
+            *mtime = ok ? st.st_mtime : 0;
+            *size = ok ? st.st_size : 0;
+        }
+
+        // Read every queued event, true if any was for the file
+        bool Drain()
+        {
+            alignas(struct inotify_event) char buf[4096];
+            bool changed = false;
+            ssize_t n;
+            while ((n = read(fd_, buf, sizeof(buf))) > 0)
+            {
+                for (char *p = buf; p < buf + n;)
+                {
+                    struct inotify_event *event = (struct inotify_event *)p;
+                    if (event->len > 0 && name_ == event->name)
+                    {
+                        changed = true;
+                    }
+                    p += sizeof(struct inotify_event) + event->len;
+                }
+            }
+            return changed;
+        }
+
+        std::string path_;
+        std::string name_;
+        int fd_ = -1;
+        // When polling, as of the last Wait
+        time_t mtime_ = 0;
+        off_t size_ = 0;
+};
+
+#endif
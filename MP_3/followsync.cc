@@ -5,8 +5,12 @@
 
 #include <fstream>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <set>
 #include <string>
+#include <utility>
+#include <vector>
 #include <stdlib.h>
 #include <unistd.h>
 #include <google/protobuf/util/time_util.h>
@@ -19,9 +23,10 @@
 #include "sns.grpc.pb.h"
 #include "coordinator.grpc.pb.h"
 #include "followsync.grpc.pb.h"
-#include "json.hpp"
+#include "file_watch.h"
+#include "routing_cache.h"
+#include "storage.h"
 
-using google::protobuf::Timestamp;
 using google::protobuf::Duration;
 using grpc::Server;
 using grpc::ServerBuilder;
@@ -44,30 +49,62 @@ using snsCoordinator::ServerType;
 using snsCoordinator::MASTER;
 using snsCoordinator::SLAVE;
 using snsCoordinator::SYNC;
-using json = nlohmann::ordered_json;
 
 // Coordinator stub
 std::unique_ptr<SNSCoordinator::Stub> coord_stub_;
 
-// Number of seconds for the syncer to check if any files have been updated
+// The coordinator's routing table - which followsync handles a user is
+// looked up here rather than with GetFollowSyncsForUsers
+std::unique_ptr<RoutingCache> routes;
+int cluster_id = -1;
+
+// The master's follow graph is watched for changes, and also checked this
+// often in seconds in case a change was not signalled
 int update_time = 10;
 
 std::string follow_location = "follow.json";
 std::string timeline_location = "timeline.json";
-std::string master_follow_location;
-std::string slave_follow_location;
-std::string master_timeline_location;
-std::string slave_timeline_location;
+
+// The cluster's follow graphs, as the servers keep them (-s json|binary).
+// New users and follows are read from the master's and sent to the other
+// clusters' followsyncs, and what those send is added to the master's and,
+// if there is one, the slave's - the servers pick it up as they would any
+// other process's change. Only the graph is opened; the servers own the rest.
+std::string storage_kind = "binary";
+std::unique_ptr<Storage> master_storage;
+std::unique_ptr<Storage> slave_storage;
+
+// Both graphs, or only the master's if there is no slave
+std::vector<Storage*> Graphs() {
+    std::vector<Storage*> graphs = {master_storage.get()};
+    if (slave_storage) {
+        graphs.push_back(slave_storage.get());
+    }
+    return graphs;
+}
 
 class SNSFollowSyncImpl final : public SNSFollowSync::Service {
     
+    // Users of other clusters, so this one can list them and link follows
     Status SyncUsers(ServerContext* context, const Users* users, Reply* reply) override {
-
+        for (Storage* graph : Graphs()) {
+            for (int user : users->user_id()) {
+                graph->CreateUser(std::to_string(user));
+            }
+        }
+        glog(INFO, "Stored " + std::to_string(users->user_id_size()) + " users from another cluster");
         return Status::OK;
     }
 
-    Status SyncRelations(ServerContext* context, const Relation* relation, Reply* reply) {
-
+    // A user of another cluster following one of this cluster's users
+    Status SyncRelations(ServerContext* context, const Relation* relation, Reply* reply) override {
+        std::string follower = std::to_string(relation->follower());
+        std::string followee = std::to_string(relation->followee());
+        for (Storage* graph : Graphs()) {
+            graph->CreateUser(follower);
+            graph->Follow(follower, followee, relation->timestamp());
+        }
+        glog(INFO, "Stored " + follower + " following " + followee);
         return Status::OK;
     }
 
@@ -90,10 +127,7 @@ void send_heartbeat(int id, ServerType type, std::string ip, std::string port) {
     beat.set_server_type(type);
     beat.set_server_ip(ip);
     beat.set_server_port(port);
-    Timestamp *timestamp = new Timestamp();
-    timestamp->set_seconds(time(NULL));
-    timestamp->set_nanos(0);
-    beat.set_allocated_timestamp(timestamp);
+    beat.mutable_timestamp()->set_seconds(time(NULL));
 
     // Send to coordinator
     stream->Write(beat);
@@ -101,90 +135,129 @@ void send_heartbeat(int id, ServerType type, std::string ip, std::string port) {
     stream->Finish();
 }
 
-void UpdateJSON(json j, std::string location)
-{
-    // glog(INFO, "Updating json");
-    std::ofstream ofs(location);
-    ofs << std::setw(4) << j << std::endl;
-    ofs.close();
-}
-
-// Add a new user to data.json
-void CreateUserJSON(std::string username)
-{
-    // Load data.json
-    std::ifstream file(follow_location);
-    json j = json::parse(file);
-    file.close();
-
-    // Create user object
-    json user_data;
-    user_data["username"] = username;
-    user_data["following"] = json::object();
-    j["users"][username] = user_data;
-
-    UpdateJSON(j, follow_location);
-}
-
-std::vector<int> ParseUsers(std::string location)
-{
-    std::vector<int> users;
-    std::ifstream file(location);
-    json j;
-
-    if (file.is_open())
-    {
+// A follow read from the graph: follower, followee, timestamp
+struct Follow {
+    std::string follower;
+    std::string followee;
+    int64_t timestamp;
+};
 
-        // Check if file is empty
-        if (file.peek() == std::ifstream::traits_type::eof())
-        {
-            file.close();
-            return users;
+// Send the changes read from the master's graph on. Only what this
+// cluster owns goes out - its own users, to every other followsync, and
+// its users' follows of other clusters' users, to the followee's - so
+// what peers store here is not sent back.
+void Forward(const std::vector<std::string>& users, const std::vector<Follow>& follows) {
+    static std::map<std::string, std::unique_ptr<SNSFollowSync::Stub>> stubs;
+    auto stub = [](const RoutingCache::Route& sync) {
+        std::unique_ptr<SNSFollowSync::Stub>& s = stubs[sync.Address()];
+        if (!s) {
+            s = SNSFollowSync::NewStub(grpc::CreateChannel(sync.Address(), grpc::InsecureChannelCredentials()));
         }
-
-        // Parse json
-        j = json::parse(file);
-        file.close();
-
-        for (auto user_data : j["users"])
-        {
-            // Add all users to vector
-            std::string username = user_data["username"];
-            users.push_back(std::stoi(username));
+        return s.get();
+    };
+    std::shared_ptr<const RoutingCache::Table> table = routes->Current();
+    std::map<int, RoutingCache::Route> syncs = table->OfType(SYNC);
+    syncs.erase(cluster_id);
+
+    Users local;
+    for (const std::string& user : users) {
+        if (table->Cluster(std::stoi(user)) == cluster_id) {
+            local.add_user_id(std::stoi(user));
+        }
+    }
+    if (local.user_id_size() > 0) {
+        for (const auto& sync : syncs) {
+            ClientContext context;
+            Reply reply;
+            Status status = stub(sync.second)->SyncUsers(&context, local, &reply);
+            if (!status.ok()) {
+                glog(WARNING, "Could not send users to the followsync of cluster " + std::to_string(sync.first) +
+                                  " - " + status.error_message());
+            }
         }
     }
 
-    return users;
+    for (const Follow& follow : follows) {
+        int follower = std::stoi(follow.follower);
+        int followee = std::stoi(follow.followee);
+        auto sync = syncs.find(table->Cluster(followee));
+        if (table->Cluster(follower) != cluster_id || sync == syncs.end()) {
+            continue;
+        }
+        Relation relation;
+        relation.set_follower(follower);
+        relation.set_followee(followee);
+        relation.set_timestamp(follow.timestamp);
+        ClientContext context;
+        Reply reply;
+        Status status = stub(sync->second)->SyncRelations(&context, relation, &reply);
+        if (!status.ok()) {
+            glog(WARNING, "Could not send " + follow.follower + " following " + follow.followee +
+                              " to the followsync of cluster " + std::to_string(sync->first) + " - " +
+                              status.error_message());
+        }
+    }
 }
 
+// Read what changed in the master's graph and send it on. Binary storage
+// reads only the records appended since the last check. json storage is
+// read whole and compared with the last read. Changes from before the
+// followsync started are not sent.
 void update_thread() {
-    // Initialize last_update
-    struct stat ffile_stat;
-    time_t previous_follow_mtime = 0;
+    FileWatch watch(master_storage->GraphPath());
+    if (!watch.watching()) {
+        glog(ERROR, "Could not watch " + master_storage->GraphPath() + " - checking it every " +
+                        std::to_string(update_time) + "s");
+    }
 
-    if (stat(follow_location.c_str(), &ffile_stat) != 0) {
-        glog(ERROR, "Stat for follow file failed");
-        return;
+    uint64_t position = master_storage->GraphPosition();
+    // json: the graph as of the last read
+    std::set<std::string> known_users;
+    std::set<std::pair<std::string, std::string>> known_follows;
+    bool incremental = master_storage->LoadGraphChanges(&position, [](const std::string&) {},
+        [](const std::string&, const std::string&, int64_t) {},
+        [](const std::string&, const std::string&) {});
+    if (!incremental) {
+        master_storage->LoadGraph(
+            [&](const std::string& user) { known_users.insert(user); },
+            [&](const std::string& user, const std::string& following, int64_t) {
+                known_follows.insert(std::make_pair(user, following));
+            });
     }
-    previous_follow_mtime = ffile_stat.st_mtime;
 
+    std::vector<std::string> users;
+    std::vector<Follow> follows;
     while (true) {
-        // Sleep
-        std::this_thread::sleep_for(std::chrono::seconds(update_time));
-        glog(INFO, "Checking for updates...");
-
-        // Check if follow file was updated
-        if (stat(follow_location.c_str(), &ffile_stat) != 0) {
-            glog(ERROR, "Stat for follow file failed");
-            return;
+        bool changed = watch.Wait(update_time * 1000);
+        users.clear();
+        follows.clear();
+        if (incremental) {
+            master_storage->LoadGraphChanges(&position,
+                [&](const std::string& user) { users.push_back(user); },
+                [&](const std::string& user, const std::string& following, int64_t timestamp) {
+                    follows.push_back(Follow{user, following, timestamp});
+                },
+                // Nothing unfollows yet, and peers have no way to be told
+                [](const std::string&, const std::string&) {});
+        } else if (changed && master_storage->GraphChangedElsewhere()) {
+            master_storage->LoadGraph(
+                [&](const std::string& user) {
+                    if (known_users.insert(user).second) {
+                        users.push_back(user);
+                    }
+                },
+                [&](const std::string& user, const std::string& following, int64_t timestamp) {
+                    if (known_follows.insert(std::make_pair(user, following)).second) {
+                        follows.push_back(Follow{user, following, timestamp});
+                    }
+                });
         }
-        if (previous_follow_mtime != ffile_stat.st_mtime) {
-            // Reload follow data
-            glog(INFO, "Follow file change detected");
-            // std::vector<int> users = ParseUsers(master_follow_location);
-
-            previous_follow_mtime = ffile_stat.st_mtime;
+        if (users.empty() && follows.empty()) {
+            continue;
         }
+        glog(INFO, "Follow graph changed - " + std::to_string(users.size()) + " users, " +
+                       std::to_string(follows.size()) + " follows");
+        Forward(users, follows);
     }
 
 }
@@ -213,7 +286,7 @@ int main(int argc, char** argv) {
     std::string id = "-1";
 
     int opt = 0;
-    while ((opt = getopt(argc, argv, "c:o:p:i:")) != -1){
+    while ((opt = getopt(argc, argv, "c:o:p:i:s:")) != -1){
         switch (opt) {
         case 'c':
             caddr = optarg;
@@ -227,6 +300,9 @@ int main(int argc, char** argv) {
         case 'i':
             id = optarg;
             break;
+        case 's':
+            storage_kind = optarg;
+            break;
         default:
             std::cerr << "Invalid Command Line Argument\n";
         }
@@ -254,19 +330,39 @@ int main(int argc, char** argv) {
     // Set folders for this syncer
     std::string master_folder =  "master_" +  id;
     std::string slave_folder =  "slave_" +  id;
-    master_follow_location = master_folder + "/" + follow_location;
-    slave_follow_location = slave_folder + "/" + follow_location;
-    master_timeline_location = master_folder + "/" + timeline_location;
-    slave_timeline_location = slave_folder + "/" + timeline_location;
+    mkdir(master_folder.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+    master_storage.reset(MakeStorage(storage_kind, master_folder, follow_location, timeline_location));
+    if (!master_storage)
+    {
+        std::cout << "Please enter a valid storage type! (-s json|binary)";
+        return -1;
+    }
+    if (FileExists(slave_folder))
+    {
+        slave_storage.reset(MakeStorage(storage_kind, slave_folder, follow_location, timeline_location));
+    }
+    for (Storage* graph : Graphs())
+    {
+        if (!graph->InitGraph())
+        {
+            glog(ERROR, "Could not open the follow graph at " + graph->GraphPath());
+            return -1;
+        }
+    }
 
     // Create coordinator stub
     std::string coord_login = caddr + ":" + cport;
     coord_stub_ = std::unique_ptr<SNSCoordinator::Stub>(SNSCoordinator::NewStub(grpc::CreateChannel(coord_login, grpc::InsecureChannelCredentials())));
 
     // Send init heartbeat to coordinator
-    send_heartbeat(std::stoi(id), SYNC, "0.0.0.0", port);
+    cluster_id = std::stoi(id);
+    send_heartbeat(cluster_id, SYNC, "0.0.0.0", port);
+    routes.reset(new RoutingCache(coord_stub_.get()));
+    routes->Start();
 
     glog(INFO, "Logging Initialized. FollowSync starting...");
+    std::thread update(update_thread);
+    update.detach();
     RunSync(port);
 
 
@@ -0,0 +1,182 @@
+#ifndef HASH_RING_H
+#define HASH_RING_H
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+/*
+ * Consistent-hash ring placing users on clusters.
+ *
+ * Every cluster is hashed onto the ring at vnodes points, and a user
+ * belongs to the first point at or after the user's own hash, wrapping
+ * around. Adding a cluster only takes users from the points just before
+ * its own, and removing one only hands its users to the next points, so
+ * either moves about 1/N of the users. The many points per cluster keep
+ * the shares even.
+ */
+
+class HashRing
+{
+    public:
+        static const int default_vnodes = 128;
+
+        explicit HashRing(int vnodes = default_vnodes) : vnodes_(vnodes) {}
+
+        // FNV-1a, then a 64 bit finalizer so nearby names land far apart
+        static uint64_t Hash(const std::string &key)
+        {
+            uint64_t h = 14695981039346656037ULL;
+            for (unsigned char c : key)
+            {
+                h = (h ^ c) * 1099511628211ULL;
+            }
+            h ^= h >> 33;
+            h *= 0xff51afd7ed558ccdULL;
+            h ^= h >> 33;
+            h *= 0xc4ceb9fe1a85ec53ULL;
+            h ^= h >> 33;
+            return h;
+        }
+
+        static uint64_t UserHash(int user_id)
+        {
+            return Hash("user-" + std::to_string(user_id));
+        }
+
+        void Add(int cluster)
+        {
+            if (!clusters_.insert(cluster).second)
+            {
+                return;
+            }
+            for (int v = 0; v < vnodes_; v++)
+            {
+                // Two clusters hashing to one point is as good as impossible,
+                // and the lower id keeps it so the ring is still deterministic
+                uint64_t point = Hash("cluster-" + std::to_string(cluster) + "#" + std::to_string(v));
+                auto it = points_.find(point);
+                if (it == points_.end() || cluster < it->second)
+                {
+                    points_[point] = cluster;
+                }
+            }
+        }
+
+        void Remove(int cluster)
+        {
+            if (clusters_.erase(cluster) == 0)
+            {
+                return;
+            }
+            std::set<int> rest;
+            rest.swap(clusters_);
+            points_.clear();
+            for (int c : rest)
+            {
+                Add(c);
+            }
+        }
+
+        bool Contains(int cluster) const
+        {
+            return clusters_.count(cluster) > 0;
+        }
+
+        bool empty() const
+        {
+            return clusters_.empty();
+        }
+
+        const std::set<int> &clusters() const
+        {
+            return clusters_;
+        }
+
+        // Cluster owning hash, -1 if there are none
+        int Lookup(uint64_t hash) const
+        {
+            if (points_.empty())
+            {
+                return -1;
+            }
+            auto it = points_.lower_bound(hash);
+            return it == points_.end() ? points_.begin()->second : it->second;
+        }
+
+        int LookupUser(int user_id) const
+        {
+            return Lookup(UserHash(user_id));
+        }
+
+        // Fraction of the hash space each cluster owns
+        std::map<int, double> Shares() const
+        {
+            std::map<int, double> shares;
+            for (int c : clusters_)
+            {
+                shares[c] = 0;
+            }
+            uint64_t prev = points_.empty() ? 0 : points_.rbegin()->first;
+            for (const auto &point : points_)
+            {
+                // Everything after the previous point, wrapping for the first
+                shares[point.second] += (double)(point.first - prev) / 18446744073709551616.0;
+                prev = point.first;
+            }
+            if (points_.size() == 1)
+            {
+                shares[points_.begin()->second] = 1;
+            }
+            return shares;
+        }
+
+        // Fraction of the hash space - so of the users - owned by a
+        // different cluster in after than in before
+        static double Moved(const HashRing &before, const HashRing &after)
+        {
+            if (before.points_.empty() || after.points_.empty())
+            {
+                return before.points_.empty() && after.points_.empty() ? 0 : 1;
+            }
+
+            // Every point of either ring ends a range with one owner in each
+            std::vector<uint64_t> ends;
+            for (const auto &point : before.points_)
+            {
+                ends.push_back(point.first);
+            }
+            for (const auto &point : after.points_)
+            {
+                ends.push_back(point.first);
+            }
+            std::sort(ends.begin(), ends.end());
+            ends.erase(std::unique(ends.begin(), ends.end()), ends.end());
+
+            double moved = 0;
+            uint64_t prev = ends.back();
+            for (uint64_t end : ends)
+            {
+                if (before.Lookup(end) != after.Lookup(end))
+                {
+                    moved += (double)(end - prev) / 18446744073709551616.0;
+                }
+                prev = end;
+            }
+            if (ends.size() == 1 && before.Lookup(ends[0]) != after.Lookup(ends[0]))
+            {
+                moved = 1;
+            }
+            return moved;
+        }
+
+    private:
+        int vnodes_;
+        std::set<int> clusters_;
+        std::map<uint64_t, int> points_; // point on the ring -> cluster
+};
+
+#endif
@@ -0,0 +1,454 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdlib.h>
+#include <unistd.h>
+#include <grpc++/grpc++.h>
+
+#include "json.hpp"
+#include "sns.grpc.pb.h"
+
+using grpc::Channel;
+using grpc::ChannelArguments;
+using grpc::ClientContext;
+using grpc::ClientReaderWriter;
+using grpc::Status;
+using csce438::ListReply;
+using csce438::ListRequest;
+using csce438::Message;
+using csce438::Reply;
+using csce438::Request;
+using csce438::SNSService;
+using json = nlohmann::ordered_json;
+
+// Load test for one server's SNSService
+//
+// Logs in -n users, has each follow -k others, calls List for every user,
+// opens a Timeline stream per user and then posts at -r posts/s for -d
+// seconds. Every post carries its id, and each follower stream that gets it
+// records the time from the post's Write to its delivery. A summary goes to
+// stdout and the full results, as json, to -o.
+//
+//   ./load_test -h localhost -p 10000 -n 200 -g powerlaw -k 10 -r 500 -d 30
+//
+// Talks to the server directly - start it as a master with its slave up,
+// since a master copies every Timeline stream to its slave.
+
+typedef std::chrono::steady_clock Clock;
+
+std::string hostname = "localhost";
+std::string port = "10000";
+int num_users = 100;
+std::string graph = "powerlaw";  // none, uniform or powerlaw
+int follows_per_user = 10;
+double alpha = 1.0;              // powerlaw exponent
+int post_rate = 100;             // posts per second over all users
+int duration = 10;               // seconds of posting
+int msg_len = 64;
+int threads = 8;                 // Login/Follow/List callers and post writers
+int channels = 0;                // 0 - one per 100 users
+int drain = 2;                   // seconds to wait for deliveries after posting
+std::string prefix;              // usernames - defaults to a per run tag
+std::string output = "load_test.json";
+
+int64_t MicrosSince(Clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+}
+
+// Latencies in microseconds, plus failed calls
+struct Samples {
+    std::vector<int64_t> us;
+    size_t errors = 0;
+
+    void Merge(const Samples& other) {
+        us.insert(us.end(), other.us.begin(), other.us.end());
+        errors += other.errors;
+    }
+
+    // Percentiles and a log2 histogram - bucket i counts samples below 2^i us
+    json Summary() const {
+        std::vector<int64_t> sorted(us);
+        std::sort(sorted.begin(), sorted.end());
+        auto percentile = [&sorted](double q) -> int64_t {
+            if (sorted.empty()) {
+                return 0;
+            }
+            size_t rank = (size_t)std::ceil(q * sorted.size());
+            return sorted[std::max<size_t>(rank, 1) - 1];
+        };
+
+        json histogram = json::array();
+        size_t i = 0;
+        for (int64_t below = 1; i < sorted.size(); below *= 2) {
+            size_t count = 0;
+            for (; i < sorted.size() && sorted[i] < below; i++) {
+                count++;
+            }
+            if (count > 0) {
+                histogram.push_back({{"below_us", below}, {"count", count}});
+            }
+        }
+
+        double sum = 0;
+        for (int64_t v : sorted) {
+            sum += v;
+        }
+
+        json j;
+        j["count"] = sorted.size();
+        j["errors"] = errors;
+        j["mean_us"] = sorted.empty() ? 0 : sum / sorted.size();
+        j["p50_us"] = percentile(0.50);
+        j["p90_us"] = percentile(0.90);
+        j["p99_us"] = percentile(0.99);
+        j["p999_us"] = percentile(0.999);
+        j["max_us"] = sorted.empty() ? 0 : sorted.back();
+        j["histogram"] = histogram;
+        return j;
+    }
+};
+
+struct SimUser {
+    std::string name;
+    SNSService::Stub* stub;
+    std::vector<int> following;
+    std::vector<int> followers;
+
+    ClientContext ctx;
+    std::unique_ptr<ClientReaderWriter<Message, Message>> stream;
+    std::thread reader;
+    Samples delivery;  // filled by reader
+    size_t history = 0;  // posts received that are not from this run
+};
+
+// Call fn(i, samples) for i in [0, count) from threads callers, and merge
+// what they measured
+Samples RunCalls(int count, const std::function<void(int i, Samples& samples)>& fn) {
+    std::vector<Samples> samples(threads);
+    std::vector<std::thread> callers;
+    for (int t = 0; t < threads; t++) {
+        callers.emplace_back([&, t] {
+            for (int i = t; i < count; i += threads) {
+                fn(i, samples[t]);
+            }
+        });
+    }
+    Samples merged;
+    for (int t = 0; t < threads; t++) {
+        callers[t].join();
+        merged.Merge(samples[t]);
+    }
+    return merged;
+}
+
+// Follow targets for every user. Out-degree is follows_per_user; with
+// powerlaw, user i is picked with weight 1 / (i + 1)^alpha, so a few users
+// get most of the followers.
+void BuildGraph(std::vector<SimUser>& users) {
+    if (graph == "none" || users.size() < 2) {
+        return;
+    }
+
+    std::mt19937 rng(438);
+    std::vector<double> weights(users.size(), 1.0);
+    if (graph == "powerlaw") {
+        for (size_t i = 0; i < users.size(); i++) {
+            weights[i] = 1.0 / std::pow(i + 1, alpha);
+        }
+    }
+    std::discrete_distribution<int> pick(weights.begin(), weights.end());
+
+    int degree = std::min<int>(follows_per_user, users.size() - 1);
+    for (int i = 0; i < (int)users.size(); i++) {
+        std::vector<bool> chosen(users.size(), false);
+        chosen[i] = true;
+
+        // Heavy skew can make the last few picks slow - give up after a while
+        for (int tries = 0; (int)users[i].following.size() < degree && tries < degree * 100; tries++) {
+            int j = pick(rng);
+            if (!chosen[j]) {
+                chosen[j] = true;
+                users[i].following.push_back(j);
+                users[j].followers.push_back(i);
+            }
+        }
+    }
+}
+
+// Post ids are "<prefix> <id>" at the start of the message
+bool ParsePostId(const std::string& msg, size_t* id) {
+    if (msg.compare(0, prefix.size(), prefix) != 0 || msg.size() <= prefix.size() ||
+        msg[prefix.size()] != ' ') {
+        return false;
+    }
+    *id = strtoull(msg.c_str() + prefix.size() + 1, NULL, 10);
+    return true;
+}
+
+int main(int argc, char** argv) {
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "h:p:n:g:k:a:r:d:l:t:c:w:u:o:")) != -1){
+        switch(opt) {
+            case 'h':
+                hostname = optarg;break;
+            case 'p':
+                port = optarg;break;
+            case 'n':
+                num_users = atoi(optarg);break;
+            case 'g':
+                graph = optarg;break;
+            case 'k':
+                follows_per_user = atoi(optarg);break;
+            case 'a':
+                alpha = atof(optarg);break;
+            case 'r':
+                post_rate = atoi(optarg);break;
+            case 'd':
+                duration = atoi(optarg);break;
+            case 'l':
+                msg_len = atoi(optarg);break;
+            case 't':
+                threads = atoi(optarg);break;
+            case 'c':
+                channels = atoi(optarg);break;
+            case 'w':
+                drain = atoi(optarg);break;
+            case 'u':
+                prefix = optarg;break;
+            case 'o':
+                output = optarg;break;
+            default:
+                std::cerr << "Invalid Command Line Argument\n";
+        }
+    }
+    if (num_users <= 0 || post_rate <= 0 || duration <= 0 || threads <= 0 ||
+        follows_per_user < 0 || msg_len < 0 || channels < 0 || drain < 0) {
+        std::cerr << "Arguments must be positive\n";
+        return -1;
+    }
+    if (graph != "none" && graph != "uniform" && graph != "powerlaw") {
+        std::cerr << "Unknown follow graph " << graph << " (-g none|uniform|powerlaw)\n";
+        return -1;
+    }
+
+    // A fresh set of users every run, so earlier runs' follows and posts
+    // do not mix in
+    if (prefix.empty()) {
+        prefix = "lt" + std::to_string(time(NULL) % 1000000) + "-" + std::to_string(getpid());
+    }
+    if (channels == 0) {
+        channels = (num_users + 99) / 100;
+    }
+
+    // Separate connections - a channel argument per channel keeps gRPC from
+    // sharing one subchannel between them
+    std::vector<std::unique_ptr<SNSService::Stub>> stubs;
+    for (int c = 0; c < channels; c++) {
+        ChannelArguments args;
+        args.SetInt("load_test.channel", c);
+        stubs.push_back(SNSService::NewStub(grpc::CreateCustomChannel(
+            hostname + ":" + port, grpc::InsecureChannelCredentials(), args)));
+    }
+
+    std::vector<SimUser> users(num_users);
+    for (int i = 0; i < num_users; i++) {
+        users[i].name = prefix + "_" + std::to_string(i);
+        users[i].stub = stubs[i % channels].get();
+    }
+    BuildGraph(users);
+
+    std::cout << "Load test against " << hostname << ":" << port << " - " << num_users
+              << " users, " << graph << " graph, " << post_rate << " posts/s for "
+              << duration << "s" << std::endl;
+
+    // Login
+    Samples login = RunCalls(num_users, [&users](int i, Samples& samples) {
+        ClientContext ctx;
+        Request request;
+        Reply reply;
+        request.set_username(users[i].name);
+        auto start = Clock::now();
+        Status status = users[i].stub->Login(&ctx, request, &reply);
+        int64_t us = MicrosSince(start);
+        if (!status.ok() || reply.msg() != "Login Successful!") {
+            samples.errors++;
+            return;
+        }
+        samples.us.push_back(us);
+    });
+    std::cout << "Login  " << login.us.size() << " ok, " << login.errors << " failed" << std::endl;
+
+    // Follow - one caller per user, in follow order
+    Samples follow = RunCalls(num_users, [&users](int i, Samples& samples) {
+        for (int j : users[i].following) {
+            ClientContext ctx;
+            Request request;
+            Reply reply;
+            request.set_username(users[i].name);
+            request.add_arguments(users[j].name);
+            auto start = Clock::now();
+            Status status = users[i].stub->Follow(&ctx, request, &reply);
+            int64_t us = MicrosSince(start);
+            if (!status.ok()) {
+                samples.errors++;
+                continue;
+            }
+            samples.us.push_back(us);
+        }
+    });
+    std::cout << "Follow " << follow.us.size() << " ok, " << follow.errors << " failed" << std::endl;
+
+    // List - first page of the directory
+    Samples list = RunCalls(num_users, [&users](int i, Samples& samples) {
+        ClientContext ctx;
+        ListRequest request;
+        ListReply reply;
+        request.set_username(users[i].name);
+        auto start = Clock::now();
+        Status status = users[i].stub->List(&ctx, request, &reply);
+        int64_t us = MicrosSince(start);
+        if (!status.ok()) {
+            samples.errors++;
+            return;
+        }
+        samples.us.push_back(us);
+    });
+    std::cout << "List   " << list.us.size() << " ok, " << list.errors << " failed" << std::endl;
+
+    // When each post was written, by post id - a slot per post we can send
+    size_t max_posts = (size_t)post_rate * duration;
+    std::unique_ptr<std::atomic<int64_t>[]> sent_at(new std::atomic<int64_t>[max_posts]);
+    for (size_t i = 0; i < max_posts; i++) {
+        sent_at[i] = -1;
+    }
+    auto epoch = Clock::now();
+
+    // Timeline streams, each with a reader recording delivery latency
+    for (SimUser& user : users) {
+        user.stream = user.stub->Timeline(&user.ctx);
+        Message init;
+        init.set_username(user.name);
+        init.set_msg("INIT");
+        user.stream->Write(init);
+
+        SimUser* u = &user;
+        std::atomic<int64_t>* sent = sent_at.get();
+        user.reader = std::thread([u, sent, max_posts, epoch] {
+            Message m;
+            size_t id;
+            while (u->stream->Read(&m)) {
+                int64_t now = MicrosSince(epoch);
+                if (!ParsePostId(m.msg(), &id) || id >= max_posts || sent[id] < 0) {
+                    u->history++;
+                    continue;
+                }
+                u->delivery.us.push_back(now - sent[id]);
+            }
+        });
+    }
+    // Let the INIT histories go out before timing anything
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+
+    // Post - writer t owns users t, t + threads, ... and sends every
+    // threads-th post at an even pace
+    std::atomic<size_t> next_id(0);
+    std::atomic<size_t> expected(0);
+    std::vector<std::thread> writers;
+    auto post_start = Clock::now();
+    for (int t = 0; t < threads && t < num_users; t++) {
+        writers.emplace_back([&, t] {
+            std::mt19937 rng(t);
+            int owned = (num_users - t + threads - 1) / threads;
+            std::uniform_int_distribution<int> pick(0, owned - 1);
+            Message post;
+            std::string padding(msg_len, 'x');
+            auto interval = std::chrono::nanoseconds(1000000000LL * threads / post_rate);
+            auto next = post_start + std::chrono::nanoseconds(1000000000LL * t / post_rate);
+
+            for (size_t n = t; n < max_posts; n += threads) {
+                std::this_thread::sleep_until(next);
+                next += interval;
+
+                SimUser& user = users[t + pick(rng) * threads];
+                size_t id = next_id++;
+                post.set_username(user.name);
+                post.set_msg(prefix + " " + std::to_string(id) + " " + padding);
+                post.mutable_timestamp()->set_seconds(time(NULL));
+                sent_at[id] = MicrosSince(epoch);
+                expected += user.followers.size();
+                user.stream->Write(post);
+            }
+        });
+    }
+    for (std::thread& w : writers) {
+        w.join();
+    }
+    double post_seconds = std::chrono::duration<double>(Clock::now() - post_start).count();
+
+    // Wait for the stragglers, then close every stream
+    std::this_thread::sleep_for(std::chrono::seconds(drain));
+    for (SimUser& user : users) {
+        user.stream->WritesDone();
+    }
+    Samples delivery;
+    size_t history = 0;
+    for (SimUser& user : users) {
+        user.reader.join();
+        user.stream->Finish();
+        delivery.Merge(user.delivery);
+        history += user.history;
+    }
+
+    // Log everyone out so the names can be reused
+    RunCalls(num_users, [&users](int i, Samples& samples) {
+        ClientContext ctx;
+        Request request;
+        Reply reply;
+        request.set_username(users[i].name);
+        request.add_arguments("SIGINT");
+        users[i].stub->Login(&ctx, request, &reply);
+    });
+
+    size_t sent = next_id;
+    json results;
+    results["config"] = {
+        {"server", hostname + ":" + port}, {"users", num_users}, {"graph", graph},
+        {"follows_per_user", follows_per_user}, {"alpha", alpha}, {"post_rate", post_rate},
+        {"duration_s", duration}, {"msg_len", msg_len}, {"threads", threads},
+        {"channels", channels}, {"prefix", prefix}
+    };
+    results["rpc"]["Login"] = login.Summary();
+    results["rpc"]["Follow"] = follow.Summary();
+    results["rpc"]["List"] = list.Summary();
+    results["posts"]["sent"] = sent;
+    results["posts"]["rate"] = sent / post_seconds;
+    results["posts"]["expected_deliveries"] = (size_t)expected;
+    results["posts"]["delivered"] = delivery.us.size();
+    results["posts"]["history_received"] = history;
+    results["posts"]["delivery_latency"] = delivery.Summary();
+
+    std::ofstream out(output);
+    out << results.dump(4) << std::endl;
+
+    json d = results["posts"]["delivery_latency"];
+    std::cout << "Posted " << sent << " at " << (int)(sent / post_seconds) << "/s, delivered "
+              << delivery.us.size() << " of " << (size_t)expected << std::endl;
+    std::cout << "Delivery latency us - p50 " << d["p50_us"] << "  p90 " << d["p90_us"]
+              << "  p99 " << d["p99_us"] << "  max " << d["max_us"] << std::endl;
+    for (const char* rpc : {"Login", "Follow", "List"}) {
+        json r = results["rpc"][rpc];
+        std::cout << rpc << " latency us - p50 " << r["p50_us"] << "  p99 " << r["p99_us"]
+                  << "  errors " << r["errors"] << std::endl;
+    }
+    std::cout << "Results in " << output << std::endl;
+    return 0;
+}
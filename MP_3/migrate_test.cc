@@ -0,0 +1,318 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdlib.h>
+#include <unistd.h>
+#include <grpc++/grpc++.h>
+
+#include "sns.grpc.pb.h"
+#include "coordinator.grpc.pb.h"
+
+using grpc::ClientContext;
+using grpc::ClientReaderWriter;
+using grpc::Status;
+using csce438::Message;
+using csce438::Reply;
+using csce438::Request;
+using csce438::SNSService;
+using csce438::TimelinePage;
+using csce438::TimelinePageRequest;
+using snsCoordinator::SNSCoordinator;
+using snsCoordinator::Migration;
+using snsCoordinator::MigrationResult;
+using snsCoordinator::Placement;
+using snsCoordinator::Server;
+using snsCoordinator::User;
+using snsCoordinator::Users;
+
+// Live migration test
+//
+// Logs user -u in on the master the coordinator gives it and stores -n
+// posts. Then, while one thread posts to the user's Timeline stream at -r
+// posts/s and another calls Follow for it in a loop, asks the coordinator to
+// move it to cluster -t. Both follow the user to its new master the way the
+// client does. Reports what the coordinator copied and how long writes were
+// paused, the longest gap between two successful Follow calls, and checks
+// every post made it to the new master.
+//
+//   ./migrate_test -c localhost -p 9090 -u 7 -t 2 -n 10000 -r 200
+
+typedef std::chrono::steady_clock Clock;
+
+std::string coord_host = "localhost";
+std::string coord_port = "9090";
+int user_id = 1;
+int to_cluster = 2;
+int preload = 10000;
+int post_rate = 100;   // posts per second while moving
+int settle = 1;        // seconds of posting before and after the move
+const int retry_ms = 50;
+
+std::string username;
+std::unique_ptr<SNSCoordinator::Stub> coordinator;
+
+int64_t MicrosSince(Clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+}
+
+// The user's master as the coordinator has it now, logged in. Null if
+// there is none, or it refuses the user.
+std::unique_ptr<SNSService::Stub> Resolve(std::string* address) {
+    ClientContext context;
+    User user;
+    user.set_user_id(user_id);
+    Server server;
+    if (!coordinator->GetServer(&context, user, &server).ok()) {
+        return nullptr;
+    }
+    *address = server.server_ip() + ":" + server.port_num();
+    std::unique_ptr<SNSService::Stub> stub = SNSService::NewStub(
+        grpc::CreateChannel(*address, grpc::InsecureChannelCredentials()));
+
+    ClientContext login_context;
+    Request request;
+    request.set_username(username);
+    Reply reply;
+    if (!stub->Login(&login_context, request, &reply).ok()) {
+        return nullptr;
+    }
+    return stub;
+}
+
+// Resolve until it works
+std::unique_ptr<SNSService::Stub> ResolveRetrying(std::string* address) {
+    std::unique_ptr<SNSService::Stub> stub;
+    while (!(stub = Resolve(address))) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(retry_ms));
+    }
+    return stub;
+}
+
+Message MakePost(size_t n) {
+    Message m;
+    m.set_username(username);
+    m.set_msg("migrate_test " + std::to_string(n));
+    m.mutable_timestamp()->set_seconds(time(NULL));
+    return m;
+}
+
+// Posts to the user's Timeline stream until stop is set - at post_rate a
+// second, or as fast as possible if rate is 0 and until count are written.
+// When the user moves, the stream is reopened on its new master and the
+// posts the old one did not store are sent again. Returns the posts stored.
+size_t PostUntil(const std::atomic<bool>& stop, int rate, size_t count, size_t* moves) {
+    std::string address;
+    std::unique_ptr<SNSService::Stub> stub = ResolveRetrying(&address);
+    std::vector<Message> unstored;
+    size_t stored = 0;
+    size_t next = 0;
+    Clock::time_point start = Clock::now();
+
+    while (true) {
+        ClientContext context;
+        std::unique_ptr<ClientReaderWriter<Message, Message>> stream(stub->Timeline(&context));
+        Message init;
+        init.set_username(username);
+        init.set_msg("INIT");
+        stream->Write(init);
+        // History and other posts the stream sends are not needed
+        std::thread reader([&stream]() {
+            Message m;
+            while (stream->Read(&m)) {
+            }
+        });
+
+        std::vector<Message> written;
+        for (const Message& m : unstored) {
+            stream->Write(m);
+            written.push_back(m);
+        }
+        while (!stop && (rate > 0 || next < count)) {
+            if (rate > 0) {
+                std::this_thread::sleep_until(start + std::chrono::microseconds((int64_t)next * 1000000 / rate));
+            }
+            Message m = MakePost(next++);
+            written.push_back(m);
+            if (!stream->Write(m)) {
+                break;
+            }
+        }
+        stream->WritesDone();
+        reader.join();
+        Status status = stream->Finish();
+
+        const auto& trailers = context.GetServerTrailingMetadata();
+        auto it = trailers.find("stored-posts");
+        if (status.ok()) {
+            return stored + written.size();
+        }
+        if (status.error_code() != grpc::StatusCode::UNAVAILABLE || it == trailers.end()) {
+            std::cerr << "Timeline failed: " << status.error_message() << "\n";
+            return stored;
+        }
+        size_t n = std::min((size_t)strtoull(std::string(it->second.data(), it->second.size()).c_str(), NULL, 10),
+                            written.size());
+        stored += n;
+        unstored.assign(written.begin() + n, written.end());
+        (*moves)++;
+        std::this_thread::sleep_for(std::chrono::milliseconds(retry_ms));
+        stub = ResolveRetrying(&address);
+    }
+}
+
+// Every post of the user on its master now, paging through its timeline
+size_t CountPosts() {
+    std::string address;
+    std::unique_ptr<SNSService::Stub> stub = ResolveRetrying(&address);
+    TimelinePageRequest request;
+    request.set_username(username);
+    request.set_limit(1000);
+    size_t posts = 0;
+    while (true) {
+        ClientContext context;
+        TimelinePage page;
+        Status status = stub->GetTimelinePage(&context, request, &page);
+        if (!status.ok()) {
+            std::cerr << "GetTimelinePage failed: " << status.error_message() << "\n";
+            return posts;
+        }
+        for (const Message& m : page.posts()) {
+            if (m.username() == username) {
+                posts++;
+            }
+        }
+        if (!page.has_next_cursor()) {
+            return posts;
+        }
+        *request.mutable_cursor() = page.next_cursor();
+    }
+}
+
+int ClusterOf() {
+    ClientContext context;
+    Users users;
+    users.add_users(user_id);
+    Placement placement;
+    if (!coordinator->GetPlacement(&context, users, &placement).ok() || placement.user_clusters_size() == 0) {
+        return -1;
+    }
+    return placement.user_clusters(0);
+}
+
+int main(int argc, char** argv) {
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "c:p:u:t:n:r:s:")) != -1){
+        switch(opt) {
+            case 'c':
+                coord_host = optarg;break;
+            case 'p':
+                coord_port = optarg;break;
+            case 'u':
+                user_id = atoi(optarg);break;
+            case 't':
+                to_cluster = atoi(optarg);break;
+            case 'n':
+                preload = atoi(optarg);break;
+            case 'r':
+                post_rate = atoi(optarg);break;
+            case 's':
+                settle = atoi(optarg);break;
+            default:
+                std::cerr << "Invalid Command Line Argument\n";
+        }
+    }
+    if (preload < 0 || post_rate <= 0 || settle < 0) {
+        std::cerr << "Arguments must be positive\n";
+        return -1;
+    }
+    username = std::to_string(user_id);
+    coordinator = SNSCoordinator::NewStub(grpc::CreateChannel(coord_host + ":" + coord_port,
+                                                              grpc::InsecureChannelCredentials()));
+
+    int from_cluster = ClusterOf();
+    std::cout << "User " << username << " is on cluster " << from_cluster << ", moving to " << to_cluster << "\n";
+    if (from_cluster < 0 || from_cluster == to_cluster) {
+        std::cerr << "Nothing to move\n";
+        return -1;
+    }
+
+    std::atomic<bool> stop(false);
+    size_t moves = 0;
+    Clock::time_point start = Clock::now();
+    size_t preloaded = PostUntil(stop, 0, preload, &moves);
+    std::cout << "Stored " << preloaded << " posts in " << MicrosSince(start) / 1000 << "ms\n";
+    size_t before = CountPosts();
+
+    // Follow calls in a loop, each a round trip through the user's master
+    std::atomic<int64_t> max_gap_us(0);
+    std::atomic<size_t> follows(0), refused(0);
+    std::thread prober([&]() {
+        std::string address;
+        std::unique_ptr<SNSService::Stub> stub = ResolveRetrying(&address);
+        Clock::time_point last = Clock::now();
+        while (!stop) {
+            ClientContext context;
+            Request request;
+            request.set_username(username);
+            request.add_arguments(username);
+            Reply reply;
+            Status status = stub->Follow(&context, request, &reply);
+            if (status.ok()) {
+                int64_t gap = MicrosSince(last);
+                if (gap > max_gap_us) {
+                    max_gap_us = gap;
+                }
+                last = Clock::now();
+                follows++;
+                continue;
+            }
+            refused++;
+            std::this_thread::sleep_for(std::chrono::milliseconds(retry_ms));
+            stub = ResolveRetrying(&address);
+        }
+    });
+
+    size_t posted = 0;
+    size_t stream_moves = 0;
+    std::thread poster([&]() {
+        posted = PostUntil(stop, post_rate, 0, &stream_moves);
+    });
+
+    std::this_thread::sleep_for(std::chrono::seconds(settle));
+    ClientContext context;
+    Migration migration;
+    migration.set_user_id(user_id);
+    migration.set_to_cluster(to_cluster);
+    MigrationResult result;
+    Clock::time_point migrate_start = Clock::now();
+    Status status = coordinator->MigrateUser(&context, migration, &result);
+    int64_t migrate_us = MicrosSince(migrate_start);
+    std::this_thread::sleep_for(std::chrono::seconds(settle));
+    stop = true;
+    poster.join();
+    prober.join();
+
+    if (!status.ok()) {
+        std::cerr << "MigrateUser failed: " << status.error_message() << "\n";
+        return -1;
+    }
+    double copy_s = std::max(result.copy_us(), (int64_t)1) / 1e6;
+    std::cout << "Moved from cluster " << result.from_cluster() << " in " << migrate_us / 1000 << "ms: "
+              << result.rounds() << " rounds, " << result.entries() << " entries, " << result.bytes() << " bytes ("
+              << (int64_t)(result.entries() / copy_s) << " entries/s, " << result.bytes() / copy_s / 1e6 << " MB/s)\n";
+    std::cout << "Writes paused " << result.pause_us() / 1000.0 << "ms by the coordinator, longest gap between "
+              << "Follow calls " << max_gap_us / 1000.0 << "ms (" << follows << " ok, " << refused << " refused)\n";
+
+    int now_on = ClusterOf();
+    size_t after = CountPosts();
+    size_t expected = before + posted;
+    std::cout << "Now on cluster " << now_on << " with " << after << " posts, expected " << expected
+              << " (stream moved " << stream_moves << " times)\n";
+    return now_on == to_cluster && after == expected ? 0 : 1;
+}
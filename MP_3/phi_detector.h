@@ -0,0 +1,127 @@
+#ifndef PHI_DETECTOR_H
+#define PHI_DETECTOR_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+
+/*
+ * Phi-accrual failure detector for one server's heartbeats.
+ *
+ * Keeps the last window gaps between heartbeats and treats them as normally
+ * distributed. Phi is how unlikely it is that the next heartbeat is still
+ * coming, given how long it has been since the last: -log10 of the chance
+ * of a gap at least that long. Phi 1 means a 10% chance of being wrong in
+ * suspecting the server, phi 3 a 0.1% chance, and so on. A server that
+ * sends evenly is suspected soon after a late heartbeat, and one whose
+ * heartbeats wander - GC pauses, disk stalls - is given longer.
+ *
+ * The standard deviation is kept at least min_std_ms so perfectly regular
+ * heartbeats do not make phi jump, and pause_ms is added to the mean for
+ * pauses that should never count. Until there are real gaps, the interval
+ * the server says it sends at stands in, give or take a quarter.
+ */
+
+class PhiDetector
+{
+    public:
+        PhiDetector(size_t window = 100, double min_std_ms = 200, double pause_ms = 0)
+            : window_(window), min_std_ms_(min_std_ms), pause_ms_(pause_ms) {}
+
+        // A heartbeat at now_ns from a server sending every interval_ms
+        void Heartbeat(int64_t now_ns, double interval_ms)
+        {
+            if (gaps_.empty() && interval_ms > 0)
+            {
+                Add(interval_ms - interval_ms / 4);
+                Add(interval_ms + interval_ms / 4);
+            }
+            if (last_ns_ != 0)
+            {
+                Add((now_ns - last_ns_) / 1e6);
+            }
+            last_ns_ = now_ns;
+        }
+
+        // Suspicion at now_ns, 0 before the first heartbeat
+        double Phi(int64_t now_ns) const
+        {
+            if (last_ns_ == 0 || gaps_.empty())
+            {
+                return 0;
+            }
+            return PhiOf((now_ns - last_ns_) / 1e6);
+        }
+
+        // Milliseconds after the last heartbeat at which phi reaches
+        // threshold. Phi rises with the time since, so this is when to look.
+        double SuspectAfterMs(double threshold) const
+        {
+            if (gaps_.empty())
+            {
+                return 0;
+            }
+            // Invert the logistic form PhiOf uses, by Newton's method on
+            // y * (a + b * y^2) = ln((1 - p) / p), p = 10^-threshold
+            double p = std::pow(10, -threshold);
+            double target = std::log10((1 - p) / p) * ln10;
+            double y = target / a;
+            for (int i = 0; i < 20; i++)
+            {
+                y -= (y * (a + b * y * y) - target) / (a + 3 * b * y * y);
+            }
+            return Mean() + y * StdDev();
+        }
+
+        double Mean() const
+        {
+            return sum_ / gaps_.size() + pause_ms_;
+        }
+
+        double StdDev() const
+        {
+            double mean = sum_ / gaps_.size();
+            double variance = std::max(0.0, sum_squares_ / gaps_.size() - mean * mean);
+            return std::max(std::sqrt(variance), min_std_ms_);
+        }
+
+    private:
+        // Logistic approximation of the normal distribution's tail
+        static constexpr double a = 1.5976;
+        static constexpr double b = 0.070566;
+        // Spelled out - the coordinator's log macro hides std::log
+        static constexpr double ln10 = 2.302585092994046;
+
+        double PhiOf(double elapsed_ms) const
+        {
+            double y = (elapsed_ms - Mean()) / StdDev();
+            double e = std::exp(-y * (a + b * y * y));
+            double tail = elapsed_ms > Mean() ? e / (1 + e) : 1 - 1 / (1 + e);
+            // Far enough out the tail rounds to 0
+            return tail > 0 ? -std::log10(tail) : 1e9;
+        }
+
+        void Add(double gap_ms)
+        {
+            gaps_.push_back(gap_ms);
+            sum_ += gap_ms;
+            sum_squares_ += gap_ms * gap_ms;
+            if (gaps_.size() > window_)
+            {
+                sum_ -= gaps_.front();
+                sum_squares_ -= gaps_.front() * gaps_.front();
+                gaps_.pop_front();
+            }
+        }
+
+        size_t window_;
+        double min_std_ms_;
+        double pause_ms_;
+        std::deque<double> gaps_;
+        double sum_ = 0;
+        double sum_squares_ = 0;
+        int64_t last_ns_ = 0;
+};
+
+#endif
@@ -0,0 +1,390 @@
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <grpc++/grpc++.h>
+
+#include "sns.grpc.pb.h"
+
+/*
+ * Master to slave replication log.
+ *
+ * The master applies a change locally and then appends it here. A shipper
+ * thread keeps one Replicate stream open to the slave and sends the log in
+ * order - each write carries everything appended since the last one, and it
+ * does not wait for acks, up to max_in_flight unacknowledged entries. The
+ * slave applies and stores each batch and acks the highest index it has;
+ * entries up to that watermark are dropped from the log. If the stream
+ * breaks, the shipper reconnects and resends everything past the watermark,
+ * and the slave skips the indexes it already has. While there is nothing
+ * to send, an empty batch goes out every keepalive_ms, so a slave can tell
+ * how current it is.
+ *
+ * Indexes start at 1 again every time the master starts, so batches carry
+ * the master's epoch. A slave opens every stream by acking its epoch and
+ * index. If that is not a point the log still holds - a new or restarted
+ * slave, a new master, or a slave that fell more than max_entries behind -
+ * the master first sends a snapshot of its whole state, paced to
+ * snapshot_rate bytes a second, and then the log from where the snapshot
+ * began. Snapshots are not frozen: changes made while one is read may be in
+ * both it and the log, so slaves apply entries idempotently.
+ *
+ * The log is only in memory; the snapshot is read from storage.
+ */
+
+class ReplicationLog
+{
+    public:
+        static const size_t max_batch = 256;
+        static const size_t max_batch_bytes = 1 << 20;
+        static const size_t max_in_flight = 4096;
+        static const size_t max_entries = 1 << 20;
+        // Between attempts to reach the slave
+        static const int retry_ms = 1000;
+        static const int keepalive_ms = 100;
+
+        // Passes every snapshot entry to emit, which returns false to stop
+        typedef std::function<bool(const csce438::ReplicationEntry &entry)> EntryVisitor;
+        typedef std::function<void(const EntryVisitor &emit)> SnapshotSource;
+
+        explicit ReplicationLog(uint64_t epoch) : epoch_(epoch) {}
+
+        ~ReplicationLog()
+        {
+            Stop();
+        }
+
+        // Start shipping to the slave behind stub. Snapshots are read from
+        // snapshot and sent at snapshot_rate bytes a second, 0 for no limit.
+        void Start(csce438::SNSService::Stub *stub, SnapshotSource snapshot, double snapshot_rate)
+        {
+            stub_ = stub;
+            snapshot_ = snapshot;
+            snapshot_rate_ = snapshot_rate;
+            shipper_ = std::thread(&ReplicationLog::Ship, this);
+        }
+
+        // Ship to the slave behind stub from now on. The stream to the old
+        // one is dropped, and the new slave resumes or gets a snapshot like
+        // any other. stub must outlive the log.
+        void Retarget(csce438::SNSService::Stub *stub)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stub_ = stub;
+            if (context_ != nullptr)
+            {
+                context_->TryCancel();
+            }
+        }
+
+        void Stop()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stopping_ = true;
+                if (context_ != nullptr)
+                {
+                    context_->TryCancel();
+                }
+            }
+            cv_.notify_all();
+            if (shipper_.joinable())
+            {
+                shipper_.join();
+            }
+        }
+
+        uint64_t epoch() const
+        {
+            return epoch_;
+        }
+
+        // Add a change and return the index it was given
+        uint64_t Append(csce438::ReplicationEntry entry)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            uint64_t index = ++appended_;
+            entry.set_index(index);
+            entries_.push_back(std::move(entry));
+            if (entries_.size() > max_entries)
+            {
+                entries_.pop_front();
+                dropped_++;
+            }
+            cv_.notify_all();
+            return index;
+        }
+
+        // Wait up to timeout_ms for the slave to ack index, false if it did not
+        bool WaitAcked(uint64_t index, int timeout_ms)
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (cv_.wait_for(lock, std::chrono::milliseconds(timeout_ms),
+                             [this, index] { return acked_ >= index || stopping_; }) && acked_ >= index)
+            {
+                return true;
+            }
+            sync_timeouts_++;
+            return false;
+        }
+
+        // "appended <n>, sent <n>, acked <n>, dropped <n>, sync timeouts <n>,
+        // snapshots <n> (<n> bytes)"
+        std::string ToString()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return "appended " + std::to_string(appended_) +
+                   ", sent " + std::to_string(sent_) +
+                   ", acked " + std::to_string(acked_) +
+                   ", dropped " + std::to_string(dropped_) +
+                   ", sync timeouts " + std::to_string(sync_timeouts_) +
+                   ", snapshots " + std::to_string(snapshots_) +
+                   " (" + std::to_string(snapshot_bytes_) + " bytes)";
+        }
+
+    private:
+        typedef grpc::ClientReaderWriter<csce438::ReplicationBatch, csce438::ReplicationAck> Stream;
+
+        // Index of entries_.front()
+        uint64_t FirstIndex() const
+        {
+            return appended_ - entries_.size() + 1;
+        }
+
+        // Everything below this is acked or was dropped
+        uint64_t Watermark() const
+        {
+            return std::max(acked_, FirstIndex() - 1);
+        }
+
+        // One stream at a time, reconnecting whenever it breaks
+        void Ship()
+        {
+            csce438::ReplicationBatch batch;
+            while (true)
+            {
+                grpc::ClientContext context;
+                csce438::SNSService::Stub *stub;
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    if (stopping_)
+                    {
+                        return;
+                    }
+                    context_ = &context;
+                    broken_ = false;
+                    stub = stub_;
+                }
+
+                std::unique_ptr<Stream> stream(stub->Replicate(&context));
+                csce438::ReplicationAck hello;
+                if (stream->Read(&hello))
+                {
+                    std::thread acks(&ReplicationLog::ReadAcks, this, stream.get());
+                    if (Resume(hello) || SendSnapshot(stream.get(), &batch))
+                    {
+                        while (SendNext(stream.get(), &batch))
+                        {
+                        }
+                    }
+                    context.TryCancel();
+                    acks.join();
+                }
+                stream->Finish();
+
+                std::unique_lock<std::mutex> lock(mutex_);
+                context_ = nullptr;
+                cv_.wait_for(lock, std::chrono::milliseconds(retry_ms), [this] { return stopping_; });
+            }
+        }
+
+        // True if the log still has everything after the slave's position,
+        // and shipping can carry on from there
+        bool Resume(const csce438::ReplicationAck &hello)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (hello.epoch() != epoch_ || hello.applied() < FirstIndex() - 1 || hello.applied() > appended_)
+            {
+                return false;
+            }
+            acked_ = std::max(acked_, hello.applied());
+            Trim();
+            sent_ = acked_;
+            return true;
+        }
+
+        // Send the whole state and then the log index it is current to.
+        // False if the stream broke, or the log dropped entries the slave
+        // will need after it.
+        bool SendSnapshot(Stream *stream, csce438::ReplicationBatch *batch)
+        {
+            uint64_t start;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                start = appended_;
+                snapshots_++;
+            }
+
+            auto begin = std::chrono::steady_clock::now();
+            double bytes = 0;
+            auto flush = [&]() -> bool
+            {
+                size_t size = batch->ByteSizeLong();
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    if (stopping_ || broken_)
+                    {
+                        return false;
+                    }
+                    snapshot_bytes_ += size;
+                }
+                bytes += size;
+                if (!stream->Write(*batch))
+                {
+                    return false;
+                }
+                if (snapshot_rate_ > 0)
+                {
+                    std::this_thread::sleep_until(begin + std::chrono::nanoseconds((int64_t)(bytes * 1e9 / snapshot_rate_)));
+                }
+                batch->Clear();
+                batch->set_epoch(epoch_);
+                batch->set_snapshot(true);
+                return true;
+            };
+
+            batch->Clear();
+            batch->set_epoch(epoch_);
+            batch->set_snapshot(true);
+            size_t batch_bytes = 0;
+            bool ok = true;
+            snapshot_([&](const csce438::ReplicationEntry &entry)
+            {
+                *batch->add_entries() = entry;
+                batch_bytes += entry.ByteSizeLong();
+                if ((size_t)batch->entries_size() >= max_batch || batch_bytes >= max_batch_bytes)
+                {
+                    ok = flush();
+                    batch_bytes = 0;
+                }
+                return ok;
+            });
+            if (!ok)
+            {
+                return false;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (FirstIndex() > start + 1)
+                {
+                    return false;
+                }
+                sent_ = start;
+                batch->set_snapshot_index(start);
+                batch->set_appended(appended_);
+            }
+            return flush();
+        }
+
+        // Wait until there is something to send and room in the window, and
+        // send it, or a keepalive if that takes keepalive_ms. False once the
+        // stream has broken or the log is stopping.
+        bool SendNext(Stream *stream, csce438::ReplicationBatch *batch)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                bool ready = cv_.wait_for(lock, std::chrono::milliseconds(keepalive_ms), [this]
+                {
+                    return stopping_ || broken_ ||
+                           (sent_ < appended_ && std::max(sent_, FirstIndex() - 1) - Watermark() < max_in_flight);
+                });
+                if (stopping_ || broken_)
+                {
+                    return false;
+                }
+
+                // The batch is reused, so its entries keep their buffers
+                batch->Clear();
+                batch->set_epoch(epoch_);
+                batch->set_appended(appended_);
+                // Otherwise the batch goes out empty, as a keepalive
+                if (ready)
+                {
+                    uint64_t first = FirstIndex();
+                    uint64_t next = std::max(sent_ + 1, first);
+                    size_t bytes = 0;
+                    while (next <= appended_ && (size_t)batch->entries_size() < max_batch && bytes < max_batch_bytes &&
+                           next - Watermark() <= max_in_flight)
+                    {
+                        const csce438::ReplicationEntry &entry = entries_[next - first];
+                        *batch->add_entries() = entry;
+                        bytes += entry.ByteSizeLong();
+                        next++;
+                    }
+                    sent_ = next - 1;
+                }
+            }
+            return stream->Write(*batch);
+        }
+
+        void ReadAcks(Stream *stream)
+        {
+            csce438::ReplicationAck ack;
+            while (stream->Read(&ack))
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (ack.epoch() == epoch_ && ack.applied() > acked_ && ack.applied() <= sent_)
+                {
+                    acked_ = ack.applied();
+                    Trim();
+                }
+                cv_.notify_all();
+            }
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            broken_ = true;
+            cv_.notify_all();
+        }
+
+        // Drop the acked entries
+        void Trim()
+        {
+            while (!entries_.empty() && FirstIndex() <= acked_)
+            {
+                entries_.pop_front();
+            }
+        }
+
+        const uint64_t epoch_;
+        csce438::SNSService::Stub *stub_ = nullptr;
+        SnapshotSource snapshot_;
+        double snapshot_rate_ = 0;
+        std::thread shipper_;
+
+        std::mutex mutex_;
+        std::condition_variable cv_;
+        std::deque<csce438::ReplicationEntry> entries_;
+        uint64_t appended_ = 0; // index of the newest entry
+        uint64_t sent_ = 0;     // written to the current stream up to here
+        uint64_t acked_ = 0;    // applied on the slave up to here
+        uint64_t dropped_ = 0;
+        uint64_t sync_timeouts_ = 0;
+        uint64_t snapshots_ = 0;
+        uint64_t snapshot_bytes_ = 0;
+        bool broken_ = false;
+        bool stopping_ = false;
+        grpc::ClientContext *context_ = nullptr;
+};
+
+#endif
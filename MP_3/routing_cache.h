@@ -0,0 +1,244 @@
+#ifndef ROUTING_CACHE_H
+#define ROUTING_CACHE_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include <grpc++/grpc++.h>
+
+#include "coordinator.grpc.pb.h"
+#include "hash_ring.h"
+
+/*
+ * Local copy of the coordinator's routing table.
+ *
+ * A thread keeps one WatchTopology stream open and the coordinator pushes
+ * a new versioned table down it whenever a server joins, leaves or is
+ * promoted, a slave's readiness changes, or a user is moved. Users are
+ * placed with the same hash ring the coordinator uses, so looking up where
+ * a user lives never leaves the process. Lookups load the current table
+ * atomically; a table never changes once published.
+ *
+ * If the stream breaks it is reopened with the version already held, and
+ * the coordinator only sends a table if it has changed since.
+ */
+
+class RoutingCache
+{
+    public:
+        // Between attempts to reach the coordinator
+        static const int retry_ms = 1000;
+
+        struct Route
+        {
+            std::string ip;
+            std::string port;
+            bool ready = false; // slaves: caught up with the master
+            uint64_t epoch = 0;
+
+            std::string Address() const
+            {
+                return ip + ":" + port;
+            }
+        };
+
+        class Table
+        {
+            public:
+                explicit Table(const snsCoordinator::Topology &topology) : version_(topology.version())
+                {
+                    for (const snsCoordinator::Route &r : topology.routes())
+                    {
+                        Route route;
+                        route.ip = r.server_ip();
+                        route.port = r.port_num();
+                        route.ready = r.ready();
+                        route.epoch = r.epoch();
+                        routes_[Key(r.cluster(), r.server_type())] = route;
+                    }
+                    for (int cluster : topology.ring_clusters())
+                    {
+                        ring_.Add(cluster);
+                    }
+                    for (int i = 0; i < topology.moved_users_size() && i < topology.moved_to_size(); i++)
+                    {
+                        moved_[topology.moved_users(i)] = topology.moved_to(i);
+                    }
+                }
+
+                Table() {}
+
+                uint64_t version() const
+                {
+                    return version_;
+                }
+
+                // Cluster the user is placed on, -1 if there are none
+                int Cluster(int user_id) const
+                {
+                    auto it = moved_.find(user_id);
+                    return it == moved_.end() ? ring_.LookupUser(user_id) : it->second;
+                }
+
+                bool Find(int cluster, snsCoordinator::ServerType type, Route *route) const
+                {
+                    auto it = routes_.find(Key(cluster, type));
+                    if (it == routes_.end())
+                    {
+                        return false;
+                    }
+                    *route = it->second;
+                    return true;
+                }
+
+                // Every cluster's server of type, by cluster
+                std::map<int, Route> OfType(snsCoordinator::ServerType type) const
+                {
+                    std::map<int, Route> found;
+                    for (const auto &route : routes_)
+                    {
+                        if (route.first.second == type)
+                        {
+                            found[route.first.first] = route.second;
+                        }
+                    }
+                    return found;
+                }
+
+                // Where the user's writes go
+                bool Master(int user_id, Route *route) const
+                {
+                    return Find(Cluster(user_id), snsCoordinator::MASTER, route);
+                }
+
+                // Where the user's reads go - the slave while it is ready,
+                // as GetReadServer picks. *slave says which it is.
+                bool ReadServer(int user_id, Route *route, bool *slave) const
+                {
+                    int cluster = Cluster(user_id);
+                    *slave = Find(cluster, snsCoordinator::SLAVE, route) && route->ready;
+                    return *slave || Find(cluster, snsCoordinator::MASTER, route);
+                }
+
+            private:
+                typedef std::pair<int, snsCoordinator::ServerType> Key;
+
+                uint64_t version_ = 0;
+                std::map<Key, Route> routes_;
+                HashRing ring_;
+                std::map<int, int> moved_;
+        };
+
+        typedef std::function<void(const Table &table)> Listener;
+
+        explicit RoutingCache(snsCoordinator::SNSCoordinator::Stub *coordinator)
+            : coordinator_(coordinator), table_(std::make_shared<const Table>()) {}
+
+        ~RoutingCache()
+        {
+            Stop();
+        }
+
+        // Start watching. listener, if set, is called on the watch thread
+        // with every new table.
+        void Start(Listener listener = nullptr)
+        {
+            listener_ = listener;
+            watcher_ = std::thread(&RoutingCache::Watch, this);
+        }
+
+        void Stop()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stopping_ = true;
+                if (context_ != nullptr)
+                {
+                    context_->TryCancel();
+                }
+            }
+            cv_.notify_all();
+            if (watcher_.joinable())
+            {
+                watcher_.join();
+            }
+        }
+
+        // The table as of now, version 0 before the first arrives
+        std::shared_ptr<const Table> Current() const
+        {
+            return std::atomic_load(&table_);
+        }
+
+        // Wait up to timeout_ms for a table newer than version. True if
+        // there is one.
+        bool WaitNewer(uint64_t version, int timeout_ms)
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            return cv_.wait_for(lock, std::chrono::milliseconds(timeout_ms), [this, version]
+            {
+                return Current()->version() > version || stopping_;
+            }) && Current()->version() > version;
+        }
+
+    private:
+        void Watch()
+        {
+            snsCoordinator::Topology topology;
+            while (true)
+            {
+                grpc::ClientContext context;
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    if (stopping_)
+                    {
+                        return;
+                    }
+                    context_ = &context;
+                }
+
+                snsCoordinator::TopologyRequest request;
+                request.set_known_version(Current()->version());
+                std::unique_ptr<grpc::ClientReader<snsCoordinator::Topology>> reader(
+                    coordinator_->WatchTopology(&context, request));
+                while (reader->Read(&topology))
+                {
+                    std::shared_ptr<const Table> table = std::make_shared<const Table>(topology);
+                    {
+                        std::lock_guard<std::mutex> lock(mutex_);
+                        std::atomic_store(&table_, table);
+                    }
+                    cv_.notify_all();
+                    if (listener_)
+                    {
+                        listener_(*table);
+                    }
+                }
+                reader->Finish();
+
+                std::unique_lock<std::mutex> lock(mutex_);
+                context_ = nullptr;
+                cv_.wait_for(lock, std::chrono::milliseconds(retry_ms), [this] { return stopping_; });
+            }
+        }
+
+        snsCoordinator::SNSCoordinator::Stub *coordinator_;
+        Listener listener_;
+        std::thread watcher_;
+
+        std::mutex mutex_;
+        std::condition_variable cv_;
+        std::shared_ptr<const Table> table_;
+        bool stopping_ = false;
+        grpc::ClientContext *context_ = nullptr;
+};
+
+#endif
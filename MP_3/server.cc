@@ -33,14 +33,24 @@
 
 #include <ctime>
 
+#include <google/protobuf/arena.h>
 #include <google/protobuf/timestamp.pb.h>
 #include <google/protobuf/duration.pb.h>
 
 #include <thread>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <limits>
 #include <memory>
+#include <mutex>
+#include <sstream>
 #include <string>
+#include <unordered_map>
 #include <stdlib.h>
 #include <unistd.h>
 #include <google/protobuf/util/time_util.h>
@@ -53,13 +63,32 @@
 
 #include "sns.grpc.pb.h"
 #include "coordinator.grpc.pb.h"
-#include "json.hpp"
-
+#include "admission.h"
+#include "file_watch.h"
+#include "replication.h"
+#include "routing_cache.h"
+#include "storage.h"
+#include "timeline_batch.h"
+#include "timeline_cache.h"
+#include "user_table.h"
+
+using csce438::ExportRequest;
 using csce438::ListReply;
+using csce438::ListRequest;
 using csce438::Message;
+using csce438::MessageBatch;
+using csce438::PageCursor;
+using csce438::ReplicationAck;
+using csce438::ReplicationBatch;
+using csce438::ReplicationEntry;
 using csce438::Reply;
 using csce438::Request;
 using csce438::SNSService;
+using csce438::TimelinePage;
+using csce438::TimelinePageRequest;
+using csce438::UserMove;
+using google::protobuf::Arena;
+using google::protobuf::ArenaOptions;
 using google::protobuf::Duration;
 using google::protobuf::Timestamp;
 using google::protobuf::util::TimeUtil;
@@ -81,31 +110,183 @@ using snsCoordinator::ServerType;
 using snsCoordinator::SLAVE;
 using snsCoordinator::SNSCoordinator;
 using snsCoordinator::SYNC;
-using json = nlohmann::ordered_json;
 
 // Server info
 std::string port = "-1";
 std::string id = "-1";
-ServerType type;
+// A slave becomes a master if the coordinator promotes it
+std::atomic<ServerType> type;
 std::string follow_location = "follow.json";
 std::string timeline_location = "timeline.json";
 
+// Persistent users, follows and posts (-s json|binary)
+std::string storage_kind = "binary";
+std::unique_ptr<Storage> storage;
+
+// Group commit (-d) - posts are acknowledged only once fdatasynced. A batch
+// is synced after commit_latency_us or once it has commit_batch posts (-b).
+int commit_latency_us = -1;
+int commit_batch = 64;
+
+// How often the group commit counters are logged
+const int commit_stats_interval = 60;
+
+// Admission control - per-user and global token buckets for posts (-r/-R)
+// and for Follow, List and GetTimelinePage calls (-q/-Q), in requests per
+// second, 0 for no limit. Only a master enforces them; its slave just
+// replays what the master let through.
+double user_post_rate = 0;
+double global_post_rate = 0;
+double user_call_rate = 0;
+double global_call_rate = 0;
+Admission post_admission;
+Admission call_admission;
+
+// Buckets hold this many seconds of tokens, so short bursts get through
+const double burst_seconds = 2;
+
+// How often the rejection counters are logged
+const int admission_stats_interval = 60;
+
 // Last update check
 Timestamp last_update;
 
-// Number of seconds for the master to check if any files have been updated
+// The follow file is watched for changes, and also checked this often in
+// seconds in case a change was not signalled
 int update_time = 30;
 
+// How far into the follow file's changes user_db is
+uint64_t graph_position = 0;
+
 // Slave info
 std::string slave_info = "-1";
 
+// Heartbeats go to the coordinator every heartbeat_interval_ms (-H). It
+// answers only when this server has its role or its cluster's promotion
+// epoch wrong: a slave can be promoted to master that way, and a master the
+// coordinator has replaced with its slave is fenced off and refuses every
+// request from then on.
+int heartbeat_interval_ms = 1000;
+std::atomic<uint64_t> cluster_epoch(0);
+std::atomic<bool> fenced(false);
+
+// Clients send keepalive pings, even between calls, to notice a failed
+// server quickly. Pings closer together than this are refused.
+const int min_client_ping_ms = 500;
+
+// The server pings its clients as well, and drops one that does not answer
+// within client_keepalive_ms. A vanished client's Timeline handler then
+// ends instead of waiting on a dead connection.
+const int client_keepalive_ms = 1000;
+
+// Master - changes go to the slave through this log. With -m sync a change
+// also waits up to sync_timeout_ms for the slave's ack before the client
+// hears back, and the client is told if it did not come; -m async (the
+// default) does not wait. Every server has the
+// log, but nothing is added to it until the routing table shows a slave
+// for this cluster while this server is its master - see FollowSlave.
+std::unique_ptr<ReplicationLog> replication;
+std::atomic<bool> replicating(false);
+std::string replication_mode = "async";
+const int sync_timeout_ms = 1000;
+
+// How often the replication watermarks are logged
+const int replication_stats_interval = 60;
+
+// Snapshots for a slave that cannot resume from the log are sent at this
+// many MB/s (-S), 0 for no limit
+double snapshot_rate_mb = 16;
+
+// Slave - how far the master's log has been applied, and in which of its
+// epochs. Ready once it has caught up with the master; a slave that starts
+// or is sent a snapshot is not ready until then.
+std::mutex replica_mutex;
+uint64_t replica_epoch = 0;
+uint64_t replica_applied = 0;
+std::atomic<bool> replica_ready(false);
+// steady_clock time the slave last had everything the master had
+std::atomic<int64_t> replica_current_ns(0);
+
+// Slave - List and GetTimelinePage are served while the slave was last
+// current at most this many milliseconds ago (-L), -1 to serve none
+int max_read_lag_ms = 1000;
+
+// Fan-out policy - posts from authors with at least this many followers are
+// not pushed to every follower. They go into the author's outbox once and each
+// follower's stream pulls them from there.
+int fanout_threshold = 1000;
+
+// Posts kept in each outbox
+const size_t outbox_limit = 100;
+
+// How often a timeline stream pulls from the outboxes it follows
+const int pull_interval_ms = 200;
+
+// Posts sent on INIT, and the default and largest GetTimelinePage sizes
+const size_t history_size = 20;
+
+// Stack block the INIT history frame is built in - fits history_size
+// posts of a few hundred bytes before the arena goes to the heap
+const size_t history_arena_block = 16 * 1024;
+const size_t max_page_size = 100;
+
+// Most posts a resumed INIT sends - a client away for longer gets the
+// newest ones and pages back for the rest
+const size_t resume_limit = 1000;
+
+// Default and largest List page sizes
+const size_t list_page_size = 1000;
+const size_t max_list_page_size = 10000;
+
+// Changes every time the server starts, so List tokens from an earlier run
+// (when user_db may have been loaded in another order) are not trusted
+std::string list_epoch;
+
 struct User
 {
     std::string username;
     bool connected = false;
     std::vector<User *> followers;
+    std::atomic<uint64_t> followers_version{0}; // bumped whenever followers changes
     std::vector<User *> following;
+    std::unordered_map<std::string, int64_t> follow_time; // when each following started
+
+    // The user's newest Timeline stream, which followers' posts are pushed
+    // to. A new stream replaces it, and a handler only clears it if it is
+    // still its own. Held for every write to the user's streams, as a
+    // stream takes one write at a time.
+    std::mutex stream_mutex;
     ServerReaderWriter<Message, Message> *stream = 0;
+
+    // TimelineBatch - posts wait here until the stream's writer picks them
+    // up. Only the newest TimelineBatch stream has a writer taking them. A
+    // handler, or its writer once a write fails, only clears batch_stream
+    // if it is still its own.
+    ServerReaderWriter<MessageBatch, Message> *batch_stream = 0;
+    std::mutex pending_mutex;
+    std::condition_variable pending_cv;
+    MessageList pending;
+
+    // Pull fan-out - recent posts while over fanout_threshold. The outbox is
+    // a ring of up to outbox_limit posts, post n is at outbox[n % outbox_limit]
+    std::mutex outbox_mutex;
+    std::vector<Message> outbox;
+    std::atomic<uint64_t> outbox_end{0}; // sequence number after the newest outbox post
+
+    // Admission control
+    TokenBucket post_bucket;
+    TokenBucket call_bucket;
+
+    // Held while a post is numbered and stored, so the author's sequence
+    // numbers reach storage in order. Loaded from storage on the first post.
+    std::mutex post_mutex;
+    bool sequence_loaded = false;
+    uint64_t last_sequence = 0;
+
+    // Set under post_mutex once the user has moved to another cluster - its
+    // calls are then refused, and the client asks the coordinator again
+    std::atomic<bool> moved{false};
+
     bool operator==(const User &c1) const
     {
         return (username == c1.username);
@@ -115,23 +296,45 @@ struct User
 // Coordinator Stub
 std::unique_ptr<SNSCoordinator::Stub> coord_stub_;
 
-// Slave Stub
-std::unique_ptr<SNSService::Stub> slave_stub_;
+// The coordinator's routing table, kept current by its WatchTopology stream
+std::unique_ptr<RoutingCache> routes;
 
-// Vector that stores every client that has been created
-std::vector<User *> user_db;
+// Stubs of every slave replicated to - the log may still be using the last
+// one. slave_mutex also guards slave_info and starting the log.
+std::mutex slave_mutex;
+std::vector<std::unique_ptr<SNSService::Stub>> slave_stubs_;
+
+// Every client that has been created. Appended to under user_index_mutex
+// and read without it - user_table.h never moves an entry once added.
+AppendTable<User *> user_db;
+
+// Guards every user's followers, following and follow_time. Follows and
+// follow file reloads change them under it, and everything that walks them
+// holds it - posts copy the followers out rather than writing to streams
+// while holding it.
+std::mutex graph_mutex;
+
+// username -> index in user_db
+std::unordered_map<std::string, int> user_index;
+std::mutex user_index_mutex;
 
 // Helper function used to find a Client object given its username
 int find_user(std::string username)
 {
-    int index = 0;
-    for (User *c : user_db)
-    {
-        if (c->username == username)
-            return index;
-        index++;
-    }
-    return -1;
+    std::lock_guard<std::mutex> lock(user_index_mutex);
+    auto it = user_index.find(username);
+    return it == user_index.end() ? -1 : it->second;
+}
+
+// Add a new user to user_db and the index
+User *AddUser(const std::string &username)
+{
+    User *user = new User;
+    user->username = username;
+    std::lock_guard<std::mutex> lock(user_index_mutex);
+    user_index[username] = user_db.size();
+    user_db.push_back(user);
+    return user;
 }
 
 // Check if user -> follow_username
@@ -149,495 +352,1917 @@ int find_following(User *user, std::string following_username)
     return -1;
 }
 
-void UpdateJSON(json j, std::string location)
+// Master - add a change to the replication log, returning its index.
+// 0 if this server has no slave to replicate to.
+uint64_t LogChange(ReplicationEntry entry)
+{
+    return replicating ? replication->Append(std::move(entry)) : 0;
+}
+
+// In sync mode, wait for the slave to have the change at index. If it does
+// not answer in time the change stays applied here, but the reply must not
+// claim the slave has it: DEADLINE_EXCEEDED, logged and counted with the
+// replication stats.
+Status WaitReplicated(uint64_t index)
+{
+    if (index == 0 || replication_mode != "sync" || replication->WaitAcked(index, sync_timeout_ms))
+    {
+        return Status::OK;
+    }
+    glog(WARNING, "Slave did not confirm change " + std::to_string(index) + " within " +
+                      std::to_string(sync_timeout_ms) + "ms");
+    return Status(grpc::StatusCode::DEADLINE_EXCEEDED,
+                  "Stored, but the slave did not confirm it within " + std::to_string(sync_timeout_ms) + "ms");
+}
+
+// Master - names the change at index, for a client to send with reads so a
+// slave serves them only once it has the change. Empty without a slave.
+std::string SessionToken(uint64_t index)
+{
+    if (index == 0)
+    {
+        return "";
+    }
+    return std::to_string(replication->epoch()) + "." + std::to_string(index);
+}
+
+// Slave - OK if a client read can be served here: the slave was current
+// with its master within max_read_lag_ms and has the change named by the
+// client's session token. UNAVAILABLE otherwise, so the client asks its
+// master instead.
+Status CheckReadable(const std::string &session_token)
 {
-    // glog(INFO, "Updating json");
-    std::ofstream ofs(location);
-    ofs << std::setw(4) << j << std::endl;
-    ofs.close();
+    if (type == MASTER)
+    {
+        return Status::OK;
+    }
+    if (max_read_lag_ms < 0)
+    {
+        return Status(grpc::StatusCode::UNAVAILABLE, "Reads are not served by this slave");
+    }
+    int64_t lag_ns = std::chrono::steady_clock::now().time_since_epoch().count() - replica_current_ns;
+    if (!replica_ready || lag_ns > (int64_t)max_read_lag_ms * 1000000)
+    {
+        return Status(grpc::StatusCode::UNAVAILABLE, "Slave is behind its master");
+    }
+    if (session_token.empty())
+    {
+        return Status::OK;
+    }
+
+    // "<epoch>.<index>" - a change from an earlier epoch came with the
+    // snapshot of the current one
+    size_t dot = session_token.find('.');
+    if (dot == 0 || dot == std::string::npos || dot + 1 == session_token.size() ||
+        session_token.find_first_not_of("0123456789", dot + 1) != std::string::npos ||
+        session_token.find_first_not_of("0123456789") != dot)
+    {
+        return Status(grpc::StatusCode::INVALID_ARGUMENT, "Bad session token");
+    }
+    uint64_t epoch = std::stoull(session_token.substr(0, dot));
+    uint64_t index = std::stoull(session_token.substr(dot + 1));
+    std::lock_guard<std::mutex> lock(replica_mutex);
+    if (epoch > replica_epoch || (epoch == replica_epoch && index > replica_applied))
+    {
+        return Status(grpc::StatusCode::UNAVAILABLE, "Slave does not have the session's writes yet");
+    }
+    return Status::OK;
 }
 
-// Add a new user to data.json
-void CreateUserJSON(std::string username)
+// UNAVAILABLE once user has moved to another cluster, or this master has
+// been replaced
+Status CheckHome(User *user)
 {
-    // Load data.json
-    std::ifstream file(follow_location);
-    json j = json::parse(file);
-    file.close();
+    if (fenced)
+    {
+        return Status(grpc::StatusCode::UNAVAILABLE, "Server was replaced by its slave");
+    }
+    if (user != 0 && user->moved)
+    {
+        return Status(grpc::StatusCode::UNAVAILABLE, "User has moved to another cluster");
+    }
+    return Status::OK;
+}
 
-    // Create user object
-    json user_data;
-    user_data["username"] = username;
-    user_data["following"] = json::object();
-    j["users"][username] = user_data;
+// Stamp a post by user with the time and the user's next sequence number,
+// and store it. INTERNAL if the post could not be stored - its sequence
+// number is then given to the next post - and UNAVAILABLE if the user has
+// moved. With group commit (-d) this returns once the post is on disk.
+// *log_index is set to its replication log index.
+Status StorePost(User *user, Message *message, uint64_t *log_index)
+{
+    std::lock_guard<std::mutex> lock(user->post_mutex);
+    Status home = CheckHome(user);
+    if (!home.ok())
+    {
+        return home;
+    }
+    if (!user->sequence_loaded)
+    {
+        user->last_sequence = storage->LastSequence(user->username);
+        user->sequence_loaded = true;
+    }
 
-    UpdateJSON(j, follow_location);
+    int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    NanosToTimestamp(now, message->mutable_timestamp());
+    message->set_sequence(user->last_sequence + 1);
+
+    StoredPost post;
+    post.username = message->username();
+    post.msg = message->msg();
+    post.timestamp = message->timestamp().seconds();
+    post.nanos = message->timestamp().nanos();
+    post.sequence = message->sequence();
+    if (!storage->AppendPost(post))
+    {
+        return Status(grpc::StatusCode::INTERNAL, "Post could not be stored");
+    }
+    user->last_sequence++;
+
+    // Still under post_mutex, so the author's posts are logged in order
+    ReplicationEntry entry;
+    entry.set_op(ReplicationEntry::POST);
+    entry.set_username(user->username);
+    *entry.mutable_post() = *message;
+    *log_index = LogChange(std::move(entry));
+    return Status::OK;
 }
 
-void FollowUserJSON(std::string username, std::string username_to_follow)
+// Slave, or a master a user moves to - store a post exactly as the master
+// it came from did. A post already here (by its sequence number) is skipped.
+bool ApplyPost(const Message &message)
 {
+    int user_index = find_user(message.username());
+    if (user_index < 0)
+    {
+        return false;
+    }
+    User *user = user_db[user_index];
+
+    std::lock_guard<std::mutex> lock(user->post_mutex);
+    if (!user->sequence_loaded)
+    {
+        user->last_sequence = storage->LastSequence(user->username);
+        user->sequence_loaded = true;
+    }
+    if (message.sequence() > 0 && message.sequence() <= user->last_sequence)
+    {
+        return true;
+    }
 
-    // Load data.json
-    std::ifstream file(follow_location);
-    json j = json::parse(file);
-    file.close();
+    StoredPost post;
+    post.username = message.username();
+    post.msg = message.msg();
+    post.timestamp = message.timestamp().seconds();
+    post.nanos = message.timestamp().nanos();
+    post.sequence = message.sequence();
+    if (!storage->AppendPost(post))
+    {
+        return false;
+    }
+    user->last_sequence = std::max(user->last_sequence, post.sequence);
+    return true;
+}
+
+// ------------------------------------------------------------
+// Changes that are replicated. The master's handlers and the slave's
+// replay of its log both go through these, so the two apply them alike.
+// Applying one twice changes nothing, since a slave can be sent a change
+// both in a snapshot and in the log.
+// ------------------------------------------------------------
 
-    Timestamp *timestamp = new Timestamp();
-    timestamp->set_seconds(time(NULL));
-    timestamp->set_nanos(0);
+// Create the user if it does not exist yet. True if it was created.
+bool ApplyUser(const std::string &username)
+{
+    if (find_user(username) >= 0)
+    {
+        return false;
+    }
+    AddUser(username);
+    storage->CreateUser(username);
+    return true;
+}
 
-    json follow_data;
-    follow_data["username"] = username_to_follow;
-    follow_data["timestamp"] = timestamp->seconds();
+// Log a user in, creating it on first login. Returns the reply.
+std::string ApplyLogin(const std::string &username)
+{
+    if (ApplyUser(username))
+    {
+        return "Login Successful!";
+    }
+    int user_index = find_user(username);
 
-    // Update json
-    j["users"][username]["following"][username_to_follow] = follow_data;
+    User *user = user_db[user_index];
+    if (user->connected)
+    {
+        return "You have already logged in!";
+    }
+    user->connected = true;
+    return "Welcome Back " + user->username;
+}
 
-    UpdateJSON(j, follow_location);
+void ApplyLogout(const std::string &username)
+{
+    int user_index = find_user(username);
+    if (user_index >= 0)
+    {
+        user_db[user_index]->connected = false;
+    }
 }
 
-void TimelineJSON(Message message, Timestamp *timestamp)
+// username1 follows username2 from timestamp on. False if it could not,
+// and *msg says why.
+bool ApplyFollow(const std::string &username1, const std::string &username2, int64_t timestamp, std::string *msg)
 {
-    std::string username = message.username();
+    int follower_index = find_user(username1);
+    int join_index = find_user(username2);
+
+    // Prevent self follow or a user that isn't in the db
+    if (follower_index < 0 || join_index < 0 || username1 == username2)
+    {
+        *msg = "Follow Failed - Invalid Username";
+        return false;
+    }
 
-    // Load data.json
-    std::ifstream file(timeline_location);
-    json j = json::parse(file);
-    file.close();
+    User *user1 = user_db[follower_index];
+    User *user2 = user_db[join_index];
+    // A follow file reload cannot run between storing and linking, and
+    // find the edge in memory but not yet in the file
+    std::lock_guard<std::mutex> lock(graph_mutex);
+    if (std::find(user1->following.begin(), user1->following.end(), user2) != user1->following.end())
+    {
+        *msg = "Follow Failed - Already Following User";
+        return false;
+    }
 
-    json post = json::object();
-    post["message"] = message.msg();
-    post["username"] = message.username();
-    post["timestamp"] = timestamp->seconds();
-    j["posts"].push_back(post);
+    // Update storage
+    storage->Follow(user1->username, user2->username, timestamp);
+
+    user1->following.push_back(user2);
+    user1->follow_time[user2->username] = timestamp;
+    user2->followers.push_back(user1);
+    user2->followers_version++;
+    *msg = "Follow Successful";
+    return true;
+}
 
-    UpdateJSON(j, timeline_location);
+// Slave - apply one entry of the master's log. False if it could not be
+// stored, in which case the master sends it again.
+bool ApplyEntry(const ReplicationEntry &entry)
+{
+    switch (entry.op())
+    {
+    case ReplicationEntry::LOGIN:
+        ApplyLogin(entry.username());
+        return true;
+    case ReplicationEntry::LOGOUT:
+        ApplyLogout(entry.username());
+        return true;
+    case ReplicationEntry::FOLLOW:
+    {
+        std::string msg;
+        ApplyFollow(entry.username(), entry.following(), entry.timestamp(), &msg);
+        return true;
+    }
+    case ReplicationEntry::POST:
+        return ApplyPost(entry.post());
+    case ReplicationEntry::USER:
+        ApplyUser(entry.username());
+        return true;
+    default:
+        glog(ERROR, "Unknown replication op " + std::to_string(entry.op()));
+        return true;
+    }
 }
 
-void CreateEmptyData() {
-    json fj = json::object();
-    json tj = json::object();
-    fj["users"] = json::object();
-    tj["posts"] = json::array();
-    UpdateJSON(fj, follow_location);
-    UpdateJSON(tj, timeline_location);
+// Run body(worker, workers) once on each of workers threads
+void RunWorkers(const std::function<void(size_t worker, size_t workers)> &body)
+{
+    size_t workers = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::thread> threads;
+    for (size_t w = 1; w < workers; w++)
+    {
+        threads.emplace_back(body, w, workers);
+    }
+    body(0, workers);
+    for (std::thread &t : threads)
+    {
+        t.join();
+    }
 }
 
-// Load follow data - assumes empty local db
-void LoadFollowData()
+// Startup load into an empty user_db. Storage streams out the users and
+// edges, the directory is built and indexed once, and then the edges are
+// resolved and linked in parallel - each worker owns the users whose index
+// is its worker number mod workers, so no two workers touch the same User.
+void BulkLoadFollowData()
 {
-    std::ifstream file(follow_location);
-    json j;
+    auto start = std::chrono::steady_clock::now();
 
-    if (file.is_open())
+    struct Edge
     {
+        std::string username;
+        std::string following;
+        int64_t timestamp;
+    };
+    std::vector<std::string> names;
+    std::vector<Edge> edges;
+    storage->LoadGraph(
+        [&names](const std::string &uname)
+        {
+            names.push_back(uname);
+        },
+        [&edges](const std::string &uname, const std::string &follow_username, int64_t timestamp)
+        {
+            edges.push_back({uname, follow_username, timestamp});
+        });
+    auto parsed = std::chrono::steady_clock::now();
 
-        // Check if file is empty
-        if (file.peek() == std::ifstream::traits_type::eof())
+    // Directory - allocate in parallel, then index in load order
+    std::vector<User *> created(names.size());
+    RunWorkers([&](size_t w, size_t workers)
+    {
+        for (size_t i = names.size() * w / workers; i < names.size() * (w + 1) / workers; i++)
         {
-            file.close();
-            CreateEmptyData();
-            return;
+            created[i] = new User;
+            created[i]->username = names[i];
         }
+    });
+    user_index.reserve(names.size());
+    for (User *user : created)
+    {
+        if (!user_index.emplace(user->username, user_db.size()).second)
+        {
+            delete user; // listed twice
+            continue;
+        }
+        user_db.push_back(user);
+    }
 
-        // Parse json
-        j = json::parse(file);
-        file.close();
-
-        for (auto user_data : j["users"])
+    // Resolve edges - the index is read-only until the misses are added
+    std::vector<std::pair<int, int>> resolved(edges.size());
+    RunWorkers([&](size_t w, size_t workers)
+    {
+        for (size_t i = edges.size() * w / workers; i < edges.size() * (w + 1) / workers; i++)
+        {
+            auto from = user_index.find(edges[i].username);
+            auto to = user_index.find(edges[i].following);
+            resolved[i].first = from == user_index.end() ? -1 : from->second;
+            resolved[i].second = to == user_index.end() ? -1 : to->second;
+        }
+    });
+    // Add users only named by an edge
+    auto find_or_add = [](const std::string &uname)
+    {
+        int index = find_user(uname);
+        if (index < 0)
+        {
+            AddUser(uname);
+            index = user_db.size() - 1;
+        }
+        return index;
+    };
+    for (size_t i = 0; i < edges.size(); i++)
+    {
+        if (resolved[i].first < 0)
+        {
+            resolved[i].first = find_or_add(edges[i].username);
+        }
+        if (resolved[i].second < 0)
         {
-            // Find user in local db
-            User *user;
-            std::string uname = user_data["username"];
-            int user_index = find_user(uname);
+            resolved[i].second = find_or_add(edges[i].following);
+        }
+    }
 
-            // Create the user if not found
-            if (user_index == -1)
+    // Link - storage gives every current edge once, so no duplicate checks
+    RunWorkers([&](size_t w, size_t workers)
+    {
+        for (size_t i = 0; i < edges.size(); i++)
+        {
+            User *user = user_db[resolved[i].first];
+            User *user2 = user_db[resolved[i].second];
+            if ((size_t)resolved[i].first % workers == w)
             {
-                user = new User;
-                user->username = uname;
-                user_db.push_back(user);
+                user->following.push_back(user2);
+                user->follow_time[user2->username] = edges[i].timestamp;
             }
-            // Grab the user in the local database
-            else
+            if ((size_t)resolved[i].second % workers == w)
             {
-                user = user_db[user_index];
+                user2->followers.push_back(user);
+                user2->followers_version++;
             }
+        }
+    });
+    auto linked = std::chrono::steady_clock::now();
+
+    auto ms = [](std::chrono::steady_clock::duration d)
+    {
+        return std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(d).count());
+    };
+    glog(INFO, "Loaded " + std::to_string(user_db.size()) + " users and " + std::to_string(edges.size()) +
+                   " follows in " + ms(linked - start) + "ms (read " + ms(parsed - start) + "ms, build " +
+                   ms(linked - parsed) + "ms)");
+}
+
+// What a follow file reload changed in user_db
+struct GraphDelta
+{
+    size_t users = 0;
+    size_t added = 0;
+    size_t removed = 0;
+    size_t records = 0; // read from the file
+};
+
+// Find a user named in the follow file, creating it if needed
+User *LoadUser(const std::string &uname, GraphDelta *delta)
+{
+    int index = find_user(uname);
+    if (index >= 0)
+    {
+        return user_db[index];
+    }
+    delta->users++;
+    return AddUser(uname);
+}
+
+// user follows user2 from timestamp on, unless it already does. Needs
+// graph_mutex, as does UnlinkFollow.
+void LinkFollow(User *user, User *user2, int64_t timestamp, GraphDelta *delta)
+{
+    if (user == user2 || find_following(user, user2->username) >= 0)
+    {
+        return;
+    }
+    user->following.push_back(user2);
+    user->follow_time[user2->username] = timestamp;
+    user2->followers.push_back(user);
+    user2->followers_version++;
+    delta->added++;
+}
+
+// user stops following user2, if it does
+void UnlinkFollow(User *user, User *user2, GraphDelta *delta)
+{
+    int index = find_following(user, user2->username);
+    if (index < 0)
+    {
+        return;
+    }
+    user->following.erase(user->following.begin() + index);
+    user->follow_time.erase(user2->username);
+    auto it = std::find(user2->followers.begin(), user2->followers.end(), user);
+    if (it != user2->followers.end())
+    {
+        user2->followers.erase(it);
+    }
+    user2->followers_version++;
+    delta->removed++;
+}
+
+void LogGraphDelta(const char *kind, const GraphDelta &delta, std::chrono::steady_clock::time_point start)
+{
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    glog(INFO, std::string(kind) + " follow reload: " + std::to_string(delta.records) + " records read, " +
+                   std::to_string(delta.users) + " new users, +" + std::to_string(delta.added) + " -" +
+                   std::to_string(delta.removed) + " follows in " + std::to_string(us) + "us");
+}
+
+// Reload the whole follow file and make user_db's follows match it. Only
+// the edges that differ are added or removed.
+void LoadFollowData()
+{
+    auto start = std::chrono::steady_clock::now();
+    GraphDelta delta;
+    std::lock_guard<std::mutex> lock(graph_mutex);
+
+    // Who each user follows in the file
+    std::unordered_map<User *, std::unordered_map<std::string, int64_t>> file_following;
+    storage->LoadGraph(
+        [&](const std::string &uname)
+        {
+            delta.records++;
+            file_following[LoadUser(uname, &delta)];
+        },
+        [&](const std::string &uname, const std::string &follow_username, int64_t timestamp)
+        {
+            delta.records++;
+            User *user = LoadUser(uname, &delta);
+            LoadUser(follow_username, &delta);
+            file_following[user][follow_username] = timestamp;
+        });
+
+    for (auto &entry : file_following)
+    {
+        User *user = entry.first;
+        const std::unordered_map<std::string, int64_t> &wanted = entry.second;
 
-            // Load followings / followers
-            for (auto following_data : user_data["following"])
+        // Removals first - iterating a copy, since unlinking edits the list
+        std::vector<User *> current = user->following;
+        for (User *user2 : current)
+        {
+            if (wanted.find(user2->username) == wanted.end())
             {
-                std::string follow_username = following_data["username"];
-                User *user2;
-                glog(INFO, "Adding " + uname + " -> " + follow_username);
+                UnlinkFollow(user, user2, &delta);
+            }
+        }
+        if (wanted.size() == user->following.size())
+        {
+            continue;
+        }
+        for (const auto &follow : wanted)
+        {
+            LinkFollow(user, user_db[find_user(follow.first)], follow.second, &delta);
+        }
+    }
+    LogGraphDelta("Full", delta, start);
+}
 
-                // Find user_to_follow in local db
-                int index = find_user(follow_username);
+// Apply the follow file's changes since graph_position. False if the
+// storage cannot read them incrementally. Costs time in the number of
+// changes, not the size of the graph.
+bool LoadFollowChanges()
+{
+    auto start = std::chrono::steady_clock::now();
+    GraphDelta delta;
+    std::lock_guard<std::mutex> lock(graph_mutex);
+    bool ok = storage->LoadGraphChanges(
+        &graph_position,
+        [&delta](const std::string &uname)
+        {
+            delta.records++;
+            LoadUser(uname, &delta);
+        },
+        [&delta](const std::string &uname, const std::string &follow_username, int64_t timestamp)
+        {
+            delta.records++;
+            LinkFollow(LoadUser(uname, &delta), LoadUser(follow_username, &delta), timestamp, &delta);
+        },
+        [&delta](const std::string &uname, const std::string &follow_username)
+        {
+            delta.records++;
+            UnlinkFollow(LoadUser(uname, &delta), LoadUser(follow_username, &delta), &delta);
+        });
+    if (ok && delta.records > 0)
+    {
+        LogGraphDelta("Incremental", delta, start);
+    }
+    return ok;
+}
 
-                // Create the user if not found
-                if (index == -1)
-                {
-                    user2 = new User;
-                    user2->username = follow_username;
-                    user_db.push_back(user2);
-                }
-                // Grab the user in the local database
-                else
-                {
-                    user2 = user_db[index];
-                }
+// RESOURCE_EXHAUSTED with a retry hint - in the message, and in
+// milliseconds in the retry-after-ms trailer
+Status RateLimited(ServerContext *context, int64_t retry_ns)
+{
+    std::string retry_ms = std::to_string((retry_ns + 999999) / 1000000);
+    context->AddTrailingMetadata("retry-after-ms", retry_ms);
+    return Status(grpc::StatusCode::RESOURCE_EXHAUSTED, "Rate limited - retry in " + retry_ms + "ms");
+}
 
-                // Check if already following
-                if ((find_following(user, follow_username)) < -1)
-                {
-                    glog(INFO, "Already Following");
-                    continue;
-                }
+// Queue a post for a TimelineBatch follower
+void QueueBatchPost(User *user, const Message &message)
+{
+    std::lock_guard<std::mutex> lock(user->pending_mutex);
+    if (user->batch_stream == 0)
+    {
+        return;
+    }
+    user->pending.Add(message);
+    // A replaced stream's writer may still be waiting too
+    user->pending_cv.notify_all();
+}
 
-                user->following.push_back(user2);
-                user2->followers.push_back(user);
+// Needs graph_mutex
+bool IsPullAuthor(User *user)
+{
+    return (int)user->followers.size() >= fanout_threshold;
+}
+
+// Store a post once for all followers to pull
+void AppendOutbox(User *user, const Message &message)
+{
+    std::lock_guard<std::mutex> lock(user->outbox_mutex);
+    if (user->outbox.size() < outbox_limit)
+    {
+        user->outbox.push_back(message);
+    }
+    else
+    {
+        CopyPost(message, &user->outbox[user->outbox_end % outbox_limit]);
+    }
+    user->outbox_end++;
+}
+
+// Send a new post to every connected follower, or leave it in the outbox
+// if the author has too many followers
+void SendToFollowers(User *user, const Message &message)
+{
+    // Reused by each posting thread, so the steady state allocates nothing
+    static thread_local std::vector<User *> followers;
+    {
+        std::lock_guard<std::mutex> lock(graph_mutex);
+        if (!IsPullAuthor(user))
+        {
+            followers.assign(user->followers.begin(), user->followers.end());
+        }
+        else
+        {
+            followers.clear();
+            // The outbox lock is only ever taken after graph_mutex
+            AppendOutbox(user, message);
+        }
+    }
+
+    for (User *u : followers)
+    {
+        {
+            std::lock_guard<std::mutex> lock(u->stream_mutex);
+            if (u->stream != 0)
+            {
+                u->stream->Write(message);
+                continue;
             }
         }
+        QueueBatchPost(u, message);
+    }
+}
+
+// Outbox position a stream has read up to, per followed author
+typedef std::unordered_map<User *, uint64_t> OutboxCursors;
+
+// Start pulling from now - older posts are covered by the INIT history
+void StartCursors(User *user, OutboxCursors &cursors)
+{
+    std::lock_guard<std::mutex> lock(graph_mutex);
+    for (User *u : user->following)
+    {
+        cursors[u] = u->outbox_end;
+    }
+}
+
+// Pull outbox posts newer than the cursors and merge them into posts by time.
+// Cost is bounded by followed authors * outbox_limit.
+void PullPosts(User *user, OutboxCursors &cursors, MessageList *posts)
+{
+    size_t pushed = posts->size();
+
+    std::unique_lock<std::mutex> graph_lock(graph_mutex);
+    for (User *u : user->following)
+    {
+        auto it = cursors.find(u);
+
+        // Newly followed - only see posts from now on
+        if (it == cursors.end())
+        {
+            cursors[u] = u->outbox_end;
+            continue;
+        }
+        if (it->second == u->outbox_end)
+        {
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(u->outbox_mutex);
+        uint64_t first = u->outbox_end - u->outbox.size();
+        for (uint64_t i = std::max(it->second, first); i < u->outbox_end; i++)
+        {
+            posts->Add(u->outbox[i % outbox_limit]);
+        }
+        it->second = u->outbox_end;
+    }
+    graph_lock.unlock();
+
+    if (posts->size() > pushed)
+    {
+        std::stable_sort(posts->begin(), posts->end(), [](const Message &a, const Message &b)
+        {
+            return a.timestamp().seconds() < b.timestamp().seconds() ||
+                   (a.timestamp().seconds() == b.timestamp().seconds() && a.timestamp().nanos() < b.timestamp().nanos());
+        });
     }
+}
+
+// Authors whose posts are on a user's timeline - own posts from the start,
+// followed users' from when they were followed
+AuthorSince TimelineAuthors(User *user)
+{
+    std::lock_guard<std::mutex> lock(graph_mutex);
+    AuthorSince authors(user->follow_time.begin(), user->follow_time.end());
+    authors[user->username] = std::numeric_limits<int64_t>::min();
+    return authors;
+}
+
+// Fill message in place, reusing whatever it already holds
+void ToMessage(const StoredPost &post, Message *message)
+{
+    message->set_username(post.username);
+    message->set_msg(post.msg);
+    message->mutable_timestamp()->set_seconds(post.timestamp);
+    message->mutable_timestamp()->set_nanos(post.nanos);
+    message->set_sequence(post.sequence);
+}
+
+// Master - a slave's starting point when the log is not enough: every user,
+// then every follow, then every post, oldest first. It is read from storage
+// while changes keep coming, so some may also be in the log after it.
+void SnapshotState(const ReplicationLog::EntryVisitor &emit)
+{
+    bool more = true;
+    ReplicationEntry entry;
+    storage->LoadGraph(
+        [&](const std::string &username)
+        {
+            if (more)
+            {
+                entry.Clear();
+                entry.set_op(ReplicationEntry::USER);
+                entry.set_username(username);
+                more = emit(entry);
+            }
+        },
+        [&](const std::string &username, const std::string &following, int64_t timestamp)
+        {
+            if (more)
+            {
+                entry.Clear();
+                entry.set_op(ReplicationEntry::FOLLOW);
+                entry.set_username(username);
+                entry.set_following(following);
+                entry.set_timestamp(timestamp);
+                more = emit(entry);
+            }
+        });
+
+    if (more)
+    {
+        storage->ScanPosts([&](const StoredPost &post)
+        {
+            entry.Clear();
+            entry.set_op(ReplicationEntry::POST);
+            entry.set_username(post.username);
+            ToMessage(post, entry.mutable_post());
+            return emit(entry);
+        });
+    }
+}
+
+// The INIT history - the most recent posts the user can see, newest first.
+// With a resume vector only the posts the client is missing are returned:
+// for an author it has posts from, the user included, the ones after the
+// newest of those, and for anyone else the ones since its oldest cached post.
+std::vector<StoredPost> RecentPosts(User *user, const Message &init)
+{
+    AuthorSince authors = TimelineAuthors(user);
+    if (!init.has_resume())
+    {
+        return storage->RecentPosts(authors, history_size);
+    }
+
+    // Start each author at the second of the post the client has - an
+    // author's sequence numbers only go up with time - or at since
+    const csce438::ResumeVector &resume = init.resume();
+    std::unordered_map<std::string, uint64_t> after;
+    for (auto &a : authors)
+    {
+        a.second = std::max(a.second, resume.since());
+    }
+    for (const csce438::ResumePoint &point : resume.authors())
+    {
+        auto it = authors.find(point.author());
+        if (it != authors.end())
+        {
+            it->second = std::max(it->second, point.timestamp());
+            after[point.author()] = point.sequence();
+        }
+    }
+
+    // That also finds the posts from that second the client has. Drop them,
+    // and ask for as many more until resume_limit are left or there are none.
+    std::vector<StoredPost> posts;
+    size_t limit = resume_limit;
+    while (true)
+    {
+        std::vector<StoredPost> found = storage->RecentPosts(authors, limit);
+        posts.clear();
+        for (StoredPost &post : found)
+        {
+            auto it = after.find(post.username);
+            if (it == after.end() || post.sequence > it->second)
+            {
+                posts.push_back(std::move(post));
+            }
+        }
+        if (posts.size() >= resume_limit || found.size() < limit)
+        {
+            break;
+        }
+        limit += found.size() - posts.size();
+    }
+    if (posts.size() > resume_limit)
+    {
+        posts.resize(resume_limit);
+    }
+    return posts;
+}
+
+// ------------------------------------------------------------
+// List tokens
+//
+// A directory version is "<epoch>.<users>.<followers_version>" and a list
+// cursor is "<epoch>.<index>". user_db only grows, so within one epoch
+// (one run of the server) the users after an index are exactly the ones
+// added since, and a version tells both how much of user_db the client
+// has and whether its follower list is current.
+// ------------------------------------------------------------
+
+std::string ListCursor(size_t index)
+{
+    return list_epoch + "." + std::to_string(index);
+}
+
+std::string DirectoryVersion(size_t users, uint64_t followers_version)
+{
+    return ListCursor(users) + "." + std::to_string(followers_version);
+}
+
+// Split a token into numbers after checking its epoch - false if it is
+// malformed or from another epoch
+bool ParseListToken(const std::string &token, std::vector<uint64_t> *numbers)
+{
+    if (token.compare(0, list_epoch.size() + 1, list_epoch + ".") != 0)
+    {
+        return false;
+    }
+    std::stringstream ss(token.substr(list_epoch.size() + 1));
+    std::string part;
+    while (std::getline(ss, part, '.'))
+    {
+        if (part.empty() || part.find_first_not_of("0123456789") != std::string::npos)
+        {
+            return false;
+        }
+        numbers->push_back(std::stoull(part));
+    }
+    return true;
+}
+
+bool ParseListCursor(const std::string &cursor, size_t *index)
+{
+    std::vector<uint64_t> numbers;
+    if (!ParseListToken(cursor, &numbers) || numbers.size() != 1 || numbers[0] > user_db.size())
+    {
+        return false;
+    }
+    *index = numbers[0];
+    return true;
+}
+
+bool ParseDirectoryVersion(const std::string &version, size_t *users, uint64_t *followers_version)
+{
+    std::vector<uint64_t> numbers;
+    if (!ParseListToken(version, &numbers) || numbers.size() != 2)
+    {
+        return false;
+    }
+    *users = numbers[0];
+    *followers_version = numbers[1];
+    return true;
+}
+
+// A Timeline stream ends on a post that could not be stored, or an INIT
+// for a user that is not here. If the user has moved, the client is told
+// how many of the stream's posts were dealt with - stored, or dropped for
+// going over the rate - so it can send the rest to the user's new cluster.
+void PostNotStored(ServerContext *context, User *user, const Status &status, uint64_t stored)
+{
+    if (status.error_code() == grpc::StatusCode::UNAVAILABLE)
+    {
+        glog(INFO, user->username + " has moved - ending its stream after " + std::to_string(stored) + " posts");
+        context->AddTrailingMetadata("stored-posts", std::to_string(stored));
+        return;
+    }
+    glog(ERROR, "Could not store post from " + user->username);
+}
+
+// A Timeline stream's posts have no reply of their own, so in sync mode
+// the ones the slave did not confirm are counted in a trailer
+void UnconfirmedPosts(ServerContext *context, uint64_t unconfirmed)
+{
+    if (unconfirmed > 0)
+    {
+        context->AddTrailingMetadata("unconfirmed-posts", std::to_string(unconfirmed));
+    }
+}
+
+// Entries per ExportUser batch
+const size_t export_batch = 256;
+
+class SNSServiceImpl final : public SNSService::Service
+{
+
+    Status List(ServerContext *context, const ListRequest *request, ListReply *list_reply) override
+    {
+        glog(INFO, "Serving List Request");
+        Status readable = CheckReadable(request->session_token());
+        if (!readable.ok())
+        {
+            return readable;
+        }
+        int user_index = find_user(request->username());
+        if (user_index < 0)
+        {
+            return Status(grpc::StatusCode::NOT_FOUND, "Unknown user");
+        }
+        User *user = user_db[user_index];
+        Status home = CheckHome(user);
+        if (!home.ok())
+        {
+            return home;
+        }
+
+        int64_t retry_ns;
+        if (!call_admission.Admit(&user->call_bucket, &retry_ns))
+        {
+            return RateLimited(context, retry_ns);
+        }
+
+        size_t users = user_db.size();
+        uint64_t followers_version = user->followers_version;
+        list_reply->set_directory_version(DirectoryVersion(users, followers_version));
+
+        // What the client already has, if it listed during this epoch
+        size_t known_users = 0;
+        uint64_t known_followers = 0;
+        bool known = ParseDirectoryVersion(request->known_version(), &known_users, &known_followers) &&
+                     known_users <= users;
+        if (known && request->cursor().empty() && known_users == users && known_followers == followers_version)
+        {
+            list_reply->set_not_modified(true);
+            return Status::OK;
+        }
+        list_reply->set_delta(known);
+
+        size_t start = known ? known_users : 0;
+        if (!request->cursor().empty() && !ParseListCursor(request->cursor(), &start))
+        {
+            return Status(grpc::StatusCode::ABORTED, "List cursor is from before a restart");
+        }
+
+        size_t page_size = request->page_size();
+        if (page_size == 0)
+        {
+            page_size = list_page_size;
+        }
+        page_size = std::min(page_size, max_list_page_size);
+
+        // Add a page of users
+        size_t end = std::min(users, start + page_size);
+        for (size_t i = start; i < end; i++)
+        {
+            list_reply->add_all_users(user_db[i]->username);
+        }
+        if (end < users)
+        {
+            list_reply->set_next_cursor(ListCursor(end));
+            return Status::OK;
+        }
+
+        // Last page - add self and the users that are followers of user
+        list_reply->add_followers(user->username);
+        std::lock_guard<std::mutex> lock(graph_mutex);
+        for (User *u : user->followers)
+        {
+            list_reply->add_followers(u->username);
+        }
+
+        return Status::OK;
+    }
+
+    Status Follow(ServerContext *context, const Request *request, Reply *reply) override
+    {
+        std::string username1 = request->username();
+        std::string username2 = request->arguments(0);
+        glog(INFO, "Serving Follow Request - " + username1 + " -> " + username2);
+
+        int follower_index = find_user(username1);
+        Status home = CheckHome(follower_index < 0 ? 0 : user_db[follower_index]);
+        if (!home.ok())
+        {
+            return home;
+        }
+        int64_t retry_ns;
+        if (!call_admission.Admit(follower_index < 0 ? 0 : &user_db[follower_index]->call_bucket, &retry_ns))
+        {
+            return RateLimited(context, retry_ns);
+        }
+
+        int64_t timestamp = time(NULL);
+        std::string msg;
+        bool followed = ApplyFollow(username1, username2, timestamp, &msg);
+        reply->set_msg(msg);
+        if (!followed)
+        {
+            glog(INFO, "Follow Request - " + reply->msg());
+            return Status::OK;
+        }
+
+        // Copy operation to slave
+        ReplicationEntry entry;
+        entry.set_op(ReplicationEntry::FOLLOW);
+        entry.set_username(username1);
+        entry.set_following(username2);
+        entry.set_timestamp(timestamp);
+        uint64_t log_index = LogChange(std::move(entry));
+        reply->set_session_token(SessionToken(log_index));
+
+        return WaitReplicated(log_index);
+    }
+
+    Status Login(ServerContext *context, const Request *request, Reply *reply) override
+    {
+        // Only the cluster's master takes clients - a client trying the
+        // slave in case it was promoted hears back at once if it was not
+        if (type != MASTER)
+        {
+            return Status(grpc::StatusCode::UNAVAILABLE, "Not the master");
+        }
+        std::string username = request->username();
+        ReplicationEntry entry;
+        entry.set_username(username);
+
+        // Catch SIGINT case - flip connected to false;
+        if (!request->arguments().empty())
+        {
+            glog(INFO, "Client SIGINT - " + request->username());
+            ApplyLogout(username);
+
+            // Copy to slave
+            entry.set_op(ReplicationEntry::LOGOUT);
+            WaitReplicated(LogChange(std::move(entry)));
+            return Status::CANCELLED;
+        }
+
+        glog(INFO, "Serving Login Request - " + request->username());
+        int user_index = find_user(username);
+        Status home = CheckHome(user_index < 0 ? 0 : user_db[user_index]);
+        if (!home.ok())
+        {
+            return home;
+        }
+        reply->set_msg(ApplyLogin(username));
+
+        // Copy operation to slave
+        entry.set_op(ReplicationEntry::LOGIN);
+        uint64_t log_index = LogChange(std::move(entry));
+        reply->set_session_token(SessionToken(log_index));
+
+        // Only session state - a login the slave did not confirm is logged
+        // and counted, but not failed, as the client would log in again
+        // and be told it already has
+        WaitReplicated(log_index);
+        glog(INFO, "Login Request - " + reply->msg());
+        return Status::OK;
+    }
+
+    Status Timeline(ServerContext *context, ServerReaderWriter<Message, Message> *stream) override
+    {
+        // ------------------------------------------------------------
+        // In this function, you are to write code that handles
+        // receiving a message/post from a user, recording it in a file
+        // and then making it available on his/her follower's streams
+        // ------------------------------------------------------------
+        glog(INFO, "Serving Timeline Request");
+        Message message_recv;
+        Message message_send;
+        std::string uname;
+        int user_index = -1;
+        User *user = 0;
+        bool init = true;
+        std::atomic<bool> done(false);
+        std::thread puller;
+        Status status = Status::OK;
+        int64_t retry_ns;
+        uint64_t log_index = 0;
+        uint64_t stored = 0;
+        uint64_t unconfirmed = 0; // sync mode - stored, but not confirmed by the slave
+
+        while (stream->Read(&message_recv))
+        {
+            // Admit posts before they are stored or replicated. A post over
+            // the rate is dropped and counted, and the stream stays open.
+            // It counts as dealt with, so it is not sent again after a move.
+            if (!init && !post_admission.Admit(user ? &user->post_bucket : 0, &retry_ns))
+            {
+                stored++;
+                continue;
+            }
+
+            // Check if inital setup
+            if (message_recv.msg() == "INIT" && init)
+            {
+
+                init = false;
+                uname = message_recv.username();
+                user_index = find_user(uname);
+                if (user_index < 0)
+                {
+                    status = Status(grpc::StatusCode::NOT_FOUND, "Unknown user");
+                    break;
+                }
+                user = user_db[user_index];
+                status = CheckHome(user);
+                if (!status.ok())
+                {
+                    PostNotStored(context, user, status, 0);
+                    break;
+                }
+
+                // Retrieve following messages - up to 20. The history goes
+                // out before followers' posts can be pushed to this stream.
+                std::lock_guard<std::mutex> lock(user->stream_mutex);
+                if (type == MASTER)
+                {
+                    for (const StoredPost &post : RecentPosts(user, message_recv))
+                    {
+                        ToMessage(post, &message_send);
+                        stream->Write(message_send);
+                    }
+
+                    // Pull posts from high-follower authors this user follows
+                    puller = std::thread([user, stream, &done]
+                    {
+                        OutboxCursors cursors;
+                        StartCursors(user, cursors);
+                        MessageList pulled;
+                        while (!done)
+                        {
+                            std::this_thread::sleep_for(std::chrono::milliseconds(pull_interval_ms));
+                            pulled.Clear();
+                            PullPosts(user, cursors, &pulled);
+                            // Followers' pushes write to this stream too
+                            std::lock_guard<std::mutex> lock(user->stream_mutex);
+                            for (Message &m : pulled)
+                            {
+                                stream->Write(m);
+                            }
+                        }
+                    });
+                }
+                user->stream = stream;
+            }
+
+            // Send post to followers - a post before INIT has no author to number it by
+            else if (user != 0)
+            {
+                // Create message - message_send keeps its buffers from the last post.
+                // StorePost stamps it.
+                message_send.set_username(uname);
+                message_send.set_msg(message_recv.msg());
+
+                // Store the post before anyone sees it - in sync mode the
+                // slave has it too before it goes out
+                status = StorePost(user, &message_send, &log_index);
+                if (!status.ok())
+                {
+                    PostNotStored(context, user, status, stored);
+                    break;
+                }
+                stored++;
+                if (!WaitReplicated(log_index).ok())
+                {
+                    unconfirmed++;
+                }
+
+                if (type == MASTER) {
+                    // send post to followers
+                    SendToFollowers(user, message_send);
+                }
+            }
+        }
+
+        // Nothing is pushed to this stream once the handler returns
+        if (user != 0)
+        {
+            std::lock_guard<std::mutex> lock(user->stream_mutex);
+            if (user->stream == stream)
+            {
+                user->stream = 0;
+            }
+        }
+
+        // Stop the puller
+        done = true;
+        if (puller.joinable())
+        {
+            puller.join();
+        }
+
+        UnconfirmedPosts(context, unconfirmed);
+        return status;
+    }
+
+    Status TimelineBatch(ServerContext *context, ServerReaderWriter<MessageBatch, Message> *stream) override
+    {
+        // ------------------------------------------------------------
+        // Same as Timeline, but posts for this user are queued and a
+        // writer thread sends everything pending as one MessageBatch
+        // ------------------------------------------------------------
+        glog(INFO, "Serving TimelineBatch Request");
+        Message message_recv;
+        Message message_send;
+        User *user = 0;
+        BatchEncoder encoder;
+        std::thread writer;
+        Status status = Status::OK;
+        int64_t retry_ns;
+        uint64_t log_index = 0;
+        uint64_t stored = 0;
+        uint64_t unconfirmed = 0; // sync mode - stored, but not confirmed by the slave
+
+        while (stream->Read(&message_recv))
+        {
+            // Admit posts before they are stored or replicated - as in
+            // Timeline, a post over the rate is only dropped
+            if (user != 0 && !post_admission.Admit(&user->post_bucket, &retry_ns))
+            {
+                stored++;
+                continue;
+            }
+
+            // Check if inital setup
+            if (message_recv.msg() == "INIT" && user == 0)
+            {
+                int user_index = find_user(message_recv.username());
+                if (user_index < 0)
+                {
+                    status = Status(grpc::StatusCode::NOT_FOUND, "Unknown user");
+                    break;
+                }
+                user = user_db[user_index];
+                status = CheckHome(user);
+                if (!status.ok())
+                {
+                    PostNotStored(context, user, status, 0);
+                    break;
+                }
+                if (type != MASTER)
+                {
+                    continue;
+                }
+
+                // Take the pending posts over from an older stream, whose
+                // writer then stops, before the history is read - a post
+                // stored meanwhile is in one or the other, and the writer
+                // drops what the history already had. Posts the old writer
+                // had not drained yet are kept.
+                {
+                    std::lock_guard<std::mutex> lock(user->pending_mutex);
+                    user->batch_stream = stream;
+                }
+                user->pending_cv.notify_all();
+                OutboxCursors cursors;
+                StartCursors(user, cursors);
+
+                // History goes out as a single frame, oldest first. The frame
+                // is built on an arena that starts in a stack block, so its
+                // posts are not allocated one by one - only long message
+                // text still goes to the heap.
+                char block[history_arena_block];
+                ArenaOptions options;
+                options.initial_block = block;
+                options.initial_block_size = sizeof(block);
+                Arena arena(options);
+                MessageBatch *history = Arena::CreateMessage<MessageBatch>(&arena);
+                std::vector<StoredPost> recent = RecentPosts(user, message_recv);
+                // Newest sequence the history has from each author
+                std::unordered_map<std::string, uint64_t> sent;
+                for (auto it = recent.rbegin(); it != recent.rend(); it++)
+                {
+                    encoder.Add(it->username, it->msg, it->timestamp * 1000000000LL + it->nanos, it->sequence, history);
+                    uint64_t &newest = sent[it->username];
+                    newest = std::max(newest, it->sequence);
+                }
+                if (history->posts_size() > 0)
+                {
+                    stream->Write(*history);
+                }
+
+                // Drain everything that piled up while the last write was in flight,
+                // plus anything new in the outboxes this user pulls from
+                writer = std::thread([user, stream, &encoder, cursors, sent]() mutable
+                {
+                    MessageList drained;
+                    MessageBatch batch;
+                    while (true)
+                    {
+                        {
+                            std::unique_lock<std::mutex> lock(user->pending_mutex);
+                            user->pending_cv.wait_for(lock, std::chrono::milliseconds(pull_interval_ms),
+                                                      [user, stream]
+                            {
+                                return user->batch_stream != stream || !user->pending.empty();
+                            });
+                            if (user->batch_stream != stream)
+                            {
+                                break;
+                            }
+                            drained.Swap(&user->pending);
+                        }
+
+                        PullPosts(user, cursors, &drained);
+                        if (drained.empty())
+                        {
+                            continue;
+                        }
+
+                        // drained and batch are reused, so the steady state allocates nothing
+                        batch.Clear();
+                        for (const Message &m : drained)
+                        {
+                            auto it = sent.find(m.username());
+                            if (it == sent.end() || m.sequence() > it->second)
+                            {
+                                encoder.Add(m, &batch);
+                            }
+                        }
+                        drained.Clear();
+                        if (batch.posts_size() == 0)
+                        {
+                            continue;
+                        }
+
+                        // A broken stream takes no more - let the posts stop
+                        // piling up for it
+                        if (!stream->Write(batch))
+                        {
+                            std::lock_guard<std::mutex> lock(user->pending_mutex);
+                            if (user->batch_stream == stream)
+                            {
+                                user->batch_stream = 0;
+                                user->pending.Clear();
+                            }
+                            break;
+                        }
+                    }
+                });
+            }
+
+            // Send post to followers
+            else if (user != 0)
+            {
+                // Create message - message_send keeps its buffers from the last post.
+                // StorePost stamps it.
+                message_send.set_username(user->username);
+                message_send.set_msg(message_recv.msg());
+
+                // Store the post before anyone sees it - in sync mode the
+                // slave has it too before it goes out
+                status = StorePost(user, &message_send, &log_index);
+                if (!status.ok())
+                {
+                    PostNotStored(context, user, status, stored);
+                    break;
+                }
+                stored++;
+                if (!WaitReplicated(log_index).ok())
+                {
+                    unconfirmed++;
+                }
+
+                if (type == MASTER) {
+                    SendToFollowers(user, message_send);
+                }
+            }
+        }
+
+        // Stop the writer
+        if (writer.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> lock(user->pending_mutex);
+                if (user->batch_stream == stream)
+                {
+                    user->batch_stream = 0;
+                    user->pending.Clear();
+                }
+            }
+            user->pending_cv.notify_all();
+            writer.join();
+        }
 
-    // Create data.json if it doesn't exist
-    else
-    {
-        CreateEmptyData();
+        UnconfirmedPosts(context, unconfirmed);
+        return status;
     }
-}
-
-class SNSServiceImpl final : public SNSService::Service
-{
 
-    Status List(ServerContext *context, const Request *request, ListReply *list_reply) override
+    Status GetTimelinePage(ServerContext *context, const TimelinePageRequest *request, TimelinePage *page) override
     {
-        glog(INFO, "Serving List Request");
-        User *user = user_db[find_user(request->username())];
+        glog(INFO, "Serving GetTimelinePage Request - " + request->username());
+        Status readable = CheckReadable(request->session_token());
+        if (!readable.ok())
+        {
+            return readable;
+        }
+        int index = find_user(request->username());
+        if (index < 0)
+        {
+            return Status(grpc::StatusCode::NOT_FOUND, "Unknown user");
+        }
+        Status home = CheckHome(user_db[index]);
+        if (!home.ok())
+        {
+            return home;
+        }
 
-        // Add all users in the db
-        for (User *c : user_db)
+        int64_t retry_ns;
+        if (!call_admission.Admit(&user_db[index]->call_bucket, &retry_ns))
         {
-            list_reply->add_all_users(c->username);
+            return RateLimited(context, retry_ns);
         }
 
-        // Add self to followers
-        list_reply->add_followers(user->username);
+        size_t limit = request->limit();
+        if (limit == 0)
+        {
+            limit = history_size;
+        }
+        limit = std::min(limit, max_page_size);
 
-        // Find users that are followers of user
-        for (User *u : user->followers)
+        PostCursor before;
+        if (request->has_cursor())
         {
-            list_reply->add_followers(u->username);
+            before.segment = request->cursor().segment();
+            before.timestamp = request->cursor().timestamp();
+            before.offset = request->cursor().offset();
+        }
+
+        PostCursor next;
+        std::vector<StoredPost> posts = storage->PostsBefore(TimelineAuthors(user_db[index]), before, limit, &next);
+        for (const StoredPost &post : posts)
+        {
+            ToMessage(post, page->add_posts());
         }
 
+        // A short page is the last one
+        if (posts.size() == limit)
+        {
+            PageCursor *cursor = page->mutable_next_cursor();
+            cursor->set_segment(next.segment);
+            cursor->set_timestamp(next.timestamp);
+            cursor->set_offset(next.offset);
+        }
         return Status::OK;
     }
 
-    Status Follow(ServerContext *context, const Request *request, Reply *reply) override
+    Status ExportUser(ServerContext *context, const ExportRequest *request, ServerWriter<ReplicationBatch> *writer) override
     {
-        std::string username1 = request->username();
-        std::string username2 = request->arguments(0);
-        glog(INFO, "Serving Follow Request - " + username1 + " -> " + username2);
-
-        // Copy operation to slave
-        if (type == MASTER) {
-            ClientContext ctx;
-            Request req;
-            req.set_username(username1);
-            req.add_arguments(username2);
-            Reply rep;
-            slave_stub_->Follow(&ctx, req, &rep);
+        // ------------------------------------------------------------
+        // Old master of a moving user - the user, its follow edges, and its
+        // timeline: its own posts and those of the users it follows since
+        // it followed them, oldest first. Posts at or before request->after
+        // were sent in an earlier round and are skipped. The users it
+        // follows are not sent - they live on their own clusters.
+        // ------------------------------------------------------------
+        if (type != MASTER)
+        {
+            return Status(grpc::StatusCode::FAILED_PRECONDITION, "Not a master");
         }
+        int index = find_user(request->username());
+        if (index < 0)
+        {
+            return Status(grpc::StatusCode::NOT_FOUND, "Unknown user");
+        }
+        User *user = user_db[index];
+        glog(INFO, "Serving ExportUser Request - " + user->username);
 
-
-        int join_index = find_user(username2);
-
-        // Prevent self follow or a user that isn't in the db
-        if (join_index < 0 || username1 == username2)
+        ReplicationBatch batch;
+        bool ok = true;
+        auto add = [&](const ReplicationEntry &entry)
         {
-            reply->set_msg("Follow Failed - Invalid Username");
+            *batch.add_entries() = entry;
+            if ((size_t)batch.entries_size() >= export_batch)
+            {
+                ok = ok && writer->Write(batch);
+                batch.Clear();
+            }
+        };
+
+        ReplicationEntry entry;
+        entry.set_op(ReplicationEntry::USER);
+        entry.set_username(user->username);
+        add(entry);
+        // Copied out, so the graph is not locked while the stream writes
+        std::vector<std::pair<std::string, int64_t>> follows;
+        {
+            std::lock_guard<std::mutex> lock(graph_mutex);
+            for (User *following : user->following)
+            {
+                follows.emplace_back(following->username, user->follow_time[following->username]);
+            }
         }
-        else
+        for (const auto &follow : follows)
         {
-            User *user1 = user_db[find_user(username1)];
-            User *user2 = user_db[join_index];
+            entry.Clear();
+            entry.set_op(ReplicationEntry::FOLLOW);
+            entry.set_username(user->username);
+            entry.set_following(follow.first);
+            entry.set_timestamp(follow.second);
+            add(entry);
+        }
 
-            if (std::find(user1->following.begin(), user1->following.end(), user2) != user1->following.end())
+        // Start each author at its last exported post, by time and then by
+        // sequence number
+        AuthorSince authors = TimelineAuthors(user);
+        std::unordered_map<std::string, uint64_t> after;
+        for (const csce438::ResumePoint &point : request->after())
+        {
+            auto it = authors.find(point.author());
+            if (it != authors.end())
             {
-                reply->set_msg("Follow Failed - Already Following User");
-                glog(INFO, "Follow Request - " + reply->msg());
-                return Status::OK;
+                it->second = std::max(it->second, point.timestamp());
+                after[point.author()] = point.sequence();
             }
+        }
 
-            user1->following.push_back(user2);
-            user2->followers.push_back(user1);
-            reply->set_msg("Follow Successful");
-
-            // Update json
-            FollowUserJSON(user1->username, user2->username);
+        // Streamed straight from storage, so at most one batch is held
+        if (ok)
+        {
+            storage->ScanPosts([&](const StoredPost &post)
+            {
+                auto author = authors.find(post.username);
+                if (author == authors.end() || post.timestamp < author->second)
+                {
+                    return true;
+                }
+                auto it = after.find(post.username);
+                if (it != after.end() && post.sequence <= it->second)
+                {
+                    return true;
+                }
+                entry.Clear();
+                entry.set_op(ReplicationEntry::POST);
+                entry.set_username(post.username);
+                ToMessage(post, entry.mutable_post());
+                add(entry);
+                return ok;
+            });
         }
 
-        // log(INFO, "Follow Request - " + reply->msg());
-        return Status::OK;
+        if (ok && batch.entries_size() > 0)
+        {
+            ok = writer->Write(batch);
+        }
+        return ok ? Status::OK : Status(grpc::StatusCode::CANCELLED, "Export stream closed");
     }
 
-    Status Login(ServerContext *context, const Request *request, Reply *reply) override
+    Status ImportUser(ServerContext *context, ServerReader<ReplicationBatch> *reader, Reply *reply) override
     {
-        User *c;
-        std::string username = request->username();
+        // ------------------------------------------------------------
+        // New master of a moving user - apply what ExportUser sent, and
+        // pass it on to this master's slave. Entries already here are
+        // skipped, so a round can overlap the last, and so are follows and
+        // posts of users this cluster does not know.
+        // ------------------------------------------------------------
+        if (type != MASTER)
+        {
+            return Status(grpc::StatusCode::FAILED_PRECONDITION, "Not a master");
+        }
+        glog(INFO, "Serving ImportUser Request");
 
-        // Catch SIGINT case - flip connected to false;
-        if (!request->arguments().empty())
+        ReplicationBatch batch;
+        size_t imported = 0;
+        size_t skipped = 0;
+        uint64_t log_index = 0;
+        while (reader->Read(&batch))
         {
-            glog(INFO, "Client SIGINT - " + request->username());
-            // Copy to slave
-            if (type == MASTER) {
-                ClientContext ctx;
-                Request req;
-                req.set_username(username);
-                req.add_arguments("SIGINT");
-                Reply rep;
-
-                slave_stub_->Login(&ctx, req, &rep);
+            for (ReplicationEntry &entry : *batch.mutable_entries())
+            {
+                if ((entry.op() == ReplicationEntry::FOLLOW && find_user(entry.following()) < 0) ||
+                    (entry.op() == ReplicationEntry::POST && find_user(entry.post().username()) < 0))
+                {
+                    skipped++;
+                    continue;
+                }
+                if (!ApplyEntry(entry))
+                {
+                    return Status(grpc::StatusCode::INTERNAL, "Entry could not be stored");
+                }
+                log_index = LogChange(std::move(entry));
+                imported++;
             }
-
-            user_db[find_user(username)]->connected = false;
-            return Status::CANCELLED;
         }
-
-        glog(INFO, "Serving Login Request - " + request->username());
-
-        // Copy operation to slave
-        if (type == MASTER) {
-            ClientContext ctx;
-            Request req;
-            req.set_username(username);
-            Reply rep;
-            slave_stub_->Login(&ctx, req, &rep);
+        if (skipped > 0)
+        {
+            glog(WARNING, "ImportUser skipped " + std::to_string(skipped) + " entries for users not on this cluster");
         }
+        reply->set_msg("Imported " + std::to_string(imported) + " entries");
+        return WaitReplicated(log_index);
+    }
 
-        int user_index = find_user(username);
-        if (user_index < 0)
+    Status SetUserMoved(ServerContext *context, const UserMove *request, Reply *reply) override
+    {
+        int index = find_user(request->username());
+        if (index < 0)
         {
-            c = new User;
-            c->username = username;
-            user_db.push_back(c);
-            reply->set_msg("Login Successful!");
-
-            // Update json
-            CreateUserJSON(username);
+            return Status(grpc::StatusCode::NOT_FOUND, "Unknown user");
         }
-        else
-        {
-            User *user = user_db[user_index];
+        User *user = user_db[index];
 
-            if (user->connected)
-                reply->set_msg("You have already logged in!");
-            else
-            {
-                std::string msg = "Welcome Back " + user->username;
-                reply->set_msg(msg);
-                user->connected = true;
-            }
-        }
-        glog(INFO, "Login Request - " + reply->msg());
+        // Under post_mutex, so no post is stored after this returns
+        std::lock_guard<std::mutex> lock(user->post_mutex);
+        user->moved = request->moved();
+        glog(INFO, user->username + (request->moved() ? " has moved to another cluster" : " is back on this cluster"));
+        reply->set_msg(request->moved() ? "Moved" : "Not moved");
         return Status::OK;
     }
 
-    Status Timeline(ServerContext *context, ServerReaderWriter<Message, Message> *stream) override
+    Status Replicate(ServerContext *context, ServerReaderWriter<ReplicationAck, ReplicationBatch> *stream) override
     {
         // ------------------------------------------------------------
-        // In this function, you are to write code that handles
-        // receiving a message/post from a user, recording it in a file
-        // and then making it available on his/her follower's streams
+        // Slave side of replication.h - say where this slave is, then
+        // apply a snapshot if the master sends one and the log after it,
+        // acking how far it got after every log batch
         // ------------------------------------------------------------
-        glog(INFO, "Serving Timeline Request");
-        ClientContext ctx;
-        std::shared_ptr<ClientReaderWriter<Message, Message>> slave_stream;
-        
-        // Copy operation to slave
-        if (type == MASTER) {
-            glog(INFO, "Setting up slave_stream";)
-            slave_stream = std::shared_ptr<ClientReaderWriter<Message, Message>>(slave_stub_->Timeline(&ctx));
+        if (type == MASTER)
+        {
+            return Status(grpc::StatusCode::FAILED_PRECONDITION, "Not a slave");
         }
+        glog(INFO, "Serving Replicate Request");
 
-        Message message_recv;
-        Message message_send;
-        std::string uname;
-        int user_index = -1;
-        bool init = true;
-
-        while (stream->Read(&message_recv))
+        ReplicationAck ack;
+        {
+            std::lock_guard<std::mutex> lock(replica_mutex);
+            ack.set_epoch(replica_epoch);
+            ack.set_applied(replica_applied);
+        }
+        if (!stream->Write(ack))
         {
-            User *user;
+            return Status::OK;
+        }
 
-            // Copy to slave
-            if (type == MASTER) {
-                glog(INFO, "Copying to slave";)
-                slave_stream->Write(message_recv);
+        ReplicationBatch batch;
+        bool in_snapshot = false;
+        size_t snapshot_entries = 0;
+        auto snapshot_start = std::chrono::steady_clock::now();
+        while (stream->Read(&batch))
+        {
+            std::lock_guard<std::mutex> lock(replica_mutex);
+            if (type == MASTER)
+            {
+                return Status(grpc::StatusCode::FAILED_PRECONDITION, "Promoted to master");
             }
-
-            // Check if inital setup
-            if (message_recv.msg() == "INIT" && init)
+            if (batch.snapshot())
             {
-
-                init = false;
-                uname = message_recv.username();
-                user_index = find_user(uname);
-                user = user_db[user_index];
-
-                if (user->stream == 0)
+                if (!in_snapshot)
                 {
-                    user->stream = stream;
+                    glog(INFO, "Receiving a snapshot from the master - not ready until it is applied");
+                    in_snapshot = true;
+                    replica_ready = false;
+                    snapshot_entries = 0;
+                    snapshot_start = std::chrono::steady_clock::now();
                 }
-
-                // Retrieve following messages - up to 20
-                int count = 0;
-
-                // Load json
-                std::ifstream ffile(follow_location);
-                std::ifstream tfile(timeline_location);
-                json follow_json = json::parse(ffile);
-                json time_json = json::parse(tfile);
-                ffile.close();
-                tfile.close();
-
-                // Get the recent 20 messages
-                json posts = time_json["posts"];
-                for (auto it = posts.rbegin(); it != posts.rend(); it++)
+                for (const ReplicationEntry &entry : batch.entries())
                 {
-                    if (count >= 20)
+                    if (!ApplyEntry(entry))
                     {
-                        break;
+                        glog(ERROR, "Could not apply snapshot entry");
+                        return Status(grpc::StatusCode::INTERNAL, "Entry could not be stored");
                     }
+                }
+                snapshot_entries += batch.entries_size();
+                if (batch.snapshot_index() == 0)
+                {
+                    continue;
+                }
 
-                    std::string message_username = (*it)["username"];
-                    if (uname != message_username)
-                    {   
-                        
-                        // Check if username is followed
-                        if (find_following(user, message_username) < 0)
-                        {
-                            continue;
-                        }
-
-                        // Check if message is after follow age
-                        int64_t follow_age = follow_json["users"][uname]["following"][message_username]["timestamp"];
-                        int64_t message_seconds = (*it)["timestamp"];
-                        if (follow_age > message_seconds)
-                        {
-                            continue;
-                        }
+                // Done - the log carries on from the snapshot's index
+                in_snapshot = false;
+                replica_epoch = batch.epoch();
+                replica_applied = batch.snapshot_index();
+                auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now() - snapshot_start).count();
+                glog(INFO, "Snapshot applied - " + std::to_string(snapshot_entries) + " entries in " +
+                               std::to_string(ms) + "ms, log continues after " + std::to_string(replica_applied));
+            }
+            else
+            {
+                if (batch.epoch() != replica_epoch)
+                {
+                    return Status(grpc::StatusCode::FAILED_PRECONDITION, "Log from another master epoch");
+                }
+                for (const ReplicationEntry &entry : batch.entries())
+                {
+                    if (entry.index() <= replica_applied)
+                    {
+                        continue;
                     }
-
-                    // Create message
-                    message_send.set_username((*it)["username"]);
-                    message_send.set_msg((*it)["message"]);
-                    Timestamp *timestamp = new Timestamp();
-                    timestamp->set_seconds((*it)["timestamp"]);
-                    timestamp->set_nanos(0);
-                    message_send.set_allocated_timestamp(timestamp);
-
-                    // Send to client
-                    if (type == MASTER) {
-                        stream->Write(message_send);
+                    if (entry.index() > replica_applied + 1)
+                    {
+                        return Status(grpc::StatusCode::FAILED_PRECONDITION, "Log has a gap");
+                    }
+                    if (!ApplyEntry(entry))
+                    {
+                        glog(ERROR, "Could not apply replicated entry " + std::to_string(entry.index()));
+                        return Status(grpc::StatusCode::INTERNAL, "Entry could not be stored");
                     }
-                    count++;
+                    replica_applied = entry.index();
                 }
             }
 
-            // Send post to followers
-            else
+            if (replica_applied >= batch.appended())
             {
-                std::string str = message_recv.msg();
-
-                // Create message
-                message_send.set_username(uname);
-                message_send.set_msg(str);
-                Timestamp *timestamp = new Timestamp();
-                timestamp->set_seconds(time(NULL));
-                timestamp->set_nanos(0);
-                message_send.set_allocated_timestamp(timestamp);
-
-                if (type == MASTER) {
-                    // send post to followers
-                    for (User *u : user->followers)
-                    {
-                        if (u->stream != 0)
-                        {
-                            u->stream->Write(message_send);
-                        }
-                    }
+                replica_current_ns = std::chrono::steady_clock::now().time_since_epoch().count();
+                if (!replica_ready)
+                {
+                    glog(INFO, "Caught up with the master at " + std::to_string(replica_applied) + " - ready");
+                    replica_ready = true;
                 }
+            }
 
-                // Update JSON
-                TimelineJSON(message_send, timestamp);
+            ack.set_epoch(replica_epoch);
+            ack.set_applied(replica_applied);
+            if (!stream->Write(ack))
+            {
+                break;
             }
         }
-
         return Status::OK;
     }
 };
 
-void heartbeat_thread(int id, ServerType type, std::string ip, std::string port)
+// Master - ship the replication log to whichever slave table has for this
+// cluster, starting the log the first time there is one. A slave that is
+// replaced, or a new one after a failover, is picked up with the next table.
+void FollowSlave(const RoutingCache::Table &table)
+{
+    RoutingCache::Route slave;
+    std::lock_guard<std::mutex> lock(slave_mutex);
+    if (type != MASTER || fenced || !table.Find(std::stoi(id), SLAVE, &slave) || slave.Address() == slave_info)
+    {
+        return;
+    }
+    slave_stubs_.push_back(SNSService::NewStub(grpc::CreateChannel(slave.Address(), grpc::InsecureChannelCredentials())));
+    if (replicating)
+    {
+        replication->Retarget(slave_stubs_.back().get());
+        glog(INFO, "Slave moved from " + slave_info + " to " + slave.Address() + " - replicating there");
+    }
+    else
+    {
+        replication->Start(slave_stubs_.back().get(), SnapshotState, snapshot_rate_mb * 1000000);
+        replicating = true;
+        glog(INFO, "Replicating to " + slave.Address() + " (" + replication_mode + ")");
+    }
+    slave_info = slave.Address();
+}
+
+// Slave - the coordinator made this server its cluster's master, after the
+// old one stopped sending heartbeats. Changes the old master had not
+// replicated yet are lost.
+void Promote(uint64_t epoch)
 {
+    // Not in the middle of a replicated batch
+    std::lock_guard<std::mutex> lock(replica_mutex);
+    if (type == MASTER)
+    {
+        return;
+    }
+    type = MASTER;
+    glog(WARNING, "Promoted to master in epoch " + std::to_string(epoch) + " - have the old master's log up to " +
+                      std::to_string(replica_applied) + (replica_ready ? "" : ", but was still catching up"));
+    // In case the table already shows a slave to replicate to
+    FollowSlave(*routes->Current());
+}
 
-    // Create the stream
-    ClientContext ctx;
-    std::shared_ptr<ClientReaderWriter<Heartbeat, Heartbeat>> stream(coord_stub_->HandleHeartBeats(&ctx));
+// Master - the coordinator promoted the slave while this server was
+// unreachable. Serving on would split the cluster in two.
+void Fence(uint64_t epoch)
+{
+    if (fenced.exchange(true))
+    {
+        return;
+    }
+    glog(ERROR, "Replaced by the slave in epoch " + std::to_string(epoch) +
+                    " - refusing all requests, restart this server as a slave");
+    std::lock_guard<std::mutex> lock(slave_mutex);
+    replication->Stop();
+}
 
-    while (true)
+// The coordinator's answer to a heartbeat
+void ApplyRole(const Heartbeat &answer)
+{
+    if (answer.server_type() == MASTER && type == SLAVE)
     {
-        // Create heartbeat
-        glog(INFO, "Sending heartbeat");
+        Promote(answer.epoch());
+    }
+    else if (answer.server_type() == SLAVE && type == MASTER && answer.epoch() >= cluster_epoch)
+    {
+        Fence(answer.epoch());
+    }
+    if (answer.epoch() > cluster_epoch)
+    {
+        cluster_epoch = answer.epoch();
+    }
+}
 
-        Heartbeat beat;
-        beat.set_server_id(id);
-        beat.set_server_type(type);
-        beat.set_server_ip(ip);
-        beat.set_server_port(port);
-        Timestamp *timestamp = new Timestamp();
-        timestamp->set_seconds(time(NULL));
-        timestamp->set_nanos(0);
-        beat.set_allocated_timestamp(timestamp);
+void heartbeat_thread(int id, std::string ip, std::string port)
+{
+    // One stream at a time, reopened if the coordinator goes away
+    while (!fenced)
+    {
+        ClientContext ctx;
+        std::shared_ptr<ClientReaderWriter<Heartbeat, Heartbeat>> stream(coord_stub_->HandleHeartBeats(&ctx));
+        std::thread answers([stream]
+        {
+            Heartbeat answer;
+            while (stream->Read(&answer))
+            {
+                ApplyRole(answer);
+            }
+        });
 
-        // Send to coordinator
-        stream->Write(beat);
+        while (!fenced)
+        {
+            // Create heartbeat
+            glog(INFO, "Sending heartbeat");
+
+            Heartbeat beat;
+            beat.set_server_id(id);
+            beat.set_server_type(type);
+            beat.set_server_ip(ip);
+            beat.set_server_port(port);
+            beat.set_ready(type == MASTER || replica_ready);
+            beat.set_epoch(cluster_epoch);
+            beat.set_interval_ms(heartbeat_interval_ms);
+            beat.mutable_timestamp()->set_seconds(time(NULL));
+
+            // Send to coordinator
+            if (!stream->Write(beat))
+            {
+                glog(ERROR, "Lost the coordinator - reconnecting");
+                break;
+            }
 
-        // Sleep for 10 seconds
-        std::this_thread::sleep_for(std::chrono::seconds(10));
+            std::this_thread::sleep_for(std::chrono::milliseconds(heartbeat_interval_ms));
+        }
+        ctx.TryCancel();
+        answers.join();
+        stream->Finish();
+        std::this_thread::sleep_for(std::chrono::milliseconds(heartbeat_interval_ms));
     }
 }
 
 void update_thread() {
-    // Initialize last_update
-    struct stat ffile_stat;
-    time_t previous_follow_mtime = 0;
-
-    if (stat(follow_location.c_str(), &ffile_stat) != 0) {
-        glog(ERROR, "Stat for follow file failed");
-        return;
+    FileWatch watch(follow_location);
+    if (!watch.watching()) {
+        glog(ERROR, "Could not watch the follow file - checking it every " + std::to_string(update_time) + "s");
     }
-    previous_follow_mtime = ffile_stat.st_mtime;
 
     while (true) {
-        // Sleep
-        std::this_thread::sleep_for(std::chrono::seconds(update_time));
-        glog(INFO, "Checking for updates...");
-
-        // Check if follow file was updated
-        if (stat(follow_location.c_str(), &ffile_stat) != 0) {
-            glog(ERROR, "Stat for follow file failed");
-            return;
+        bool changed = watch.Wait(update_time * 1000);
+
+        // Only what was added since the last check is read, when the
+        // storage allows it - the periodic check then costs one stat.
+        // Either way this server's own follows, already in user_db, are
+        // not read back.
+        if (LoadFollowChanges()) {
+            continue;
         }
-        if (previous_follow_mtime != ffile_stat.st_mtime) {
+        if (changed && storage->GraphChangedElsewhere()) {
             // Reload follow data
             glog(INFO, "Follow file change detected - loading data");
+            graph_position = storage->GraphPosition();
             LoadFollowData();
-            previous_follow_mtime = ffile_stat.st_mtime;
         }
     }
+}
+
+void commit_stats_thread()
+{
+    while (true)
+    {
+        std::this_thread::sleep_for(std::chrono::seconds(commit_stats_interval));
+        glog(INFO, "Group commit: " + storage->CommitStats());
+    }
+}
+
+void admission_stats_thread()
+{
+    while (true)
+    {
+        std::this_thread::sleep_for(std::chrono::seconds(admission_stats_interval));
+        glog(INFO, "Admission: posts " + post_admission.ToString() + ", calls " + call_admission.ToString());
+    }
+}
 
+void replication_stats_thread()
+{
+    while (true)
+    {
+        std::this_thread::sleep_for(std::chrono::seconds(replication_stats_interval));
+        if (replicating)
+        {
+            glog(INFO, "Replication: " + replication->ToString());
+        }
+    }
 }
 
 void RunServer(std::string port_no)
@@ -648,6 +2273,12 @@ void RunServer(std::string port_no)
     ServerBuilder builder;
     builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
     builder.RegisterService(&service);
+    builder.AddChannelArgument(GRPC_ARG_KEEPALIVE_PERMIT_WITHOUT_CALLS, 1);
+    builder.AddChannelArgument(GRPC_ARG_HTTP2_MIN_RECV_PING_INTERVAL_WITHOUT_DATA_MS, min_client_ping_ms);
+    builder.AddChannelArgument(GRPC_ARG_HTTP2_MAX_PING_STRIKES, 0);
+    builder.AddChannelArgument(GRPC_ARG_KEEPALIVE_TIME_MS, client_keepalive_ms);
+    builder.AddChannelArgument(GRPC_ARG_KEEPALIVE_TIMEOUT_MS, client_keepalive_ms);
+    builder.AddChannelArgument(GRPC_ARG_HTTP2_MAX_PINGS_WITHOUT_DATA, 0);
     std::unique_ptr<Server> server(builder.BuildAndStart());
     std::cout << "Server listening on " << server_address << std::endl;
     glog(INFO, "Server listening on " + server_address);
@@ -664,7 +2295,7 @@ int main(int argc, char **argv)
     std::string t = "-1";
 
     int opt = 0;
-    while ((opt = getopt(argc, argv, "c:o:p:i:t:")) != -1)
+    while ((opt = getopt(argc, argv, "c:o:p:i:t:f:s:d:b:r:R:q:Q:m:S:L:H:")) != -1)
     {
         switch (opt)
         {
@@ -683,6 +2314,42 @@ int main(int argc, char **argv)
         case 't':
             t = optarg;
             break;
+        case 'f':
+            fanout_threshold = std::stoi(optarg);
+            break;
+        case 's':
+            storage_kind = optarg;
+            break;
+        case 'd':
+            commit_latency_us = std::stoi(optarg);
+            break;
+        case 'b':
+            commit_batch = std::stoi(optarg);
+            break;
+        case 'r':
+            user_post_rate = std::stod(optarg);
+            break;
+        case 'R':
+            global_post_rate = std::stod(optarg);
+            break;
+        case 'q':
+            user_call_rate = std::stod(optarg);
+            break;
+        case 'Q':
+            global_call_rate = std::stod(optarg);
+            break;
+        case 'm':
+            replication_mode = optarg;
+            break;
+        case 'S':
+            snapshot_rate_mb = std::stod(optarg);
+            break;
+        case 'L':
+            max_read_lag_ms = std::stoi(optarg);
+            break;
+        case 'H':
+            heartbeat_interval_ms = std::stoi(optarg);
+            break;
         default:
             std::cerr << "Invalid Command Line Argument\n";
         }
@@ -702,8 +2369,14 @@ int main(int argc, char **argv)
         std::cout << "Please enter a valid type! (-t)";
         return -1;
     }
+    if (replication_mode != "async" && replication_mode != "sync")
+    {
+        std::cout << "Please enter a valid replication mode! (-m async|sync)";
+        return -1;
+    }
 
     std::string log_file_name = t + id + "-" + port;
+    list_epoch = std::to_string(time(NULL)) + "-" + std::to_string(getpid());
 
     // log to the terminal
     FLAGS_alsologtostderr = 1;
@@ -729,36 +2402,62 @@ int main(int argc, char **argv)
     std::string folder_name = t + "_" +  id;
     mkdir(folder_name.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
 
-    follow_location = folder_name + "/" + follow_location;
-    timeline_location = folder_name + "/" + timeline_location;
-    LoadFollowData();
+    storage.reset(MakeStorage(storage_kind, folder_name, follow_location, timeline_location));
+    if (!storage)
+    {
+        std::cout << "Please enter a valid storage type! (-s json|binary)";
+        return -1;
+    }
+    if (!storage->Init())
+    {
+        glog(ERROR, "Could not open storage in " + folder_name);
+        return -1;
+    }
+    if (commit_latency_us >= 0)
+    {
+        if (commit_batch <= 0 || !storage->EnableGroupCommit(commit_batch, commit_latency_us))
+        {
+            std::cout << "Group commit (-d) needs binary storage and a positive batch size (-b)";
+            return -1;
+        }
+        glog(INFO, "Group commit on: " + std::to_string(commit_batch) + " posts or " +
+                       std::to_string(commit_latency_us) + "us per batch");
+        std::thread(commit_stats_thread).detach();
+    }
+    follow_location = storage->GraphPath();
+    // Changes made while loading are applied again by update_thread
+    graph_position = storage->GraphPosition();
+    BulkLoadFollowData();
+
+    // On slaves too - one promoted on failover takes the writes with the
+    // same limits, and until then they limit the reads they serve
+    post_admission.Configure(user_post_rate, global_post_rate, burst_seconds);
+    call_admission.Configure(user_call_rate, global_call_rate, burst_seconds);
+    if (post_admission.enabled() || call_admission.enabled())
+    {
+        glog(INFO, "Admission control on: posts/s " + std::to_string(user_post_rate) + " per user, " +
+                       std::to_string(global_post_rate) + " total; calls/s " + std::to_string(user_call_rate) +
+                       " per user, " + std::to_string(global_call_rate) + " total (0 = no limit)");
+        std::thread(admission_stats_thread).detach();
+    }
+
 
+    // Ship changes to the slave once there is one, and this server is the
+    // master - indexes restart with this epoch
+    uint64_t epoch = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    replication.reset(new ReplicationLog(epoch));
+    std::thread(replication_stats_thread).detach();
+    routes.reset(new RoutingCache(coord_stub_.get()));
+    routes->Start(FollowSlave);
 
     // Start heartbeat thread
-    std::thread hb(heartbeat_thread, std::stoi(id), type, "0.0.0.0", port);
+    std::thread hb(heartbeat_thread, std::stoi(id), "0.0.0.0", port);
 
     // Start update thread
     std::thread update(update_thread);
 
 
-    // Get the slave server
-    if (type == MASTER) {
-        ClientContext ctx;
-        snsCoordinator::Server s;
-        snsCoordinator::ClusterID cid;
-        cid.set_cluster(std::stoi(id));
-        Status status = coord_stub_->GetSlave(&ctx, cid, &s);
-
-        if (!status.ok()) {
-            glog(ERROR, "GetSlave failed");
-            return 0;
-        }
-
-        slave_info = s.server_ip() + ":" + s.port_num();
-        // glog(INFO, "Slave info: " + slave_info);
-        slave_stub_ = std::unique_ptr<SNSService::Stub>(SNSService::NewStub(grpc::CreateChannel(slave_info, grpc::InsecureChannelCredentials())));
-    }
-
     // Start the server
     RunServer(port);
     hb.join();
@@ -0,0 +1,327 @@
+#ifndef SERVER_REGISTRY_H
+#define SERVER_REGISTRY_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include "coordinator.pb.h"
+#include "phi_detector.h"
+
+/*
+ * The coordinator's table of masters, slaves and followsyncs, keyed by
+ * cluster id and server type.
+ *
+ * Heartbeats update the table under a mutex. Lookups never take it: every
+ * change a lookup could see - a server joining, or a slave becoming ready
+ * or falling behind - publishes a new immutable snapshot of the routes, and
+ * readers load the current one atomically and keep it as long as they need
+ * it. Most heartbeats only move a server's timestamp, which routing does not
+ * use, so they do not publish.
+ *
+ * Masters and slaves are suspected once the phi-accrual detector over their
+ * heartbeats crosses phi_threshold, or after max_silence_ms without one.
+ * A master that stops sending heartbeats is replaced by its cluster's slave,
+ * if that has caught up, and the cluster's promotion epoch goes up. Servers
+ * are told their role and the epoch whenever the one they report is out of
+ * date, so a slave finds out it was promoted, and an old master that comes
+ * back finds out it has been replaced and stops serving.
+ */
+
+struct server_t
+{
+    int server_id;
+    std::string ip;
+    std::string port;
+    snsCoordinator::ServerType type;
+    google::protobuf::Timestamp timestamp;
+    bool active = true;
+    // Slaves: caught up with their master's log
+    bool ready = false;
+    // steady_clock time of the last heartbeat
+    int64_t last_beat_ns = 0;
+    // Promoted masters: when the master they replaced last sent a
+    // heartbeat, until they first send one as master
+    int64_t failover_start_ns = 0;
+};
+
+class ServerRegistry
+{
+    public:
+        typedef std::pair<int, snsCoordinator::ServerType> Key;
+        typedef std::map<Key, server_t> Routes;
+
+        enum Change
+        {
+            UNCHANGED,
+            ADDED,
+            READY_CHANGED,
+            // A promoted slave's first heartbeat as master
+            PROMOTION_DONE,
+            // A promoted slave that has not heard yet, or a replaced master
+            WRONG_ROLE
+        };
+
+        enum Expiry
+        {
+            NOT_DUE,
+            REMOVED,
+            PROMOTED
+        };
+
+        // What Update found, and what to tell the server if answer is set
+        struct Verdict
+        {
+            Change change = UNCHANGED;
+            bool answer = false;
+            snsCoordinator::Heartbeat reply;
+            // PROMOTION_DONE: from the old master's last heartbeat on
+            int64_t failover_ns = 0;
+            // Masters and slaves: when to check on the server next
+            int64_t check_ms = 0;
+            // The entry the heartbeat kept alive, if counted. A promoted
+            // slave's beats count for its cluster's master before it hears;
+            // a replaced master's count for nothing.
+            bool counted = false;
+            Key key;
+        };
+
+        struct Expired
+        {
+            Expiry expiry = NOT_DUE;
+            // The server dropped, and the slave that replaced it
+            server_t server;
+            server_t promoted;
+            double phi = 0;
+            double mean_ms = 0;
+            // NOT_DUE: when to check again, 0 if the server is gone
+            int64_t check_ms = 0;
+        };
+
+        ServerRegistry() : routes_(std::make_shared<const Routes>()) {}
+
+        // Detector settings, before the first heartbeat
+        void Configure(double phi_threshold, int64_t max_silence_ms, double min_std_ms, double pause_ms)
+        {
+            phi_threshold_ = phi_threshold;
+            max_silence_ms_ = max_silence_ms;
+            min_std_ms_ = min_std_ms;
+            pause_ms_ = pause_ms;
+        }
+
+        // Record a heartbeat received at now_ns, adding the server if it is
+        // new or replaces the one registered
+        Verdict Update(const snsCoordinator::Heartbeat &beat, int64_t now_ns)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            int cluster = beat.server_id();
+            snsCoordinator::ServerType type = beat.server_type();
+            Verdict verdict;
+            verdict.reply.set_server_id(cluster);
+            verdict.reply.set_server_type(type);
+            verdict.reply.set_epoch(epochs_[cluster]);
+            verdict.answer = type != snsCoordinator::SYNC && beat.epoch() != epochs_[cluster];
+
+            // Only one master a cluster - the registered one
+            Key master_key(cluster, snsCoordinator::MASTER);
+            auto master = servers_.find(master_key);
+            if (type != snsCoordinator::SYNC && master != servers_.end() &&
+                (type == snsCoordinator::MASTER) != Same(master->second, beat))
+            {
+                verdict.change = WRONG_ROLE;
+                verdict.answer = true;
+                verdict.reply.set_server_type(type == snsCoordinator::MASTER ? snsCoordinator::SLAVE
+                                                                            : snsCoordinator::MASTER);
+                // The promoted slave is the master now, and is alive
+                if (type != snsCoordinator::MASTER)
+                {
+                    master->second.timestamp = beat.timestamp();
+                    master->second.last_beat_ns = now_ns;
+                    detectors_[master_key].Heartbeat(now_ns, beat.interval_ms());
+                    verdict.check_ms = CheckInMs(master_key, now_ns);
+                    verdict.counted = true;
+                    verdict.key = master_key;
+                }
+                return verdict;
+            }
+
+            Key key(cluster, type);
+            verdict.counted = true;
+            verdict.key = key;
+            auto it = servers_.find(key);
+            if (it == servers_.end() || !Same(it->second, beat))
+            {
+                server_t s;
+                s.server_id = cluster;
+                s.ip = beat.server_ip();
+                s.port = beat.server_port();
+                s.type = type;
+                s.timestamp = beat.timestamp();
+                s.ready = beat.ready();
+                s.last_beat_ns = now_ns;
+                servers_[key] = s;
+                Publish();
+                verdict.change = ADDED;
+                if (type != snsCoordinator::SYNC)
+                {
+                    detectors_[key] = PhiDetector(phi_window, min_std_ms_, pause_ms_);
+                    detectors_[key].Heartbeat(now_ns, beat.interval_ms());
+                    verdict.check_ms = CheckInMs(key, now_ns);
+                }
+                return verdict;
+            }
+
+            server_t &s = it->second;
+            s.timestamp = beat.timestamp();
+            s.last_beat_ns = now_ns;
+            if (type != snsCoordinator::SYNC)
+            {
+                detectors_[key].Heartbeat(now_ns, beat.interval_ms());
+                verdict.check_ms = CheckInMs(key, now_ns);
+            }
+            if (type == snsCoordinator::MASTER && s.failover_start_ns != 0)
+            {
+                verdict.change = PROMOTION_DONE;
+                verdict.failover_ns = now_ns - s.failover_start_ns;
+                s.failover_start_ns = 0;
+            }
+            if (type == snsCoordinator::SLAVE && s.ready != beat.ready())
+            {
+                s.ready = beat.ready();
+                Publish();
+                verdict.change = READY_CHANGED;
+            }
+            return verdict;
+        }
+
+        // Drop the server at key if it is suspected. closed, if set, is the
+        // last heartbeat of a stream that has ended: its server is dropped at
+        // once, but only while it is still the one at key - a slave may have
+        // been promoted into its place since. A master is replaced by its
+        // cluster's slave if that is ready.
+        Expired Expire(const Key &key, int64_t now_ns, const snsCoordinator::Heartbeat *closed)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            Expired expired;
+            auto it = servers_.find(key);
+            if (it == servers_.end())
+            {
+                return expired;
+            }
+            PhiDetector &detector = detectors_[key];
+            expired.phi = detector.Phi(now_ns);
+            expired.mean_ms = detector.Mean();
+            bool force = closed != nullptr && Same(it->second, *closed);
+            if (!force && expired.phi < phi_threshold_ &&
+                now_ns - it->second.last_beat_ns < max_silence_ms_ * 1000000)
+            {
+                expired.check_ms = CheckInMs(key, now_ns);
+                return expired;
+            }
+            expired.server = it->second;
+
+            auto slave = servers_.find(Key(key.first, snsCoordinator::SLAVE));
+            if (key.second == snsCoordinator::MASTER && slave != servers_.end() && slave->second.ready)
+            {
+                server_t master = slave->second;
+                master.type = snsCoordinator::MASTER;
+                master.ready = false;
+                master.failover_start_ns = it->second.last_beat_ns;
+                master.last_beat_ns = now_ns;
+                it->second = master;
+                // Same server, same heartbeats
+                detector = detectors_[slave->first];
+                detectors_.erase(slave->first);
+                servers_.erase(slave);
+                epochs_[key.first]++;
+                Publish();
+                expired.promoted = master;
+                expired.check_ms = CheckInMs(key, now_ns);
+                expired.expiry = PROMOTED;
+                return expired;
+            }
+            servers_.erase(it);
+            detectors_.erase(key);
+            Publish();
+            expired.expiry = REMOVED;
+            return expired;
+        }
+
+        // How many times the cluster's slave has been promoted
+        uint64_t Epoch(int cluster)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return epochs_[cluster];
+        }
+
+        // The routes as of now. They do not change under the caller.
+        std::shared_ptr<const Routes> Snapshot() const
+        {
+            return std::atomic_load(&routes_);
+        }
+
+        // The cluster's server of type, false if none has registered
+        bool Find(int cluster, snsCoordinator::ServerType type, server_t *server) const
+        {
+            std::shared_ptr<const Routes> routes = Snapshot();
+            auto it = routes->find(Key(cluster, type));
+            if (it == routes->end())
+            {
+                return false;
+            }
+            *server = it->second;
+            return true;
+        }
+
+        size_t Count(snsCoordinator::ServerType type) const
+        {
+            size_t count = 0;
+            for (const auto &route : *Snapshot())
+            {
+                count += route.first.second == type;
+            }
+            return count;
+        }
+
+    private:
+        // Heartbeat gaps each detector keeps
+        static const size_t phi_window = 100;
+
+        // Milliseconds from now_ns until the server at key is suspected, at
+        // least 1. Needs mutex_.
+        int64_t CheckInMs(const Key &key, int64_t now_ns)
+        {
+            const PhiDetector &detector = detectors_[key];
+            int64_t since_ms = (now_ns - servers_[key].last_beat_ns) / 1000000;
+            int64_t due_ms = std::min((int64_t)std::ceil(detector.SuspectAfterMs(phi_threshold_)), max_silence_ms_);
+            return std::max(due_ms - since_ms, (int64_t)1);
+        }
+
+        static bool Same(const server_t &s, const snsCoordinator::Heartbeat &beat)
+        {
+            return s.ip == beat.server_ip() && s.port == beat.server_port();
+        }
+
+        // Needs mutex_
+        void Publish()
+        {
+            std::atomic_store(&routes_, std::shared_ptr<const Routes>(std::make_shared<Routes>(servers_)));
+        }
+
+        std::mutex mutex_;
+        Routes servers_;
+        std::map<int, uint64_t> epochs_;
+        std::map<Key, PhiDetector> detectors_;
+        double phi_threshold_ = 8;
+        int64_t max_silence_ms_ = 10000;
+        double min_std_ms_ = 200;
+        double pause_ms_ = 0;
+        std::shared_ptr<const Routes> routes_;
+};
+
+#endif
@@ -0,0 +1,92 @@
+#include <iostream>
+#include <memory>
+#include <string>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "storage.h"
+
+// Copy a server's data folder from one storage backend to the other
+//
+//   ./storage_convert -d master_1 -f json -t binary
+int main(int argc, char** argv) {
+
+    std::string from = "json";
+    std::string to = "binary";
+    std::string folder = "-1";
+
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "f:t:d:")) != -1){
+        switch (opt) {
+        case 'f':
+            from = optarg;
+            break;
+        case 't':
+            to = optarg;
+            break;
+        case 'd':
+            folder = optarg;
+            break;
+        default:
+            std::cerr << "Invalid Command Line Argument\n";
+        }
+    }
+
+    if (folder == "-1")
+    {
+        std::cout << "Please enter a server folder! (-d)\n";
+        return -1;
+    }
+
+    std::unique_ptr<Storage> src(MakeStorage(from, folder, "follow.json", "timeline.json"));
+    std::unique_ptr<Storage> dst(MakeStorage(to, folder, "follow.json", "timeline.json"));
+    if (!src || !dst || from == to)
+    {
+        std::cout << "Usage: storage_convert -d folder -f json|binary -t binary|json\n";
+        return -1;
+    }
+    if (!src->Exists())
+    {
+        std::cout << "No " << from << " data in " << folder << "\n";
+        return -1;
+    }
+    if (dst->Exists())
+    {
+        std::cout << folder << " already has " << to << " data - remove it first\n";
+        return -1;
+    }
+    if (!src->Init() || !dst->Init())
+    {
+        return -1;
+    }
+
+    int users = 0;
+    int follows = 0;
+    int posts = 0;
+
+    src->LoadGraph(
+        [&](const std::string& username) {
+            dst->CreateUser(username);
+            users++;
+        },
+        [&](const std::string& username, const std::string& following, int64_t timestamp) {
+            dst->Follow(username, following, timestamp);
+            follows++;
+        });
+
+    bool ok = true;
+    src->ScanPosts([&](const StoredPost& post) {
+        ok = dst->AppendPost(post);
+        posts += ok;
+        return ok;
+    });
+    if (!ok)
+    {
+        std::cerr << "Could not write post " << posts + 1 << "\n";
+        return -1;
+    }
+
+    std::cout << "Converted " << users << " users, " << follows << " follows, "
+              << posts << " posts from " << from << " to " << to << "\n";
+    return 0;
+}
@@ -0,0 +1,92 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Hashed timer wheel.
+ *
+ * Timers go into one of slots buckets by their deadline, and Advance, called
+ * every tick_ms, moves to the next bucket and fires what is due there. A
+ * deadline more than one turn away waits out the extra turns in its bucket.
+ * Scheduling and firing are O(1) no matter how many timers there are.
+ *
+ * Scheduling a key again replaces its timer, and the old entry is skipped
+ * when its bucket comes round, so a timer pushed back on every heartbeat
+ * costs one append each time.
+ */
+
+class TimerWheel
+{
+    public:
+        TimerWheel(size_t slots, int tick_ms) : tick_ms_(tick_ms), slots_(slots) {}
+
+        int tick_ms() const
+        {
+            return tick_ms_;
+        }
+
+        // Fire key after delay_ms, rounded up to whole ticks
+        void Schedule(uint64_t key, int64_t delay_ms)
+        {
+            uint64_t ticks = delay_ms <= tick_ms_ ? 1 : (delay_ms + tick_ms_ - 1) / tick_ms_;
+            std::lock_guard<std::mutex> lock(mutex_);
+            uint64_t generation = ++generation_;
+            timers_[key] = generation;
+            Timer timer = {key, generation, (ticks - 1) / slots_.size()};
+            slots_[(current_ + ticks) % slots_.size()].push_back(timer);
+        }
+
+        void Cancel(uint64_t key)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            timers_.erase(key);
+        }
+
+        // Move on one tick and add the keys that are due to expired
+        void Advance(std::vector<uint64_t> *expired)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            current_ = (current_ + 1) % slots_.size();
+            std::vector<Timer> &slot = slots_[current_];
+            size_t kept = 0;
+            for (Timer &timer : slot)
+            {
+                auto it = timers_.find(timer.key);
+                if (it == timers_.end() || it->second != timer.generation)
+                {
+                    continue;
+                }
+                if (timer.rounds > 0)
+                {
+                    timer.rounds--;
+                    slot[kept++] = timer;
+                    continue;
+                }
+                timers_.erase(it);
+                expired->push_back(timer.key);
+            }
+            slot.resize(kept);
+        }
+
+    private:
+        struct Timer
+        {
+            uint64_t key;
+            uint64_t generation;
+            uint64_t rounds; // turns of the wheel still to wait
+        };
+
+        const int tick_ms_;
+        std::mutex mutex_;
+        std::vector<std::vector<Timer>> slots_;
+        size_t current_ = 0;
+        uint64_t generation_ = 0;
+        // Key -> generation of its live timer
+        std::unordered_map<uint64_t, uint64_t> timers_;
+};
+
+#endif
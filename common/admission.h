@@ -0,0 +1,136 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+/*
+ * Token buckets for admission control.
+ *
+ * A bucket refills at a fixed rate up to a burst size. It is kept as one
+ * atomic - the time the bucket would next be full if nothing else were
+ * taken (the GCRA form of a token bucket) - so taking a token is a load and
+ * a compare-exchange, with no lock on the request path. A rejected take says
+ * how long until a token frees up, which the servers pass back as a retry
+ * hint.
+ *
+ * Limits are shared by every bucket of a kind; a bucket only holds state.
+ */
+
+inline int64_t MonotonicNanos()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct RateLimit
+{
+    int64_t interval_ns = 0;  // time to refill one token, 0 for no limit
+    int64_t tolerance_ns = 0; // how far ahead of the refill a bucket may run
+
+    // rate tokens per second, up to burst at once. A rate <= 0 is no limit.
+    static RateLimit PerSecond(double rate, double burst)
+    {
+        RateLimit limit;
+        if (rate > 0)
+        {
+            limit.interval_ns = std::max<int64_t>(1, (int64_t)(1e9 / rate));
+            limit.tolerance_ns = (int64_t)((std::max(burst, 1.0) - 1) * limit.interval_ns);
+        }
+        return limit;
+    }
+
+    bool enabled() const { return interval_ns > 0; }
+};
+
+class TokenBucket
+{
+    public:
+        // True if a token was taken, otherwise *retry_ns is how long until
+        // one is available
+        bool Take(const RateLimit &limit, int64_t now_ns, int64_t *retry_ns)
+        {
+            if (!limit.enabled())
+            {
+                return true;
+            }
+
+            int64_t full = full_at_.load(std::memory_order_relaxed);
+            while (true)
+            {
+                int64_t start = std::max(full, now_ns);
+                if (start - now_ns > limit.tolerance_ns)
+                {
+                    *retry_ns = start - now_ns - limit.tolerance_ns;
+                    return false;
+                }
+                if (full_at_.compare_exchange_weak(full, start + limit.interval_ns,
+                                                   std::memory_order_relaxed))
+                {
+                    return true;
+                }
+            }
+        }
+
+    private:
+        std::atomic<int64_t> full_at_{0};
+};
+
+// Per-user and global limits for one kind of request, and how often each
+// turned a request away
+class Admission
+{
+    public:
+        void Configure(double user_rate, double global_rate, double burst_seconds)
+        {
+            user_ = RateLimit::PerSecond(user_rate, user_rate * burst_seconds);
+            global_ = RateLimit::PerSecond(global_rate, global_rate * burst_seconds);
+        }
+
+        bool enabled() const { return user_.enabled() || global_.enabled(); }
+
+        // Check the user's bucket (if there is a user) and then the global
+        // one. A request the global bucket turns away has still used the
+        // user's token - the user was sending within its own limit anyway.
+        bool Admit(TokenBucket *user_bucket, int64_t *retry_ns)
+        {
+            if (!enabled())
+            {
+                return true;
+            }
+            int64_t now = MonotonicNanos();
+            if (user_bucket && !user_bucket->Take(user_, now, retry_ns))
+            {
+                rejected_user_.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            if (!global_bucket_.Take(global_, now, retry_ns))
+            {
+                rejected_global_.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            return true;
+        }
+
+        uint64_t rejected() const { return rejected_user_ + rejected_global_; }
+
+        // "rejected <n> (user <n>, global <n>)"
+        std::string ToString() const
+        {
+            return "rejected " + std::to_string(rejected()) +
+                   " (user " + std::to_string(rejected_user_) +
+                   ", global " + std::to_string(rejected_global_) + ")";
+        }
+
+    private:
+        RateLimit user_;
+        RateLimit global_;
+        TokenBucket global_bucket_;
+        std::atomic<uint64_t> rejected_user_{0};
+        std::atomic<uint64_t> rejected_global_{0};
+};
+
+#endif
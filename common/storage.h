@@ -0,0 +1,1948 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#include <google/protobuf/io/coded_stream.h>
+
+#include "json.hpp"
+#include "storage.pb.h"
+
+/*
+ * Persistent storage for the follow graph and the posts.
+ *
+ * Two backends implement the same interface:
+ *  - JsonStorage keeps the pretty-printed json files. Every change re-reads
+ *    and rewrites a whole file, so it is meant for debugging.
+ *  - BinaryStorage appends length-delimited snsStorage::Record protobufs.
+ *    follow.seg holds the graph, posts go to timeline-N.seg segments that
+ *    roll over at segment_bytes, and storage.idx lists the segments.
+ *    A full segment is sealed with a footer indexing its posts by author
+ *    and time, and is read through mmap from then on.
+ *    With group commit on, AppendPost returns once the post is fdatasynced,
+ *    and posts arriving together share one fdatasync.
+ *
+ * storage_convert copies a data folder from one backend to the other.
+ */
+
+struct StoredPost
+{
+    std::string username;
+    std::string msg;
+    int64_t timestamp = 0;  // seconds
+    int32_t nanos = 0;
+    uint64_t sequence = 0;  // per-author, 0 on posts from before sequences
+};
+
+typedef std::function<void(const std::string &username)> UserVisitor;
+typedef std::function<void(const std::string &username, const std::string &following, int64_t timestamp)> FollowVisitor;
+typedef std::function<void(const std::string &username, const std::string &following)> UnfollowVisitor;
+// Return false to stop the scan
+typedef std::function<bool(const StoredPost &post)> PostVisitor;
+// Author -> oldest timestamp of theirs to include
+typedef std::unordered_map<std::string, int64_t> AuthorSince;
+
+// Where a page of PostsBefore stopped. Only meaningful to the backend that
+// made it - the default is past the newest post.
+struct PostCursor
+{
+    uint32_t segment = std::numeric_limits<uint32_t>::max();
+    int64_t timestamp = std::numeric_limits<int64_t>::max();
+    uint64_t offset = std::numeric_limits<uint64_t>::max();
+};
+
+// Index of the power of two bucket holding v: 0 for 0-1, 1 for 2-3, 2 for 4-7...
+inline int Log2Bucket(uint64_t v)
+{
+    int bucket = 0;
+    while (v > 1 && bucket < 31)
+    {
+        v >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+// Counters kept by the group commit thread
+struct GroupCommitStats
+{
+    uint64_t batches = 0;
+    uint64_t posts = 0;
+    uint64_t failed = 0;
+    uint64_t max_batch = 0;
+    uint64_t commit_us = 0;
+    uint64_t max_commit_us = 0;
+    uint64_t batch_sizes[32] = {};    // by Log2Bucket(posts in batch)
+    uint64_t commit_latency[32] = {}; // by Log2Bucket(microseconds)
+
+    void Add(size_t batch, uint64_t us)
+    {
+        batches++;
+        posts += batch;
+        max_batch = std::max<uint64_t>(max_batch, batch);
+        commit_us += us;
+        max_commit_us = std::max(max_commit_us, us);
+        batch_sizes[Log2Bucket(batch)]++;
+        commit_latency[Log2Bucket(us)]++;
+    }
+
+    // Ex: "12 batches, 80 posts (avg 6.7, max 16), commit avg 850us max 2100us,
+    //      sizes 1:2 4:6 8:4, latency_us 512:7 1024:4 2048:1"
+    std::string ToString() const
+    {
+        std::ostringstream out;
+        out << batches << " batches, " << posts << " posts";
+        if (batches > 0)
+        {
+            out << " (avg " << std::fixed << std::setprecision(1) << (double)posts / batches
+                << ", max " << max_batch << "), commit avg " << commit_us / batches
+                << "us max " << max_commit_us << "us";
+        }
+        if (failed > 0)
+        {
+            out << ", " << failed << " failed";
+        }
+        out << ", sizes" << Histogram(batch_sizes) << ", latency_us" << Histogram(commit_latency);
+        return out.str();
+    }
+
+    private:
+        // Non-empty buckets as "low:count" - bucket low holds low to 2*low-1,
+        // and bucket 1 also holds 0
+        static std::string Histogram(const uint64_t (&buckets)[32])
+        {
+            std::string h;
+            for (int i = 0; i < 32; i++)
+            {
+                if (buckets[i] > 0)
+                {
+                    h += " " + std::to_string(1ULL << i) + ":" + std::to_string(buckets[i]);
+                }
+            }
+            return h;
+        }
+};
+
+class Storage
+{
+    public:
+        virtual ~Storage() {}
+
+        // True if the folder already has data for this backend
+        virtual bool Exists() const = 0;
+
+        // Open the storage, creating empty files if needed
+        virtual bool Init() = 0;
+
+        // Open only what CreateUser, Follow and Unfollow write, to add to
+        // the graph of a folder another process has open. Nothing there is
+        // repaired, so a record that process is writing is left alone.
+        virtual bool InitGraph() = 0;
+
+        // Replay the graph - every user first, then every follow edge
+        virtual void LoadGraph(const UserVisitor &on_user, const FollowVisitor &on_follow) = 0;
+
+        // Where the graph's changes end now, to pass to LoadGraphChanges
+        virtual uint64_t GraphPosition()
+        {
+            return 0;
+        }
+
+        // Replay the graph changes stored after *position, oldest first,
+        // that other processes wrote, and move *position past them. This
+        // process's own changes are skipped. False if the backend cannot -
+        // the caller should reload the whole graph with LoadGraph instead.
+        virtual bool LoadGraphChanges(uint64_t *position, const UserVisitor &on_user, const FollowVisitor &on_follow,
+                                      const UnfollowVisitor &on_unfollow)
+        {
+            return false;
+        }
+
+        // False if the graph file is as LoadGraph or this process's own
+        // last write left it, so a change signalled on it was our own
+        virtual bool GraphChangedElsewhere()
+        {
+            return true;
+        }
+
+        virtual void CreateUser(const std::string &username) = 0;
+        virtual void Follow(const std::string &username, const std::string &following, int64_t timestamp) = 0;
+        virtual void Unfollow(const std::string &username, const std::string &following) = 0;
+        // False if the post could not be stored
+        virtual bool AppendPost(const StoredPost &post) = 0;
+
+        // Make AppendPost wait until the post is durable. A batch of posts is
+        // committed with one fdatasync once it has max_batch posts or its
+        // oldest post has waited max_latency_us. False if not supported.
+        virtual bool EnableGroupCommit(size_t max_batch, int max_latency_us)
+        {
+            return false;
+        }
+
+        // Group commit counters, empty if group commit is off
+        virtual std::string CommitStats()
+        {
+            return "";
+        }
+
+        // Oldest first
+        virtual void ScanPosts(const PostVisitor &visit) = 0;
+        // Newest first
+        virtual void ScanPostsBackward(const PostVisitor &visit) = 0;
+
+        // Newest first, at most limit posts by the given authors that are
+        // older than before. *next is set to continue after the last one.
+        virtual std::vector<StoredPost> PostsBefore(const AuthorSince &authors, const PostCursor &before,
+                                                    size_t limit, PostCursor *next)
+        {
+            // Keep the newest limit matches, by position from the oldest post
+            std::deque<std::pair<uint64_t, StoredPost>> window;
+            uint64_t position = 0;
+            ScanPosts([&](const StoredPost &post)
+            {
+                if (position >= before.offset)
+                {
+                    return false;
+                }
+                auto it = authors.find(post.username);
+                if (it != authors.end() && post.timestamp >= it->second)
+                {
+                    window.push_back(std::make_pair(position, post));
+                    if (window.size() > limit)
+                    {
+                        window.pop_front();
+                    }
+                }
+                position++;
+                return true;
+            });
+
+            std::vector<StoredPost> posts;
+            for (auto it = window.rbegin(); it != window.rend(); it++)
+            {
+                posts.push_back(it->second);
+            }
+            if (next != nullptr)
+            {
+                *next = before;
+                if (!window.empty())
+                {
+                    next->segment = 0;
+                    next->timestamp = window.front().second.timestamp;
+                    next->offset = window.front().first;
+                }
+            }
+            return posts;
+        }
+
+        // Newest first, at most limit posts by the given authors
+        std::vector<StoredPost> RecentPosts(const AuthorSince &authors, size_t limit)
+        {
+            return PostsBefore(authors, PostCursor(), limit, nullptr);
+        }
+
+        // Sequence of the author's newest post, 0 if there is none
+        uint64_t LastSequence(const std::string &author)
+        {
+            AuthorSince authors;
+            authors[author] = std::numeric_limits<int64_t>::min();
+            std::vector<StoredPost> posts = RecentPosts(authors, 1);
+            return posts.empty() ? 0 : posts[0].sequence;
+        }
+
+        // File that changes whenever the graph does
+        virtual std::string GraphPath() const = 0;
+};
+
+inline bool FileExists(const std::string &path)
+{
+    struct stat st;
+    return stat(path.c_str(), &st) == 0;
+}
+
+// ------------------------------------------------------------
+// JSON backend
+// ------------------------------------------------------------
+
+// SAX handler for a follow file:
+//   {"users": {"<name>": {"username": "<name>",
+//                         "following": {"<name>": {"username": ..., "timestamp": ...}}}}}
+// Users are passed on as they are read. Edges are kept until the end, since
+// LoadGraph gives every user before any edge.
+class GraphSax : public nlohmann::json_sax<nlohmann::ordered_json>
+{
+    public:
+        struct Edge
+        {
+            std::string username;
+            std::string following;
+            int64_t timestamp;
+        };
+        std::vector<Edge> edges;
+
+        explicit GraphSax(const UserVisitor &on_user)
+            : on_user_(on_user)
+        {}
+
+        bool null() override
+        {
+            return true;
+        }
+
+        bool boolean(bool) override
+        {
+            return true;
+        }
+
+        bool number_integer(number_integer_t val) override
+        {
+            return Number(val);
+        }
+
+        bool number_unsigned(number_unsigned_t val) override
+        {
+            return Number(val);
+        }
+
+        bool number_float(number_float_t, const string_t &) override
+        {
+            return true;
+        }
+
+        bool string(string_t &val) override
+        {
+            // users.<name>.username
+            if (path_.size() == 3 && path_[0] == "users" && path_[2] == "username")
+            {
+                on_user_(val);
+            }
+            return true;
+        }
+
+        bool binary(binary_t &) override
+        {
+            return true;
+        }
+
+        bool start_object(std::size_t) override
+        {
+            path_.push_back("");
+            timestamp_ = 0;
+            return true;
+        }
+
+        bool key(string_t &val) override
+        {
+            path_.back() = val;
+            return true;
+        }
+
+        bool end_object() override
+        {
+            // users.<name>.following.<name> is done
+            if (path_.size() == 5 && path_[0] == "users" && path_[2] == "following")
+            {
+                edges.push_back({path_[1], path_[3], timestamp_});
+            }
+            path_.pop_back();
+            return true;
+        }
+
+        bool start_array(std::size_t) override
+        {
+            path_.push_back("");
+            return true;
+        }
+
+        bool end_array() override
+        {
+            path_.pop_back();
+            return true;
+        }
+
+        bool parse_error(std::size_t, const std::string &, const nlohmann::detail::exception &) override
+        {
+            return false;
+        }
+
+    private:
+        bool Number(int64_t val)
+        {
+            // users.<name>.following.<name>.timestamp
+            if (path_.size() == 5 && path_[0] == "users" && path_[2] == "following" && path_[4] == "timestamp")
+            {
+                timestamp_ = val;
+            }
+            return true;
+        }
+
+        const UserVisitor &on_user_;
+        std::vector<std::string> path_;
+        int64_t timestamp_ = 0;
+};
+
+class JsonStorage : public Storage
+{
+    public:
+        // follow_location and timeline_location may be the same file
+        JsonStorage(const std::string &follow_location, const std::string &timeline_location)
+            : follow_location_(follow_location), timeline_location_(timeline_location)
+        {}
+
+        bool Exists() const override
+        {
+            return FileExists(follow_location_);
+        }
+
+        // Every write reads the file first
+        bool InitGraph() override
+        {
+            return true;
+        }
+
+        bool Init() override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            nlohmann::ordered_json f = Read(follow_location_);
+            if (!f.contains("users"))
+            {
+                f["users"] = nlohmann::ordered_json::object();
+            }
+            if (follow_location_ != timeline_location_)
+            {
+                Write(f, follow_location_);
+                f = Read(timeline_location_);
+            }
+            if (!f.contains("posts"))
+            {
+                f["posts"] = nlohmann::ordered_json::array();
+            }
+            Write(f, timeline_location_);
+            return true;
+        }
+
+        // Streams the file through a SAX parser instead of building a DOM,
+        // which also skips over the posts when both live in one file
+        void LoadGraph(const UserVisitor &on_user, const FollowVisitor &on_follow) override
+        {
+            GraphSax graph(on_user);
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                own_stamp_ = FollowStamp();
+                changed_elsewhere_ = false;
+                std::ifstream file(follow_location_);
+                if (!file.is_open() || file.peek() == std::ifstream::traits_type::eof())
+                {
+                    return;
+                }
+                if (!nlohmann::ordered_json::sax_parse(file, &graph))
+                {
+                    std::cerr << "Could not parse " << follow_location_ << std::endl;
+                }
+            }
+
+            for (const GraphSax::Edge &edge : graph.edges)
+            {
+                on_follow(edge.username, edge.following, edge.timestamp);
+            }
+        }
+
+        void CreateUser(const std::string &username) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            nlohmann::ordered_json j = Read(follow_location_);
+
+            nlohmann::ordered_json user_data;
+            user_data["username"] = username;
+            user_data["following"] = nlohmann::ordered_json::object();
+            j["users"][username] = user_data;
+
+            WriteOwn(j, follow_location_);
+        }
+
+        bool GraphChangedElsewhere() override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return changed_elsewhere_ || FollowStamp() != own_stamp_;
+        }
+
+        void Follow(const std::string &username, const std::string &following, int64_t timestamp) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            nlohmann::ordered_json j = Read(follow_location_);
+
+            nlohmann::ordered_json follow_data;
+            follow_data["username"] = following;
+            follow_data["timestamp"] = timestamp;
+            j["users"][username]["following"][following] = follow_data;
+
+            WriteOwn(j, follow_location_);
+        }
+
+        void Unfollow(const std::string &username, const std::string &following) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            nlohmann::ordered_json j = Read(follow_location_);
+            j["users"][username]["following"].erase(following);
+            WriteOwn(j, follow_location_);
+        }
+
+        bool AppendPost(const StoredPost &post) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            nlohmann::ordered_json j = Read(timeline_location_);
+
+            nlohmann::ordered_json p = nlohmann::ordered_json::object();
+            p["message"] = post.msg;
+            p["username"] = post.username;
+            p["timestamp"] = post.timestamp;
+            p["nanos"] = post.nanos;
+            p["sequence"] = post.sequence;
+            j["posts"].push_back(p);
+
+            WriteOwn(j, timeline_location_);
+            return true;
+        }
+
+        void ScanPosts(const PostVisitor &visit) override
+        {
+            nlohmann::ordered_json j = ReadPosts();
+            for (auto it = j.begin(); it != j.end(); it++)
+            {
+                if (!visit(ToPost(*it)))
+                {
+                    break;
+                }
+            }
+        }
+
+        void ScanPostsBackward(const PostVisitor &visit) override
+        {
+            nlohmann::ordered_json j = ReadPosts();
+            for (auto it = j.rbegin(); it != j.rend(); it++)
+            {
+                if (!visit(ToPost(*it)))
+                {
+                    break;
+                }
+            }
+        }
+
+        std::string GraphPath() const override
+        {
+            return follow_location_;
+        }
+
+    private:
+        // Missing or empty files read as an empty object
+        static nlohmann::ordered_json Read(const std::string &location)
+        {
+            std::ifstream file(location);
+            if (!file.is_open() || file.peek() == std::ifstream::traits_type::eof())
+            {
+                return nlohmann::ordered_json::object();
+            }
+            return nlohmann::ordered_json::parse(file);
+        }
+
+        static void Write(const nlohmann::ordered_json &j, const std::string &location)
+        {
+            std::ofstream ofs(location);
+            ofs << std::setw(4) << j << std::endl;
+            ofs.close();
+        }
+
+        // Which version of the follow file is on disk
+        typedef std::tuple<ino_t, off_t, int64_t> Stamp;
+
+        Stamp FollowStamp() const
+        {
+            struct stat st;
+            if (stat(follow_location_.c_str(), &st) != 0)
+            {
+                return Stamp();
+            }
+            return Stamp(st.st_ino, st.st_size, (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec);
+        }
+
+        // Write, remembering how the follow file was left if it is the one
+        // written. If someone else changed it since, that is remembered too,
+        // as our own write now hides it. Called with mutex_ held.
+        void WriteOwn(const nlohmann::ordered_json &j, const std::string &location)
+        {
+            if (location != follow_location_)
+            {
+                Write(j, location);
+                return;
+            }
+            if (FollowStamp() != own_stamp_)
+            {
+                changed_elsewhere_ = true;
+            }
+            Write(j, location);
+            own_stamp_ = FollowStamp();
+        }
+
+        nlohmann::ordered_json ReadPosts()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            nlohmann::ordered_json j = Read(timeline_location_);
+            return std::move(j["posts"]);
+        }
+
+        static StoredPost ToPost(const nlohmann::ordered_json &p)
+        {
+            StoredPost post;
+            post.username = p["username"];
+            post.msg = p["message"];
+            post.timestamp = p["timestamp"];
+            // Absent in files written before they were kept
+            post.nanos = p.value("nanos", 0);
+            post.sequence = p.value("sequence", (uint64_t)0);
+            return post;
+        }
+
+        std::string follow_location_;
+        std::string timeline_location_;
+        std::mutex mutex_;
+        Stamp own_stamp_;
+        bool changed_elsewhere_ = true;
+};
+
+// ------------------------------------------------------------
+// Binary backend
+// ------------------------------------------------------------
+
+// Read a varint32 length prefix, false if the buffer ends first
+inline bool ReadVarint32(const char *&p, const char *end, uint32_t *value)
+{
+    uint32_t result = 0;
+    for (int shift = 0; shift < 35 && p < end; shift += 7)
+    {
+        uint8_t byte = *p++;
+        result |= (uint32_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+        {
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Walk the records in data[0, size). Returns the offset just past the last
+// complete record - anything after it is a torn write.
+inline size_t ReadRecords(const char *data, size_t size,
+                          const std::function<bool(const snsStorage::Record &record, size_t offset, size_t length)> &visit)
+{
+    const char *p = data;
+    const char *end = data + size;
+    snsStorage::Record record;
+
+    while (p < end)
+    {
+        const char *start = p;
+        uint32_t length;
+        // A zero length is footer padding, never a record
+        if (!ReadVarint32(p, end, &length) || length == 0 || (size_t)(end - p) < length ||
+            !record.ParseFromArray(p, length))
+        {
+            return start - data;
+        }
+        p += length;
+        if (!visit(record, start - data, p - start))
+        {
+            break;
+        }
+    }
+    return p - data;
+}
+
+inline std::string EncodeRecord(const snsStorage::Record &record)
+{
+    std::string buf;
+    uint32_t size = record.ByteSizeLong();
+    buf.resize(google::protobuf::io::CodedOutputStream::VarintSize32(size) + size);
+    uint8_t *p = google::protobuf::io::CodedOutputStream::WriteVarint32ToArray(size, (uint8_t *)&buf[0]);
+    record.SerializeWithCachedSizesToArray(p);
+    return buf;
+}
+
+inline bool WriteAll(int fd, const char *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t n = write(fd, data, size);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+inline bool ReadFile(const std::string &path, std::string *contents)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open())
+    {
+        return false;
+    }
+    std::stringstream ss;
+    ss << file.rdbuf();
+    *contents = ss.str();
+    return true;
+}
+
+// Read from offset to the end of the file. False if it cannot be read or is
+// shorter than offset.
+inline bool ReadFileFrom(const std::string &path, uint64_t offset, std::string *contents)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0 && (uint64_t)st.st_size >= offset;
+    if (ok)
+    {
+        contents->resize(st.st_size - offset);
+        size_t done = 0;
+        while (done < contents->size())
+        {
+            ssize_t n = pread(fd, &(*contents)[done], contents->size() - done, offset + done);
+            if (n <= 0)
+            {
+                break;
+            }
+            done += n;
+        }
+        contents->resize(done);
+    }
+    close(fd);
+    return ok;
+}
+
+// ------------------------------------------------------------
+// Sealed segment footer
+//
+// Written after the last record of a full segment, starting at an 8 byte
+// aligned footer_offset:
+//
+//   AuthorEntry  authors[author_count]   sorted by name
+//   PostEntry    posts[post_count]       grouped by author, oldest first
+//   uint32_t     order[post_count]       index into posts, in file order
+//   char         names[names_bytes]      author names, padded to 8 bytes
+//   SegmentTrailer                       last 40 bytes of the file
+//
+// Fields are fixed width in host byte order, so a reader can mmap the
+// segment and binary search the footer without parsing it.
+// ------------------------------------------------------------
+
+const uint32_t segment_magic = 0x53454731; // "SEG1"
+const uint32_t segment_version = 1;
+
+struct PostEntry
+{
+    int64_t timestamp;
+    uint64_t offset; // of the record's length prefix
+    uint32_t length; // including the length prefix
+    uint32_t reserved;
+};
+
+struct AuthorEntry
+{
+    uint64_t name_offset;
+    uint32_t name_length;
+    uint32_t first; // into posts
+    uint32_t count;
+    uint32_t reserved;
+};
+
+struct SegmentTrailer
+{
+    uint64_t footer_offset;
+    uint64_t author_count;
+    uint64_t post_count;
+    uint64_t names_bytes;
+    uint32_t version;
+    uint32_t magic;
+};
+
+static_assert(sizeof(PostEntry) == 24, "PostEntry is part of the file format");
+static_assert(sizeof(AuthorEntry) == 24, "AuthorEntry is part of the file format");
+static_assert(sizeof(SegmentTrailer) == 40, "SegmentTrailer is part of the file format");
+
+inline size_t Align8(size_t n)
+{
+    return (n + 7) & ~(size_t)7;
+}
+
+// A post in the segment being appended to
+struct IndexedPost
+{
+    std::string username;
+    PostEntry entry;
+};
+
+// Footer for the posts of a segment whose records end at data_bytes,
+// including the padding in front of it
+inline std::string BuildFooter(const std::vector<IndexedPost> &posts, uint64_t data_bytes)
+{
+    // Group by author, oldest first within an author
+    std::map<std::string, std::vector<uint32_t>> by_author;
+    for (uint32_t i = 0; i < posts.size(); i++)
+    {
+        by_author[posts[i].username].push_back(i);
+    }
+
+    std::vector<AuthorEntry> authors;
+    std::vector<PostEntry> entries;
+    std::vector<uint32_t> order(posts.size());
+    std::string names;
+    for (auto &a : by_author)
+    {
+        std::stable_sort(a.second.begin(), a.second.end(), [&posts](uint32_t x, uint32_t y)
+        {
+            return posts[x].entry.timestamp < posts[y].entry.timestamp;
+        });
+
+        AuthorEntry author = {};
+        author.name_offset = names.size();
+        author.name_length = a.first.size();
+        author.first = entries.size();
+        author.count = a.second.size();
+        authors.push_back(author);
+        names += a.first;
+
+        for (uint32_t i : a.second)
+        {
+            order[i] = entries.size();
+            entries.push_back(posts[i].entry);
+        }
+    }
+
+    SegmentTrailer trailer = {};
+    trailer.footer_offset = Align8(data_bytes);
+    trailer.author_count = authors.size();
+    trailer.post_count = entries.size();
+    trailer.names_bytes = names.size();
+    trailer.version = segment_version;
+    trailer.magic = segment_magic;
+
+    std::string footer(trailer.footer_offset - data_bytes, '\0');
+    footer.append((const char *)authors.data(), authors.size() * sizeof(AuthorEntry));
+    footer.append((const char *)entries.data(), entries.size() * sizeof(PostEntry));
+    footer.append((const char *)order.data(), order.size() * sizeof(uint32_t));
+    footer.resize(Align8(data_bytes + footer.size()) - data_bytes, '\0');
+    footer.append(names);
+    footer.resize(Align8(data_bytes + footer.size()) - data_bytes, '\0');
+    footer.append((const char *)&trailer, sizeof(trailer));
+    return footer;
+}
+
+inline StoredPost ToStoredPost(const snsStorage::PostRecord &p)
+{
+    StoredPost post;
+    post.username = p.username();
+    post.msg = p.msg();
+    post.timestamp = p.timestamp();
+    post.nanos = p.nanos();
+    post.sequence = p.sequence();
+    return post;
+}
+
+// Parse the single record at data[0, length)
+inline bool ParsePost(const char *data, size_t length, StoredPost *post)
+{
+    bool found = false;
+    ReadRecords(data, length, [&](const snsStorage::Record &record, size_t, size_t)
+    {
+        *post = ToStoredPost(record.post());
+        found = true;
+        return false;
+    });
+    return found;
+}
+
+// A sealed segment, mapped read-only. Only the pages a reader touches are
+// faulted in - the trailer, a few pages of footer per author looked up, and
+// the records actually returned.
+class MappedSegment
+{
+    public:
+        ~MappedSegment()
+        {
+            if (data_ != nullptr)
+            {
+                munmap((void *)data_, size_);
+            }
+        }
+
+        // Map a sealed segment whose records end at data_bytes
+        static std::shared_ptr<MappedSegment> Open(const std::string &path, uint64_t data_bytes)
+        {
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0)
+            {
+                std::cerr << "Could not open " << path << ": " << strerror(errno) << std::endl;
+                return nullptr;
+            }
+
+            struct stat st;
+            void *p = MAP_FAILED;
+            if (fstat(fd, &st) == 0 && st.st_size > 0)
+            {
+                p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            }
+            close(fd);
+            if (p == MAP_FAILED)
+            {
+                std::cerr << "Could not map " << path << std::endl;
+                return nullptr;
+            }
+
+            std::shared_ptr<MappedSegment> segment(new MappedSegment((const char *)p, st.st_size));
+            segment->data_bytes_ = std::min<uint64_t>(data_bytes, st.st_size);
+            if (!segment->LoadFooter())
+            {
+                // Sealed without a usable footer - index it the slow way
+                std::cerr << "No footer in " << path << ", rebuilding index" << std::endl;
+                segment->BuildIndex();
+            }
+            return segment;
+        }
+
+        const char *Data() const
+        {
+            return data_;
+        }
+
+        uint64_t DataBytes() const
+        {
+            return data_bytes_;
+        }
+
+        size_t PostCount() const
+        {
+            return post_count_;
+        }
+
+        // Posts by one author, oldest first. False if the author has none here.
+        bool FindAuthor(const std::string &username, const PostEntry **begin, const PostEntry **end) const
+        {
+            size_t lo = 0;
+            size_t hi = author_count_;
+            while (lo < hi)
+            {
+                size_t mid = (lo + hi) / 2;
+                const AuthorEntry &a = authors_[mid];
+                int cmp = username.compare(0, std::string::npos, names_ + a.name_offset, a.name_length);
+                if (cmp == 0)
+                {
+                    *begin = posts_ + a.first;
+                    *end = posts_ + a.first + a.count;
+                    return true;
+                }
+                if (cmp < 0)
+                {
+                    hi = mid;
+                }
+                else
+                {
+                    lo = mid + 1;
+                }
+            }
+            return false;
+        }
+
+        // i-th post in file order
+        const PostEntry &InFileOrder(size_t i) const
+        {
+            return posts_[order_[i]];
+        }
+
+        bool ReadPost(const PostEntry &e, StoredPost *post) const
+        {
+            if (e.offset + e.length > data_bytes_)
+            {
+                return false;
+            }
+            return ParsePost(data_ + e.offset, e.length, post);
+        }
+
+    private:
+        MappedSegment(const char *data, size_t size)
+            : data_(data), size_(size)
+        {}
+
+        bool LoadFooter()
+        {
+            if (size_ < sizeof(SegmentTrailer))
+            {
+                return false;
+            }
+            SegmentTrailer trailer;
+            memcpy(&trailer, data_ + size_ - sizeof(trailer), sizeof(trailer));
+            if (trailer.magic != segment_magic || trailer.version != segment_version ||
+                trailer.footer_offset < data_bytes_ || trailer.footer_offset % 8 != 0)
+            {
+                return false;
+            }
+
+            uint64_t authors_bytes = trailer.author_count * sizeof(AuthorEntry);
+            uint64_t posts_bytes = trailer.post_count * sizeof(PostEntry);
+            uint64_t order_bytes = Align8(trailer.post_count * sizeof(uint32_t));
+            uint64_t names_bytes = Align8(trailer.names_bytes);
+            if (trailer.footer_offset + authors_bytes + posts_bytes + order_bytes + names_bytes + sizeof(trailer) != size_)
+            {
+                return false;
+            }
+
+            const char *p = data_ + trailer.footer_offset;
+            authors_ = (const AuthorEntry *)p;
+            posts_ = (const PostEntry *)(p + authors_bytes);
+            order_ = (const uint32_t *)(p + authors_bytes + posts_bytes);
+            names_ = p + authors_bytes + posts_bytes + order_bytes;
+            author_count_ = trailer.author_count;
+            post_count_ = trailer.post_count;
+            return true;
+        }
+
+        // Scan the records and keep the footer in memory instead
+        void BuildIndex()
+        {
+            std::vector<IndexedPost> posts;
+            ReadRecords(data_, data_bytes_, [&](const snsStorage::Record &record, size_t offset, size_t length)
+            {
+                IndexedPost p;
+                p.username = record.post().username();
+                p.entry.timestamp = record.post().timestamp();
+                p.entry.offset = offset;
+                p.entry.length = length;
+                p.entry.reserved = 0;
+                posts.push_back(p);
+                return true;
+            });
+
+            uint64_t start = Align8(data_bytes_);
+            rebuilt_ = BuildFooter(posts, data_bytes_).substr(start - data_bytes_);
+
+            SegmentTrailer trailer;
+            memcpy(&trailer, rebuilt_.data() + rebuilt_.size() - sizeof(trailer), sizeof(trailer));
+            const char *p = rebuilt_.data();
+            uint64_t authors_bytes = trailer.author_count * sizeof(AuthorEntry);
+            uint64_t posts_bytes = trailer.post_count * sizeof(PostEntry);
+            uint64_t order_bytes = Align8(trailer.post_count * sizeof(uint32_t));
+            authors_ = (const AuthorEntry *)p;
+            posts_ = (const PostEntry *)(p + authors_bytes);
+            order_ = (const uint32_t *)(p + authors_bytes + posts_bytes);
+            names_ = p + authors_bytes + posts_bytes + order_bytes;
+            author_count_ = trailer.author_count;
+            post_count_ = trailer.post_count;
+        }
+
+        const char *data_ = nullptr;
+        size_t size_ = 0;
+        uint64_t data_bytes_ = 0;
+
+        const AuthorEntry *authors_ = nullptr;
+        const PostEntry *posts_ = nullptr;
+        const uint32_t *order_ = nullptr;
+        const char *names_ = nullptr;
+        size_t author_count_ = 0;
+        size_t post_count_ = 0;
+
+        // Footer built by BuildIndex - 8 byte aligned by std::string's allocator
+        std::string rebuilt_;
+};
+
+// One author's posts in a segment, oldest first, down to a minimum timestamp
+struct PostRange
+{
+    const PostEntry *begin;
+    const PostEntry *end;
+    int64_t since;
+};
+
+// The newest limit entries across all ranges, newest first.
+// Costs O(limit * log ranges).
+inline std::vector<const PostEntry *> MergeNewest(std::vector<PostRange> &ranges, size_t limit)
+{
+    typedef std::pair<std::pair<int64_t, uint64_t>, size_t> HeapItem; // ((timestamp, offset), range)
+    std::priority_queue<HeapItem> heap;
+    for (size_t i = 0; i < ranges.size(); i++)
+    {
+        const PostRange &r = ranges[i];
+        if (r.end > r.begin && (r.end - 1)->timestamp >= r.since)
+        {
+            heap.push(HeapItem(std::make_pair((r.end - 1)->timestamp, (r.end - 1)->offset), i));
+        }
+    }
+
+    std::vector<const PostEntry *> newest;
+    while (!heap.empty() && newest.size() < limit)
+    {
+        PostRange &r = ranges[heap.top().second];
+        heap.pop();
+        r.end--;
+        newest.push_back(r.end);
+
+        if (r.end > r.begin && (r.end - 1)->timestamp >= r.since)
+        {
+            heap.push(HeapItem(std::make_pair((r.end - 1)->timestamp, (r.end - 1)->offset), &r - &ranges[0]));
+        }
+    }
+    return newest;
+}
+
+class BinaryStorage : public Storage
+{
+    public:
+        BinaryStorage(const std::string &folder, size_t segment_bytes = 4 << 20)
+            : folder_(folder), segment_bytes_(segment_bytes)
+        {}
+
+        ~BinaryStorage()
+        {
+            if (committer_.joinable())
+            {
+                {
+                    std::lock_guard<std::mutex> lock(commit_mutex_);
+                    stop_ = true;
+                }
+                commit_cv_.notify_one();
+                committer_.join();
+            }
+            if (graph_fd_ >= 0)
+            {
+                close(graph_fd_);
+            }
+            if (active_fd_ >= 0)
+            {
+                close(active_fd_);
+            }
+        }
+
+        bool Exists() const override
+        {
+            return FileExists(IndexPath());
+        }
+
+        bool InitGraph() override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            graph_fd_ = open(GraphPath().c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+            if (graph_fd_ < 0)
+            {
+                std::cerr << "Could not open " << GraphPath() << ": " << strerror(errno) << std::endl;
+                return false;
+            }
+            struct stat st;
+            graph_bytes_ = fstat(graph_fd_, &st) == 0 ? st.st_size : 0;
+            return true;
+        }
+
+        bool Init() override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            graph_fd_ = OpenForAppend(GraphPath(), &graph_bytes_);
+            if (graph_fd_ < 0)
+            {
+                return false;
+            }
+
+            // Read the segment list, or start the first segment
+            std::string contents;
+            if (ReadFile(IndexPath(), &contents) && !index_.ParseFromString(contents))
+            {
+                std::cerr << "Corrupt index " << IndexPath() << std::endl;
+                return false;
+            }
+            if (index_.segments_size() == 0)
+            {
+                index_.add_segments()->set_name(SegmentName(1));
+                WriteIndex();
+            }
+
+            // Rebuild the active segment's counters and index from its contents
+            snsStorage::SegmentInfo *active = ActiveSegment();
+            uint64_t bytes = 0;
+            active_fd_ = OpenForAppend(SegmentPath(*active), &bytes);
+            if (active_fd_ < 0)
+            {
+                return false;
+            }
+            active->set_records(0);
+            active->set_bytes(0);
+
+            std::string data;
+            ReadFile(SegmentPath(*active), &data);
+            ReadRecords(data.data(), bytes, [this](const snsStorage::Record &record, size_t offset, size_t length)
+            {
+                IndexActive(record.post(), offset, length);
+                return true;
+            });
+            return true;
+        }
+
+        void LoadGraph(const UserVisitor &on_user, const FollowVisitor &on_follow) override
+        {
+            std::string contents;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                ReadFile(GraphPath(), &contents);
+            }
+
+            // Replay the log into the current graph, keeping creation order
+            std::vector<std::string> users;
+            std::unordered_map<std::string, std::vector<std::pair<std::string, int64_t>>> following;
+
+            ReadRecords(contents.data(), contents.size(), [&](const snsStorage::Record &record, size_t, size_t)
+            {
+                switch (record.op_case())
+                {
+                case snsStorage::Record::kUser:
+                    if (following.find(record.user().username()) == following.end())
+                    {
+                        users.push_back(record.user().username());
+                        following[record.user().username()];
+                    }
+                    break;
+                case snsStorage::Record::kFollow:
+                {
+                    const snsStorage::FollowRecord &f = record.follow();
+                    if (following.find(f.username()) == following.end())
+                    {
+                        users.push_back(f.username());
+                    }
+                    std::vector<std::pair<std::string, int64_t>> &edges = following[f.username()];
+                    RemoveEdge(edges, f.following());
+                    edges.push_back(std::make_pair(f.following(), f.timestamp()));
+                    break;
+                }
+                case snsStorage::Record::kUnfollow:
+                    RemoveEdge(following[record.unfollow().username()], record.unfollow().following());
+                    break;
+                default:
+                    break;
+                }
+                return true;
+            });
+
+            for (const std::string &u : users)
+            {
+                on_user(u);
+            }
+            for (const std::string &u : users)
+            {
+                for (const std::pair<std::string, int64_t> &edge : following[u])
+                {
+                    on_follow(u, edge.first, edge.second);
+                }
+            }
+        }
+
+        uint64_t GraphPosition() override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return graph_bytes_;
+        }
+
+        // Reads only the end of follow.seg, from *position on
+        bool LoadGraphChanges(uint64_t *position, const UserVisitor &on_user, const FollowVisitor &on_follow,
+                              const UnfollowVisitor &on_unfollow) override
+        {
+            std::string contents;
+            std::set<uint64_t> own;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                // Shorter than what was read - not the same log any more
+                if (!ReadFileFrom(GraphPath(), *position, &contents))
+                {
+                    return false;
+                }
+                own = own_graph_records_;
+            }
+
+            // A torn record at the end is read again next time
+            uint64_t start = *position;
+            *position += ReadRecords(contents.data(), contents.size(), [&](const snsStorage::Record &record, size_t offset, size_t)
+            {
+                if (own.count(start + offset) > 0)
+                {
+                    return true;
+                }
+                switch (record.op_case())
+                {
+                case snsStorage::Record::kUser:
+                    on_user(record.user().username());
+                    break;
+                case snsStorage::Record::kFollow:
+                    on_follow(record.follow().username(), record.follow().following(), record.follow().timestamp());
+                    break;
+                case snsStorage::Record::kUnfollow:
+                    on_unfollow(record.unfollow().username(), record.unfollow().following());
+                    break;
+                default:
+                    break;
+                }
+                return true;
+            });
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            own_graph_records_.erase(own_graph_records_.begin(), own_graph_records_.lower_bound(*position));
+            return true;
+        }
+
+        void CreateUser(const std::string &username) override
+        {
+            snsStorage::Record record;
+            record.mutable_user()->set_username(username);
+            AppendGraph(record);
+        }
+
+        void Follow(const std::string &username, const std::string &following, int64_t timestamp) override
+        {
+            snsStorage::Record record;
+            snsStorage::FollowRecord *f = record.mutable_follow();
+            f->set_username(username);
+            f->set_following(following);
+            f->set_timestamp(timestamp);
+            AppendGraph(record);
+        }
+
+        void Unfollow(const std::string &username, const std::string &following) override
+        {
+            snsStorage::Record record;
+            snsStorage::UnfollowRecord *f = record.mutable_unfollow();
+            f->set_username(username);
+            f->set_following(following);
+            AppendGraph(record);
+        }
+
+        bool AppendPost(const StoredPost &post) override
+        {
+            PendingPost pending;
+            snsStorage::PostRecord *p = pending.record.mutable_post();
+            p->set_username(post.username);
+            p->set_msg(post.msg);
+            p->set_timestamp(post.timestamp);
+            p->set_nanos(post.nanos);
+            p->set_sequence(post.sequence);
+            pending.buf = EncodeRecord(pending.record);
+
+            if (group_commit_)
+            {
+                return WaitForCommit(pending);
+            }
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!WriteAll(active_fd_, pending.buf.data(), pending.buf.size()))
+            {
+                std::cerr << "Post write failed: " << strerror(errno) << std::endl;
+                return false;
+            }
+            IndexActive(*p, ActiveSegment()->bytes(), pending.buf.size());
+
+            if (ActiveSegment()->bytes() >= segment_bytes_)
+            {
+                Roll();
+            }
+            return true;
+        }
+
+        // Call after Init and before the first AppendPost
+        bool EnableGroupCommit(size_t max_batch, int max_latency_us) override
+        {
+            if (max_batch == 0 || max_latency_us < 0 || !SyncFolder())
+            {
+                return false;
+            }
+            max_batch_ = max_batch;
+            max_latency_ = std::chrono::microseconds(max_latency_us);
+            group_commit_ = true;
+            committer_ = std::thread(&BinaryStorage::CommitLoop, this);
+            return true;
+        }
+
+        std::string CommitStats() override
+        {
+            if (!group_commit_)
+            {
+                return "";
+            }
+            std::lock_guard<std::mutex> lock(commit_mutex_);
+            return stats_.ToString();
+        }
+
+        void ScanPosts(const PostVisitor &visit) override
+        {
+            std::vector<std::shared_ptr<MappedSegment>> sealed;
+            std::vector<StoredPost> active;
+            Snapshot(&sealed, &active);
+
+            for (const std::shared_ptr<MappedSegment> &segment : sealed)
+            {
+                if (!segment)
+                {
+                    continue;
+                }
+                bool more = true;
+                ReadRecords(segment->Data(), segment->DataBytes(), [&](const snsStorage::Record &record, size_t, size_t)
+                {
+                    more = visit(ToStoredPost(record.post()));
+                    return more;
+                });
+                if (!more)
+                {
+                    return;
+                }
+            }
+            for (const StoredPost &post : active)
+            {
+                if (!visit(post))
+                {
+                    return;
+                }
+            }
+        }
+
+        void ScanPostsBackward(const PostVisitor &visit) override
+        {
+            std::vector<std::shared_ptr<MappedSegment>> sealed;
+            std::vector<StoredPost> active;
+            Snapshot(&sealed, &active);
+
+            for (auto it = active.rbegin(); it != active.rend(); it++)
+            {
+                if (!visit(*it))
+                {
+                    return;
+                }
+            }
+            for (auto it = sealed.rbegin(); it != sealed.rend(); it++)
+            {
+                if (!*it)
+                {
+                    continue;
+                }
+                const MappedSegment &segment = **it;
+                StoredPost post;
+                for (size_t i = segment.PostCount(); i > 0; i--)
+                {
+                    if (segment.ReadPost(segment.InFileOrder(i - 1), &post) && !visit(post))
+                    {
+                        return;
+                    }
+                }
+            }
+        }
+
+        // Walks segments newest first from the cursor's, using each one's
+        // author index to merge only the tail of every author's posts. A
+        // segment costs one binary search per author, then O(log authors)
+        // per post taken from it.
+        std::vector<StoredPost> PostsBefore(const AuthorSince &authors, const PostCursor &before,
+                                            size_t limit, PostCursor *next) override
+        {
+            std::vector<StoredPost> posts;
+            std::vector<std::shared_ptr<MappedSegment>> sealed;
+            std::vector<PostRange> ranges;
+            PostCursor last = before;
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                uint32_t active = index_.segments_size() - 1;
+                if (before.segment >= active)
+                {
+                    for (const auto &a : authors)
+                    {
+                        auto it = active_by_author_.find(a.first);
+                        if (it != active_by_author_.end())
+                        {
+                            PostRange r = {it->second.data(), it->second.data() + it->second.size(), a.second};
+                            ranges.push_back(TrimToCursor(r, active, before));
+                        }
+                    }
+                    for (const PostEntry *e : MergeNewest(ranges, limit))
+                    {
+                        StoredPost post;
+                        if (ReadActive(*e, &post))
+                        {
+                            posts.push_back(post);
+                            last = MakeCursor(active, *e);
+                        }
+                    }
+                }
+                sealed = SealedSegments();
+            }
+
+            size_t start = std::min<size_t>(sealed.size(), (size_t)before.segment + 1);
+            for (size_t n = start; n > 0 && posts.size() < limit; n--)
+            {
+                if (!sealed[n - 1])
+                {
+                    continue;
+                }
+                const MappedSegment &segment = *sealed[n - 1];
+                ranges.clear();
+                for (const auto &a : authors)
+                {
+                    PostRange r;
+                    r.since = a.second;
+                    if (segment.FindAuthor(a.first, &r.begin, &r.end))
+                    {
+                        ranges.push_back(TrimToCursor(r, n - 1, before));
+                    }
+                }
+                for (const PostEntry *e : MergeNewest(ranges, limit - posts.size()))
+                {
+                    StoredPost post;
+                    if (segment.ReadPost(*e, &post))
+                    {
+                        posts.push_back(post);
+                        last = MakeCursor(n - 1, *e);
+                    }
+                }
+            }
+
+            if (next != nullptr)
+            {
+                *next = last;
+            }
+            return posts;
+        }
+
+        std::string GraphPath() const override
+        {
+            return folder_ + "/follow.seg";
+        }
+
+    private:
+        std::string IndexPath() const
+        {
+            return folder_ + "/storage.idx";
+        }
+
+        static std::string SegmentName(int n)
+        {
+            char name[32];
+            snprintf(name, sizeof(name), "timeline-%06d.seg", n);
+            return name;
+        }
+
+        std::string SegmentPath(const snsStorage::SegmentInfo &info) const
+        {
+            return folder_ + "/" + info.name();
+        }
+
+        snsStorage::SegmentInfo *ActiveSegment()
+        {
+            return index_.mutable_segments(index_.segments_size() - 1);
+        }
+
+        // Add a post just written to the active segment - called with mutex_ held
+        void IndexActive(const snsStorage::PostRecord &post, uint64_t offset, size_t length)
+        {
+            IndexedPost p;
+            p.username = post.username();
+            p.entry.timestamp = post.timestamp();
+            p.entry.offset = offset;
+            p.entry.length = length;
+            p.entry.reserved = 0;
+            active_posts_.push_back(p);
+            active_by_author_[p.username].push_back(p.entry);
+
+            snsStorage::SegmentInfo *active = ActiveSegment();
+            if (active->records() == 0)
+            {
+                active->set_first_timestamp(post.timestamp());
+            }
+            active->set_last_timestamp(post.timestamp());
+            active->set_records(active->records() + 1);
+            active->set_bytes(offset + length);
+        }
+
+        // Read a post of the active segment - called with mutex_ held
+        bool ReadActive(const PostEntry &e, StoredPost *post)
+        {
+            std::string buf(e.length, '\0');
+            if (pread(active_fd_, &buf[0], e.length, e.offset) != (ssize_t)e.length)
+            {
+                return false;
+            }
+            return ParsePost(buf.data(), buf.size(), post);
+        }
+
+        // Map sealed segments on first use - called with mutex_ held. Entry i
+        // is segment i, or null if it could not be mapped.
+        std::vector<std::shared_ptr<MappedSegment>> SealedSegments()
+        {
+            std::vector<std::shared_ptr<MappedSegment>> sealed;
+            for (const snsStorage::SegmentInfo &info : index_.segments())
+            {
+                if (!info.sealed())
+                {
+                    continue;
+                }
+                std::shared_ptr<MappedSegment> &segment = mapped_[info.name()];
+                if (!segment)
+                {
+                    segment = MappedSegment::Open(SegmentPath(info), info.bytes());
+                }
+                sealed.push_back(segment);
+            }
+            return sealed;
+        }
+
+        static PostCursor MakeCursor(uint32_t segment, const PostEntry &e)
+        {
+            PostCursor cursor;
+            cursor.segment = segment;
+            cursor.timestamp = e.timestamp;
+            cursor.offset = e.offset;
+            return cursor;
+        }
+
+        // Drop the posts at or after the cursor from a range of segment n
+        static PostRange TrimToCursor(PostRange r, uint32_t n, const PostCursor &before)
+        {
+            if (n == before.segment)
+            {
+                r.end = std::lower_bound(r.begin, r.end, before, [](const PostEntry &e, const PostCursor &c)
+                {
+                    return e.timestamp < c.timestamp || (e.timestamp == c.timestamp && e.offset < c.offset);
+                });
+            }
+            return r;
+        }
+
+        // Sealed segments plus a copy of the active segment's posts
+        void Snapshot(std::vector<std::shared_ptr<MappedSegment>> *sealed, std::vector<StoredPost> *active)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            *sealed = SealedSegments();
+            for (const IndexedPost &p : active_posts_)
+            {
+                StoredPost post;
+                if (ReadActive(p.entry, &post))
+                {
+                    active->push_back(post);
+                }
+            }
+        }
+
+        static void RemoveEdge(std::vector<std::pair<std::string, int64_t>> &edges, const std::string &following)
+        {
+            for (size_t i = 0; i < edges.size(); i++)
+            {
+                if (edges[i].first == following)
+                {
+                    edges.erase(edges.begin() + i);
+                    return;
+                }
+            }
+        }
+
+        // Open a log for appending and cut off a torn record at the end
+        static int OpenForAppend(const std::string &path, uint64_t *bytes)
+        {
+            int fd = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+            if (fd < 0)
+            {
+                std::cerr << "Could not open " << path << ": " << strerror(errno) << std::endl;
+                return -1;
+            }
+
+            std::string contents;
+            ReadFile(path, &contents);
+            size_t good = ReadRecords(contents.data(), contents.size(),
+                                      [](const snsStorage::Record &, size_t, size_t) { return true; });
+            if (good < contents.size())
+            {
+                std::cerr << "Truncating torn record in " << path << std::endl;
+                if (ftruncate(fd, good) != 0)
+                {
+                    std::cerr << "Truncate failed: " << strerror(errno) << std::endl;
+                }
+            }
+            *bytes = good;
+            return fd;
+        }
+
+        void AppendGraph(const snsStorage::Record &record)
+        {
+            std::string buf = EncodeRecord(record);
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!WriteAll(graph_fd_, buf.data(), buf.size()))
+            {
+                std::cerr << "Graph write failed: " << strerror(errno) << std::endl;
+                return;
+            }
+            graph_bytes_ += buf.size();
+
+            // Other processes append to the file too, so where the record
+            // went is only known from the offset the write left
+            off_t end = lseek(graph_fd_, 0, SEEK_CUR);
+            if (end >= (off_t)buf.size())
+            {
+                own_graph_records_.insert(end - buf.size());
+            }
+        }
+
+        // Write the index next to the real one and rename it over
+        void WriteIndex()
+        {
+            std::string tmp = IndexPath() + ".tmp";
+            std::ofstream ofs(tmp, std::ios::binary | std::ios::trunc);
+            index_.SerializeToOstream(&ofs);
+            ofs.close();
+            if (rename(tmp.c_str(), IndexPath().c_str()) != 0)
+            {
+                std::cerr << "Index update failed: " << strerror(errno) << std::endl;
+            }
+        }
+
+        // ------------------------------------------------------------
+        // Group commit
+        //
+        // AppendPost queues the encoded post and sleeps. CommitLoop takes
+        // everything queued, writes it with one write and one fdatasync, and
+        // then wakes the posters. Posts that queue up during an fdatasync go
+        // out together in the next batch, so the cost of a sync is shared by
+        // however many posts arrived while waiting for it.
+        // ------------------------------------------------------------
+
+        struct PendingPost
+        {
+            snsStorage::Record record;
+            std::string buf;
+        };
+
+        bool WaitForCommit(const PendingPost &pending)
+        {
+            std::unique_lock<std::mutex> lock(commit_mutex_);
+            if (failed_)
+            {
+                return false;
+            }
+            if (queue_.empty())
+            {
+                queue_start_ = std::chrono::steady_clock::now();
+            }
+            queue_.push_back(pending);
+            uint64_t ticket = ++queued_;
+            if (queue_.size() == 1 || queue_.size() >= max_batch_)
+            {
+                commit_cv_.notify_one();
+            }
+
+            durable_cv_.wait(lock, [this, ticket] { return committed_ >= ticket || failed_; });
+            return committed_ >= ticket;
+        }
+
+        void CommitLoop()
+        {
+            std::unique_lock<std::mutex> lock(commit_mutex_);
+            while (true)
+            {
+                commit_cv_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+                if (queue_.empty())
+                {
+                    break;
+                }
+
+                // Give more posts up to max_latency_ to join the batch
+                commit_cv_.wait_until(lock, queue_start_ + max_latency_,
+                                      [this] { return stop_ || queue_.size() >= max_batch_; });
+
+                std::vector<PendingPost> batch;
+                size_t n = std::min(queue_.size(), max_batch_);
+                batch.assign(std::make_move_iterator(queue_.begin()), std::make_move_iterator(queue_.begin() + n));
+                queue_.erase(queue_.begin(), queue_.begin() + n);
+                queue_start_ = std::chrono::steady_clock::now();
+
+                lock.unlock();
+                auto start = std::chrono::steady_clock::now();
+                bool ok = Commit(batch);
+                uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - start).count();
+                lock.lock();
+
+                if (ok)
+                {
+                    committed_ += batch.size();
+                    stats_.Add(batch.size(), us);
+                }
+                else
+                {
+                    // After a failed fdatasync the kernel may have dropped the
+                    // dirty pages, so nothing written since the last good sync
+                    // can be trusted. Fail this batch and every later post.
+                    failed_ = true;
+                    stats_.failed += batch.size() + queue_.size();
+                    queue_.clear();
+                }
+                durable_cv_.notify_all();
+            }
+        }
+
+        // Write and sync one batch - only CommitLoop writes posts once group
+        // commit is on, so active_fd_ can be used without mutex_ until Roll
+        bool Commit(const std::vector<PendingPost> &batch)
+        {
+            std::string buf;
+            for (const PendingPost &p : batch)
+            {
+                buf += p.buf;
+            }
+            if (!WriteAll(active_fd_, buf.data(), buf.size()) || fdatasync(active_fd_) != 0)
+            {
+                std::cerr << "Group commit failed: " << strerror(errno) << std::endl;
+                return false;
+            }
+
+            // Make the posts visible to readers
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (const PendingPost &p : batch)
+            {
+                IndexActive(p.record.post(), ActiveSegment()->bytes(), p.buf.size());
+            }
+            if (ActiveSegment()->bytes() >= segment_bytes_)
+            {
+                Roll();
+            }
+            return true;
+        }
+
+        // fsync the folder so newly created segment files survive a crash
+        bool SyncFolder()
+        {
+            int fd = open(folder_.c_str(), O_RDONLY);
+            if (fd < 0)
+            {
+                std::cerr << "Could not open " << folder_ << ": " << strerror(errno) << std::endl;
+                return false;
+            }
+            bool ok = fsync(fd) == 0;
+            close(fd);
+            return ok;
+        }
+
+        // Seal the active segment with its footer and start the next one -
+        // called with mutex_ held. If we crash before the index is rewritten,
+        // the footer is cut off as a torn record and written again later.
+        void Roll()
+        {
+            snsStorage::SegmentInfo *active = ActiveSegment();
+            std::string footer = BuildFooter(active_posts_, active->bytes());
+            if (!WriteAll(active_fd_, footer.data(), footer.size()))
+            {
+                std::cerr << "Footer write failed: " << strerror(errno) << std::endl;
+                return;
+            }
+
+            active->set_sealed(true);
+            snsStorage::SegmentInfo *next = index_.add_segments();
+            next->set_name(SegmentName(index_.segments_size()));
+            WriteIndex();
+
+            close(active_fd_);
+            active_posts_.clear();
+            active_by_author_.clear();
+            uint64_t bytes = 0;
+            active_fd_ = OpenForAppend(SegmentPath(*next), &bytes);
+            if (group_commit_)
+            {
+                SyncFolder();
+            }
+        }
+
+        std::string folder_;
+        size_t segment_bytes_;
+        std::mutex mutex_;
+        snsStorage::Index index_;
+        int graph_fd_ = -1;
+        uint64_t graph_bytes_ = 0;
+        // Offsets of graph records this process appended that
+        // LoadGraphChanges has not passed yet
+        std::set<uint64_t> own_graph_records_;
+
+        // Segment being appended to, indexed in memory until it is sealed
+        int active_fd_ = -1;
+        std::vector<IndexedPost> active_posts_;
+        std::unordered_map<std::string, std::vector<PostEntry>> active_by_author_;
+
+        std::map<std::string, std::shared_ptr<MappedSegment>> mapped_;
+
+        // Group commit - all guarded by commit_mutex_ except the settings
+        bool group_commit_ = false;
+        size_t max_batch_ = 0;
+        std::chrono::microseconds max_latency_{0};
+        std::mutex commit_mutex_;
+        std::condition_variable commit_cv_;  // wakes CommitLoop
+        std::condition_variable durable_cv_; // wakes posters after a commit
+        std::vector<PendingPost> queue_;
+        std::chrono::steady_clock::time_point queue_start_;
+        uint64_t queued_ = 0;
+        uint64_t committed_ = 0;
+        bool failed_ = false;
+        bool stop_ = false;
+        GroupCommitStats stats_;
+        std::thread committer_;
+};
+
+// kind is "json" or "binary" - returns nullptr for anything else
+inline Storage *MakeStorage(const std::string &kind, const std::string &folder,
+                            const std::string &follow_file, const std::string &timeline_file)
+{
+    if (kind == "json")
+    {
+        return new JsonStorage(folder + "/" + follow_file, folder + "/" + timeline_file);
+    }
+    if (kind == "binary")
+    {
+        return new BinaryStorage(folder);
+    }
+    return nullptr;
+}
+
+#endif
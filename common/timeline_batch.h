@@ -0,0 +1,159 @@
+#ifndef TIMELINE_BATCH_H
+#define TIMELINE_BATCH_H
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <unordered_map>
+#include <vector>
+
+#include "sns.pb.h"
+
+/*
+ * Helpers for the TimelineBatch RPC.
+ *
+ * A MessageBatch carries several posts in one stream write. Usernames are
+ * sent once per stream (BatchAuthor) and posts refer to them by id, and each
+ * post time is stored as a delta from the previous one so it fits in a small
+ * varint. The encoder/decoder pair keeps the author table for one stream, so
+ * use one of each per stream.
+ */
+
+// Copy a post field by field. CopyFrom() clears to first, which frees its
+// Timestamp - this keeps it, and reuses the string buffers, so copying into
+// a Message that has held a post before does not allocate. Keep in step with
+// the fields of Message.
+inline void CopyPost(const csce438::Message& from, csce438::Message* to)
+{
+    to->set_username(from.username());
+    to->set_msg(from.msg());
+    to->mutable_timestamp()->set_seconds(from.timestamp().seconds());
+    to->mutable_timestamp()->set_nanos(from.timestamp().nanos());
+    to->set_sequence(from.sequence());
+}
+
+// A list of posts that keeps its Messages across Clear() for the next Add().
+// A queue that is filled and drained over and over stops allocating once it
+// has held its largest batch.
+class MessageList
+{
+    public:
+        void Add(const csce438::Message& m)
+        {
+            if (size_ == items_.size()) {
+                items_.emplace_back();
+            }
+            CopyPost(m, &items_[size_++]);
+        }
+
+        void Clear() { size_ = 0; }
+        bool empty() const { return size_ == 0; }
+        size_t size() const { return size_; }
+        void Swap(MessageList* other)
+        {
+            items_.swap(other->items_);
+            std::swap(size_, other->size_);
+        }
+
+        std::vector<csce438::Message>::iterator begin() { return items_.begin(); }
+        std::vector<csce438::Message>::iterator end() { return items_.begin() + size_; }
+        std::vector<csce438::Message>::const_iterator begin() const { return items_.begin(); }
+        std::vector<csce438::Message>::const_iterator end() const { return items_.begin() + size_; }
+
+    private:
+        std::vector<csce438::Message> items_;
+        size_t size_ = 0;
+};
+
+inline int64_t TimestampToNanos(const google::protobuf::Timestamp& t)
+{
+    return t.seconds() * 1000000000LL + t.nanos();
+}
+
+inline void NanosToTimestamp(int64_t nanos, google::protobuf::Timestamp* t)
+{
+    t->set_seconds(nanos / 1000000000LL);
+    t->set_nanos(nanos % 1000000000LL);
+}
+
+class BatchEncoder
+{
+    public:
+        // Append a post to the frame being built
+        void Add(const std::string& username, const std::string& msg,
+                 int64_t nanos, uint64_t sequence, csce438::MessageBatch* batch)
+        {
+            csce438::BatchPost* post = batch->add_posts();
+            post->set_author(AuthorId(username, batch));
+            post->set_msg(msg);
+            post->set_sequence(sequence);
+
+            if (batch->posts_size() == 1) {
+                batch->set_base_time(nanos);
+                post->set_time_delta(0);
+            }
+            else {
+                post->set_time_delta(nanos - last_nanos_);
+            }
+            last_nanos_ = nanos;
+        }
+
+        void Add(const csce438::Message& m, csce438::MessageBatch* batch)
+        {
+            Add(m.username(), m.msg(), TimestampToNanos(m.timestamp()), m.sequence(), batch);
+        }
+
+    private:
+        uint32_t AuthorId(const std::string& username, csce438::MessageBatch* batch)
+        {
+            auto it = ids_.find(username);
+            if (it != ids_.end()) {
+                return it->second;
+            }
+
+            // New author on this stream - introduce it in this frame
+            uint32_t id = ids_.size();
+            ids_[username] = id;
+            csce438::BatchAuthor* author = batch->add_authors();
+            author->set_id(id);
+            author->set_username(username);
+            return id;
+        }
+
+        std::unordered_map<std::string, uint32_t> ids_;
+        int64_t last_nanos_ = 0;
+};
+
+class BatchDecoder
+{
+    public:
+        // Expand a frame back into per-post messages
+        void Decode(const csce438::MessageBatch& batch, std::vector<csce438::Message>* out)
+        {
+            for (const csce438::BatchAuthor& a : batch.authors()) {
+                if (a.id() >= names_.size()) {
+                    names_.resize(a.id() + 1);
+                }
+                names_[a.id()] = a.username();
+            }
+
+            int64_t nanos = batch.base_time();
+            for (const csce438::BatchPost& p : batch.posts()) {
+                nanos += p.time_delta();
+
+                csce438::Message m;
+                if (p.author() < names_.size()) {
+                    m.set_username(names_[p.author()]);
+                }
+                m.set_msg(p.msg());
+                m.set_sequence(p.sequence());
+                NanosToTimestamp(nanos, m.mutable_timestamp());
+                out->push_back(m);
+            }
+        }
+
+    private:
+        std::vector<std::string> names_;
+};
+
+#endif
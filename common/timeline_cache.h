@@ -0,0 +1,174 @@
+#ifndef TIMELINE_CACHE_H
+#define TIMELINE_CACHE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "sns.pb.h"
+
+/*
+ * Client-side timeline cache.
+ *
+ * Every post the server sends a client in timeline mode is appended to a
+ * file as a length-prefixed Message. The next time the client enters
+ * timeline mode it shows the cached posts straight away and sends a
+ * ResumeVector with INIT, so the server only sends what it missed.
+ *
+ * The vector has the newest sequence cached from each author - the server
+ * resumes each of them right after it - and the time of the oldest cached
+ * post, which is where authors with nothing cached start. The client's own
+ * posts are resumed the same way: they are not cached as they are typed,
+ * since only the server numbers them, but come back numbered with the next
+ * INIT. Posts already in the cache are not added again, so nothing is
+ * shown twice.
+ * The file is rewritten with the newest cache_limit posts once it holds
+ * twice that many.
+ */
+
+class TimelineCache
+{
+    public:
+        static const size_t cache_limit = 100;
+
+        explicit TimelineCache(const std::string& path)
+            : path_(path)
+        {}
+
+        // Read the file and return the cached posts, oldest first. A torn
+        // last record (the client died mid-write) is dropped.
+        const std::vector<csce438::Message>& Load()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            posts_.clear();
+            seen_.clear();
+
+            std::ifstream in(path_, std::ios::binary);
+            uint32_t size;
+            std::string record;
+            bool torn = false;
+            while (in.read((char*)&size, sizeof(size))) {
+                record.resize(size);
+                csce438::Message m;
+                if (!in.read(&record[0], size) || !m.ParseFromString(record)) {
+                    torn = true;
+                    break;
+                }
+                posts_.push_back(m);
+                Seen(m);
+            }
+            in.close();
+
+            if (torn || posts_.size() > cache_limit) {
+                Rewrite();
+            }
+            return posts_;
+        }
+
+        // Fill in where the cache ends. False if it is empty - the server
+        // then sends its full INIT history.
+        bool Resume(csce438::ResumeVector* resume)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (posts_.empty()) {
+                return false;
+            }
+
+            std::map<std::string, const csce438::Message*> newest;
+            int64_t since = posts_.front().timestamp().seconds();
+            for (const csce438::Message& m : posts_) {
+                since = std::min(since, m.timestamp().seconds());
+                if (m.sequence() == 0) {
+                    continue;
+                }
+                const csce438::Message*& n = newest[m.username()];
+                if (n == 0 || m.sequence() > n->sequence()) {
+                    n = &m;
+                }
+            }
+
+            resume->set_since(since);
+            for (const auto& n : newest) {
+                csce438::ResumePoint* point = resume->add_authors();
+                point->set_author(n.first);
+                point->set_sequence(n.second->sequence());
+                point->set_timestamp(n.second->timestamp().seconds());
+            }
+            return true;
+        }
+
+        // Append a post, false if it is already cached. Safe to call from
+        // the reader and writer threads.
+        bool Add(const csce438::Message& m)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!Seen(m)) {
+                return false;
+            }
+            posts_.push_back(m);
+            if (posts_.size() >= 2 * cache_limit) {
+                Rewrite();
+                return true;
+            }
+
+            std::string record;
+            m.SerializeToString(&record);
+            uint32_t size = record.size();
+            std::ofstream out(path_, std::ios::binary | std::ios::app);
+            out.write((const char*)&size, sizeof(size));
+            out.write(record.data(), record.size());
+            return true;
+        }
+
+    private:
+        // Keep the newest cache_limit posts - write a new file and rename
+        // it over the old one, so a crash leaves one or the other
+        void Rewrite()
+        {
+            if (posts_.size() > cache_limit) {
+                posts_.erase(posts_.begin(), posts_.end() - cache_limit);
+                seen_.clear();
+                for (const csce438::Message& m : posts_) {
+                    Seen(m);
+                }
+            }
+
+            std::string tmp = path_ + ".tmp";
+            std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+            std::string record;
+            for (const csce438::Message& m : posts_) {
+                m.SerializeToString(&record);
+                uint32_t size = record.size();
+                out.write((const char*)&size, sizeof(size));
+                out.write(record.data(), record.size());
+            }
+            out.close();
+            if (out) {
+                std::rename(tmp.c_str(), path_.c_str());
+            }
+        }
+
+        std::string path_;
+        std::mutex mutex_;
+        std::vector<csce438::Message> posts_;
+        std::set<std::pair<std::string, uint64_t>> seen_;
+
+        // Note a post's author and sequence, false if already noted. Posts
+        // without a sequence (cached by older clients) are always new.
+        bool Seen(const csce438::Message& m)
+        {
+            if (m.sequence() == 0) {
+                return true;
+            }
+            return seen_.insert(std::make_pair(m.username(), m.sequence())).second;
+        }
+};
+
+#endif
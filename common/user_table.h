@@ -0,0 +1,78 @@
+#ifndef USER_TABLE_H
+#define USER_TABLE_H
+
+#include <atomic>
+#include <cstddef>
+#include <stdexcept>
+
+/*
+ * Append only table that never moves what it holds.
+ *
+ * Entries live in fixed size chunks found through a directory that is
+ * allocated up front, so appending only ever fills in a new chunk and never
+ * copies the old ones. One thread at a time may append (the servers do it
+ * under user_index_mutex); any number may read at the same time without a
+ * lock. size() is published after the entry is written, so every index below
+ * it, or handed out by an index built under the appender's lock, is safe to
+ * read.
+ */
+
+template <typename T>
+class AppendTable
+{
+    public:
+        static const size_t chunk_size = 4096;
+        static const size_t max_chunks = 4096;
+
+        AppendTable() : size_(0)
+        {
+            for (size_t i = 0; i < max_chunks; i++)
+            {
+                chunks_[i].store(nullptr, std::memory_order_relaxed);
+            }
+        }
+
+        ~AppendTable()
+        {
+            for (size_t i = 0; i < max_chunks; i++)
+            {
+                delete[] chunks_[i].load(std::memory_order_relaxed);
+            }
+        }
+
+        AppendTable(const AppendTable &) = delete;
+        AppendTable &operator=(const AppendTable &) = delete;
+
+        size_t size() const
+        {
+            return size_.load(std::memory_order_acquire);
+        }
+
+        T operator[](size_t index) const
+        {
+            return chunks_[index / chunk_size].load(std::memory_order_acquire)[index % chunk_size];
+        }
+
+        void push_back(const T &value)
+        {
+            size_t index = size_.load(std::memory_order_relaxed);
+            if (index >= chunk_size * max_chunks)
+            {
+                throw std::length_error("AppendTable is full");
+            }
+            T *chunk = chunks_[index / chunk_size].load(std::memory_order_relaxed);
+            if (chunk == nullptr)
+            {
+                chunk = new T[chunk_size];
+                chunks_[index / chunk_size].store(chunk, std::memory_order_release);
+            }
+            chunk[index % chunk_size] = value;
+            size_.store(index + 1, std::memory_order_release);
+        }
+
+    private:
+        std::atomic<T *> chunks_[max_chunks];
+        std::atomic<size_t> size_;
+};
+
+#endif